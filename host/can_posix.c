@@ -0,0 +1,257 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "can_id.h"
+#include "can_vehiclebus.h"
+#include "elm_port.h"
+#include "host.h"
+
+// host side of the CAN bus: known IDs as in main/can.c, frames raised by the
+// session replay instead of the CAN driver
+
+static const char* TAG = "can-host";
+
+#define CAN_MAX_CB 10
+
+struct elm_port_source_s {
+    can_message_timestamp_t* item;
+    size_t count;
+    size_t head;
+    size_t len;
+    void* task; // notified on each frame
+    bool enabled;
+};
+
+static const uint32_t can_id[] = VEHICLEBUS_ID;
+static const int can_id_count = sizeof(can_id) / sizeof(*can_id);
+static uint32_t can_id_seen_us[sizeof(can_id) / sizeof(*can_id)] = {0};
+static uint32_t can_id_period_us[sizeof(can_id) / sizeof(*can_id)] = {0}; // native bus period, filtered
+static uint8_t can_id_dlc[sizeof(can_id) / sizeof(*can_id)] = {0};
+static can_message_timestamp_t can_id_latest[sizeof(can_id) / sizeof(*can_id)] = {0};
+static uint32_t can_id_data_gen[sizeof(can_id) / sizeof(*can_id)] = {0};
+static elm_port_source_t* can_source[CAN_MAX_CB];
+static uint32_t can_seq;
+
+// -----------------------------  known IDs  -----------------------------
+
+int can_id_index(uint32_t id)
+{
+    int lo = 0;
+    int hi = can_id_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (can_id[mid] == id) return mid;
+        if (can_id[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+int can_id_get_count()
+{
+    return can_id_count;
+}
+
+uint32_t can_id_get(int index)
+{
+    if (index < 0 || index >= can_id_count) return 0;
+    return can_id[index];
+}
+
+bool can_id_stat(int index, uint32_t* period_us, uint8_t* dlc)
+{
+    if (index < 0 || index >= can_id_count) return false;
+    host_lock();
+    bool seen = can_id_period_us[index] != 0;
+    *period_us = can_id_period_us[index];
+    *dlc = can_id_dlc[index];
+    host_unlock();
+    return seen;
+}
+
+bool can_id_latest_get(uint32_t id, can_message_timestamp_t* msg)
+{
+    int i = can_id_index(id);
+    if (i < 0) return false;
+    host_lock();
+    *msg = can_id_latest[i];
+    host_unlock();
+    return msg->timestamp != 0;
+}
+
+uint32_t can_id_gen(int index)
+{
+    if (index < 0 || index >= can_id_count) return 0;
+    host_lock();
+    uint32_t gen = can_id_data_gen[index];
+    host_unlock();
+    return gen;
+}
+
+static void _can_id_seen(int i, const can_message_timestamp_t* msg)
+{
+    uint32_t period = (uint32_t)msg->timestamp - can_id_seen_us[i];
+    if (can_id_seen_us[i] != 0 && period < 10 * 1000000) {
+        if (can_id_period_us[i] == 0)
+            can_id_period_us[i] = period;
+        else
+            can_id_period_us[i] = (can_id_period_us[i] * 7 + period) / 8;
+    }
+    can_id_seen_us[i] = msg->timestamp;
+    can_id_dlc[i] = msg->msg.data_length_code;
+    const can_message_t* last = &can_id_latest[i].msg;
+    if (can_id_latest[i].timestamp == 0 || last->data_length_code != msg->msg.data_length_code || memcmp(last->data, msg->msg.data, sizeof(msg->msg.data)) != 0)
+        can_id_data_gen[i]++;
+    can_id_latest[i] = *msg;
+}
+
+// -----------------------------  raise  -----------------------------
+
+bool host_can_raise(const can_message_t* frame)
+{
+    int i = can_id_index(frame->identifier);
+    if (i < 0) return false;
+
+    can_message_timestamp_t msg = {.msg = *frame, .timestamp = elm_port_time_us()};
+    host_lock();
+    msg.seq = ++can_seq;
+    if (msg.seq == 0) msg.seq = ++can_seq; // 0 is never a valid seq
+    _can_id_seen(i, &msg);
+    for (int s = 0; s < CAN_MAX_CB; s++) {
+        // no loss on the host, wait for the reader
+        while (can_source[s] && can_source[s]->enabled && can_source[s]->len == can_source[s]->count)
+            host_wait(10);
+        elm_port_source_t* src = can_source[s];
+        if (src == NULL || !src->enabled) continue;
+        src->item[(src->head + src->len) % src->count] = msg;
+        src->len++;
+        host_task_notify(src->task);
+    }
+    host_signal();
+    host_unlock();
+    return true;
+}
+
+void host_can_reset()
+{
+    memset(can_id_seen_us, 0, sizeof(can_id_seen_us));
+    memset(can_id_period_us, 0, sizeof(can_id_period_us));
+    memset(can_id_dlc, 0, sizeof(can_id_dlc));
+    memset(can_id_latest, 0, sizeof(can_id_latest));
+    can_seq = 0;
+}
+
+int host_can_sources()
+{
+    int n = 0;
+    host_lock();
+    for (int s = 0; s < CAN_MAX_CB; s++) {
+        if (can_source[s]) n++;
+    }
+    host_unlock();
+    return n;
+}
+
+// -----------------------------  source  -----------------------------
+
+elm_port_source_t* elm_port_source_new(size_t count)
+{
+    elm_port_source_t* src = calloc(1, sizeof(elm_port_source_t));
+    if (src == NULL) return NULL;
+    src->item = calloc(count, sizeof(can_message_timestamp_t));
+    src->count = count;
+    src->task = elm_port_task_self();
+    src->enabled = true;
+    if (src->item == NULL) {
+        free(src);
+        return NULL;
+    }
+    host_lock();
+    for (int s = 0; s < CAN_MAX_CB; s++) {
+        if (can_source[s] == NULL) {
+            can_source[s] = src;
+            host_signal();
+            host_unlock();
+            return src;
+        }
+    }
+    host_unlock();
+    ESP_LOGE(TAG, "no free source");
+    free(src->item);
+    free(src);
+    return NULL;
+}
+
+void elm_port_source_del(elm_port_source_t* src)
+{
+    if (src == NULL) return;
+    host_lock();
+    for (int s = 0; s < CAN_MAX_CB; s++) {
+        if (can_source[s] == src) can_source[s] = NULL;
+    }
+    host_signal();
+    host_unlock();
+    free(src->item);
+    free(src);
+}
+
+// the host raises every frame, the sessions plan their rate on it
+void elm_port_source_planned(elm_port_source_t* src, bool planned)
+{
+}
+
+void elm_port_source_enable(elm_port_source_t* src, bool enable)
+{
+    host_lock();
+    if (enable && !src->enabled) {
+        src->head = 0;
+        src->len = 0;
+    }
+    src->enabled = enable;
+    host_signal();
+    host_unlock();
+}
+
+bool elm_port_source_receive(elm_port_source_t* src, can_message_timestamp_t* msg, uint32_t timeout_ms)
+{
+    // virtual time only passes by the session, do not wait for it
+    if (host_clock_is_virtual()) timeout_ms = 0;
+    uint64_t end_us = elm_port_time_us() + (uint64_t)timeout_ms * 1000;
+
+    host_lock();
+    while (src->len == 0) {
+        uint64_t us = host_time_us();
+        if (us >= end_us) break;
+        host_wait((end_us - us) / 1000 + 1);
+    }
+    bool rx = src->len > 0;
+    if (rx) {
+        *msg = src->item[src->head];
+        src->head = (src->head + 1) % src->count;
+        src->len--;
+        host_signal();
+    }
+    host_unlock();
+    return rx;
+}
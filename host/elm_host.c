@@ -0,0 +1,680 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "elm.h"
+#include "host.h"
+
+// replay recorded sessions against the elm core, check the output and
+// measure the command and monitor rates
+//
+// session file, one step per line:
+//   > CMD          command sent by the client
+//   = \xE7\xE7     bytes sent by the client, C escapes, no \r added
+//   F 132 04 89 .. frame on the bus: ID and data bytes
+//   W 20           virtual time passes, ms
+//   @ [C0FFEF]     the client disconnects and connects again, the store
+//                  (client cache) is kept; another peer address, hexa
+//   < text         output expected after the step above, C escapes (\r \n \\ \xHH)
+//   B cpu 1.5      budget: mean cpu time of a replay, ms
+//   B latency 0.5  budget: wall time from a command to its response, ms, the
+//                  slowest command of its median over the runs
+//   B toggle 0.05  budget: mean cpu time from a command stopping a monitor
+//                  to its response, ms, a monitor command restarts it at once
+//   # comment
+//
+// the output of back to back frames is expected after the last one, the
+// output at the end of the session (EOF) is not checked
+
+#define HOST_IDLE_TIMEOUT_MS 5000
+#define HOST_PEER 0x00000000C0FFEEULL
+#define HOST_LINE_LEN 256
+#define HOST_RUNS_MAX 100
+
+typedef enum {
+    HOST_STEP_CONNECT,
+    HOST_STEP_CMD,
+    HOST_STEP_FRAME,
+    HOST_STEP_WAIT,
+} host_step_type_t;
+
+typedef struct {
+    host_step_type_t type;
+    int line;          // line in the session file
+    char* cmd;         // HOST_STEP_CMD
+    char* raw;         // HOST_STEP_CMD bytes without \r, NULL for cmd
+    size_t raw_len;
+    can_message_t msg; // HOST_STEP_FRAME
+    uint32_t ms;       // HOST_STEP_WAIT
+    uint64_t peer;     // HOST_STEP_CONNECT
+    char* expect;      // expected output, NULL if none
+    size_t expect_len;
+    char* out; // recorded output
+    size_t out_len;
+} host_step_t;
+
+typedef struct {
+    const char* name;
+    char** lines;
+    int line_count;
+    host_step_t* step;
+    int step_count;
+    double budget_cpu_ms;     // 0 if none
+    double budget_latency_ms; // 0 if none
+    double budget_toggle_ms;  // 0 if none
+} host_script_t;
+
+typedef struct {
+    uint32_t id;
+    bool closed;
+    // output
+    FILE* out;
+    char* out_buf;
+    size_t out_len;
+    size_t out_size;
+    size_t out_mark; // output already checked
+    // input the session did not take yet, pushed again on rx_resume
+    const char* in;
+    size_t in_len;
+} host_session_t;
+
+static pthread_mutex_t host_in_mux = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    uint32_t runs;
+    uint32_t cmds;
+    uint32_t frames;
+    uint64_t cmd_us;   // wall time from a command to idle
+    uint64_t frame_us; // wall time from a frame to idle
+    uint64_t latency_max_us;
+    uint64_t* cmd_latency_us; // by step then run
+    uint32_t toggles;         // commands sent while monitoring
+    uint64_t toggle_us;
+    uint64_t toggle_max_us;
+    uint64_t toggle_cpu_us;
+    uint64_t wall_us;
+    uint64_t cpu_us;
+    size_t out_len;
+    uint32_t mismatch;
+} host_stat_t;
+
+typedef enum {
+    HOST_MODE_BENCH,
+    HOST_MODE_CHECK,
+    HOST_MODE_RECORD,
+} host_mode_t;
+
+static host_mode_t host_mode = HOST_MODE_BENCH;
+
+static uint64_t host_now_us(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// -----------------------------  escape  -----------------------------
+
+static void host_escape(FILE* f, const char* buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = buf[i];
+        if (c == '\r')
+            fputs("\\r", f);
+        else if (c == '\n')
+            fputs("\\n", f);
+        else if (c == '\\')
+            fputs("\\\\", f);
+        else if (c < ' ' || c >= 0x7f)
+            fprintf(f, "\\x%02X", c);
+        else
+            fputc(c, f);
+    }
+}
+
+// unescape str in place, return the length
+static size_t host_unescape(char* str)
+{
+    char* out = str;
+    for (char* p = str; *p; p++) {
+        if (*p != '\\' || p[1] == 0) {
+            *out++ = *p;
+            continue;
+        }
+        p++;
+        if (*p == 'r')
+            *out++ = '\r';
+        else if (*p == 'n')
+            *out++ = '\n';
+        else if (*p == 'x' && isxdigit((uint8_t)p[1]) && isxdigit((uint8_t)p[2])) {
+            char hex[3] = {p[1], p[2], 0};
+            *out++ = strtoul(hex, NULL, 16);
+            p += 2;
+        }
+        else
+            *out++ = *p;
+    }
+    return out - str;
+}
+
+// -----------------------------  session link  -----------------------------
+
+static void host_link_close(const elm_link_t* link)
+{
+    host_session_t* s = link->ctx;
+    host_lock();
+    s->closed = true;
+    host_signal();
+    host_unlock();
+}
+
+// the worker resumes with host_in_mux taken first, elm_session_push
+// takes the port lock then the host lock to notify
+static void host_push(host_session_t* s, const char* buf, size_t len)
+{
+    pthread_mutex_lock(&host_in_mux);
+    size_t rest = elm_session_push(s->id, buf, len);
+    s->in = buf + len - rest;
+    s->in_len = rest;
+    pthread_mutex_unlock(&host_in_mux);
+}
+
+static void host_link_rx_resume(void* ctx)
+{
+    host_session_t* s = ctx;
+    pthread_mutex_lock(&host_in_mux);
+    if (s->in_len) {
+        size_t rest = elm_session_push(s->id, s->in, s->in_len);
+        s->in += s->in_len - rest;
+        s->in_len = rest;
+    }
+    pthread_mutex_unlock(&host_in_mux);
+}
+
+static ssize_t host_out_write(void* cookie, const char* buf, size_t size)
+{
+    host_session_t* s = cookie;
+    host_lock();
+    if (s->out_len + size > s->out_size) {
+        size_t out_size = (s->out_len + size) * 2;
+        char* out_buf = realloc(s->out_buf, out_size);
+        if (out_buf == NULL) {
+            host_unlock();
+            return -1;
+        }
+        s->out_buf = out_buf;
+        s->out_size = out_size;
+    }
+    memcpy(s->out_buf + s->out_len, buf, size);
+    s->out_len += size;
+    host_unlock();
+    return size;
+}
+
+// -----------------------------  script  -----------------------------
+
+static bool host_parse_frame(const char* line, can_message_t* msg)
+{
+    char* end;
+    memset(msg, 0, sizeof(*msg));
+    msg->identifier = strtoul(line, &end, 16);
+    if (end == line) return false;
+    while (*end) {
+        const char* p = end;
+        uint32_t b = strtoul(p, &end, 16);
+        if (end == p) break;
+        if (msg->data_length_code >= 8 || b > 0xff) return false;
+        msg->data[msg->data_length_code++] = b;
+    }
+    return true;
+}
+
+static void host_script_free(host_script_t* script)
+{
+    for (int i = 0; i < script->step_count; i++) {
+        free(script->step[i].raw);
+        free(script->step[i].expect);
+        free(script->step[i].out);
+    }
+    for (int i = 0; i < script->line_count; i++)
+        free(script->lines[i]);
+    free(script->step);
+    free(script->lines);
+}
+
+static bool host_script_load(const char* name, host_script_t* script)
+{
+    memset(script, 0, sizeof(*script));
+    script->name = name;
+    FILE* f = fopen(name, "r");
+    if (f == NULL) {
+        perror(name);
+        return false;
+    }
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &size, f)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = 0;
+        script->lines = realloc(script->lines, (script->line_count + 1) * sizeof(char*));
+        script->lines[script->line_count++] = strdup(line);
+    }
+    free(line);
+    fclose(f);
+
+    script->step = calloc(script->line_count + 1, sizeof(host_step_t));
+    script->step[script->step_count++].type = HOST_STEP_CONNECT;
+    for (int i = 0; i < script->line_count; i++) {
+        char* l = script->lines[i];
+        char* arg = l[0] ? l + 1 : l;
+        if (*arg == ' ') arg++;
+        host_step_t* step = &script->step[script->step_count];
+        step->line = i + 1;
+
+        switch (l[0]) {
+        case '>':
+            step->type = HOST_STEP_CMD;
+            step->cmd = arg;
+            script->step_count++;
+            break;
+        case '=':
+            step->type = HOST_STEP_CMD;
+            step->cmd = arg;
+            step->raw = strdup(arg);
+            step->raw_len = host_unescape(step->raw);
+            script->step_count++;
+            break;
+        case 'F':
+            step->type = HOST_STEP_FRAME;
+            if (!host_parse_frame(arg, &step->msg)) {
+                fprintf(stderr, "%s:%d: bad frame\n", name, i + 1);
+                return false;
+            }
+            script->step_count++;
+            break;
+        case 'W':
+            step->type = HOST_STEP_WAIT;
+            step->ms = strtoul(arg, NULL, 10);
+            script->step_count++;
+            break;
+        case '@':
+            step->type = HOST_STEP_CONNECT;
+            step->peer = *arg ? strtoull(arg, NULL, 16) : HOST_PEER;
+            script->step_count++;
+            break;
+        case '<': {
+            // output of the previous step
+            host_step_t* prev = &script->step[script->step_count - 1];
+            char* text = strdup(arg);
+            size_t text_len = host_unescape(text);
+            prev->expect = realloc(prev->expect, prev->expect_len + text_len);
+            memcpy(prev->expect + prev->expect_len, text, text_len);
+            prev->expect_len += text_len;
+            free(text);
+            break;
+        }
+        case 'B':
+            if (strncmp(arg, "cpu ", 4) == 0)
+                script->budget_cpu_ms = strtod(arg + 4, NULL);
+            else if (strncmp(arg, "latency ", 8) == 0)
+                script->budget_latency_ms = strtod(arg + 8, NULL);
+            else if (strncmp(arg, "toggle ", 7) == 0)
+                script->budget_toggle_ms = strtod(arg + 7, NULL);
+            else {
+                fprintf(stderr, "%s:%d: bad budget\n", name, i + 1);
+                return false;
+            }
+            break;
+        case '#':
+        case 0:
+            break;
+        default:
+            fprintf(stderr, "%s:%d: bad step\n", name, i + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void host_record_out(FILE* f, const host_step_t* step)
+{
+    // a line per emulator line or prompt, or before a GVRET message (F1)
+    size_t start = 0;
+    for (size_t k = 0; k < step->out_len; k++) {
+        char c = step->out[k];
+        bool end = c == '\n' || c == '>' || (c == '\r' && (k + 1 >= step->out_len || step->out[k + 1] != '\n')) ||
+                   (k + 1 < step->out_len && (uint8_t)step->out[k + 1] == 0xF1);
+        if (!end && k + 1 < step->out_len) continue;
+        fputs("< ", f);
+        host_escape(f, step->out + start, k + 1 - start);
+        fputc('\n', f);
+        start = k + 1;
+    }
+}
+
+// write the session back with the recorded output after each step
+static void host_script_record(host_script_t* script, FILE* f)
+{
+    int s = 1;
+    bool connect = false;
+    for (int i = 0; i < script->line_count; i++) {
+        const char* l = script->lines[i];
+        if (l[0] == '<') continue;
+        bool is_step = s < script->step_count && script->step[s].line == i + 1;
+        if (is_step && !connect) {
+            host_record_out(f, &script->step[0]);
+            connect = true;
+        }
+        fprintf(f, "%s\n", l);
+        if (is_step) host_record_out(f, &script->step[s++]);
+    }
+    if (!connect) host_record_out(f, &script->step[0]);
+}
+
+// -----------------------------  replay  -----------------------------
+
+// wait for the emulator, then check the output of the steps first..last
+static bool host_sync(host_script_t* script, host_session_t* s, int first, int last, host_stat_t* stat)
+{
+    host_step_t* step = &script->step[last];
+    if (!host_wait_idle(HOST_IDLE_TIMEOUT_MS)) {
+        fprintf(stderr, "%s:%d: emulator stalled\n", script->name, step->line);
+        return false;
+    }
+
+    host_lock();
+    const char* out = s->out_buf + s->out_mark;
+    size_t out_len = s->out_len - s->out_mark;
+    s->out_mark = s->out_len;
+    host_unlock();
+
+    if (host_mode == HOST_MODE_RECORD) {
+        step->out = realloc(step->out, out_len);
+        memcpy(step->out, out, out_len);
+        step->out_len = out_len;
+    }
+    else if (host_mode == HOST_MODE_CHECK) {
+        char* expect = NULL;
+        size_t expect_len = 0;
+        FILE* f = open_memstream(&expect, &expect_len);
+        for (int i = first; i <= last; i++)
+            fwrite(script->step[i].expect, 1, script->step[i].expect_len, f);
+        fclose(f);
+
+        if (expect_len != out_len || memcmp(expect, out, out_len) != 0) {
+            if (stat->mismatch++ == 0) {
+                fprintf(stderr, "%s:%d: output mismatch\n  expected: ", script->name, step->line);
+                host_escape(stderr, expect, expect_len);
+                fprintf(stderr, "\n  actual:   ");
+                host_escape(stderr, out, out_len);
+                fprintf(stderr, "\n");
+            }
+        }
+        free(expect);
+    }
+    return true;
+}
+
+// ATMA, STM and STMA start a monitor
+static bool host_is_monitor(const char* cmd)
+{
+    char c[8];
+    int n = 0;
+    for (; *cmd && n < sizeof(c) - 1; cmd++) {
+        if (*cmd != ' ') c[n++] = toupper((uint8_t)*cmd);
+    }
+    c[n] = 0;
+    return strcmp(c, "ATMA") == 0 || strcmp(c, "STM") == 0 || strcmp(c, "STMA") == 0;
+}
+
+static void host_session_end(host_session_t* s)
+{
+    elm_session_close(s->id);
+    host_lock();
+    while (!s->closed)
+        host_wait(100);
+    s->closed = false;
+    host_unlock();
+}
+
+static int host_cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static bool host_replay(host_script_t* script, host_stat_t* stat)
+{
+    host_session_t s;
+    memset(&s, 0, sizeof(s));
+    cookie_io_functions_t io = {.write = host_out_write};
+    s.out = fopencookie(&s, "w", io);
+    if (s.out == NULL) return false;
+
+    host_reset();
+    uint64_t wall_us = host_now_us(CLOCK_MONOTONIC);
+    uint64_t cpu_us = host_now_us(CLOCK_PROCESS_CPUTIME_ID);
+
+    elm_link_t link = {
+        .ctx = &s,
+        .peer = HOST_PEER,
+        .out = s.out,
+        .binary = true,
+        .rx_resume = host_link_rx_resume,
+        .close = host_link_close};
+    s.id = elm_session_open("elm-host", &link);
+    if (s.id == 0) {
+        fclose(s.out);
+        return false;
+    }
+    bool ok = host_sync(script, &s, 0, 0, stat);
+
+    // frames are raised back to back, then wait for the monitor
+    char cmd[HOST_LINE_LEN]; // kept while the session takes it
+    bool monitor = false;
+    int frame_first = 0;
+    uint64_t frame_start_us = 0;
+    for (int i = 1; i <= script->step_count && ok; i++) {
+        host_step_t* step = i < script->step_count ? &script->step[i] : NULL;
+        if (frame_first && (step == NULL || step->type != HOST_STEP_FRAME)) {
+            ok = host_sync(script, &s, frame_first, i - 1, stat);
+            stat->frame_us += host_now_us(CLOCK_MONOTONIC) - frame_start_us;
+            frame_first = 0;
+        }
+        if (step == NULL || !ok) break;
+
+        switch (step->type) {
+        case HOST_STEP_FRAME:
+            if (frame_first == 0) {
+                frame_first = i;
+                frame_start_us = host_now_us(CLOCK_MONOTONIC);
+            }
+            host_can_raise(&step->msg);
+            stat->frames++;
+            break;
+
+        case HOST_STEP_CMD: {
+            snprintf(cmd, sizeof(cmd), "%s\r", step->cmd);
+            uint64_t us = host_now_us(CLOCK_MONOTONIC);
+            uint64_t cmd_cpu_us = host_now_us(CLOCK_PROCESS_CPUTIME_ID);
+            if (step->raw)
+                host_push(&s, step->raw, step->raw_len);
+            else
+                host_push(&s, cmd, strlen(cmd));
+            ok = host_sync(script, &s, i, i, stat);
+            us = host_now_us(CLOCK_MONOTONIC) - us;
+            stat->cmd_us += us;
+            if (us > stat->latency_max_us) stat->latency_max_us = us;
+            stat->cmd_latency_us[i * HOST_RUNS_MAX + stat->runs] = us;
+            stat->cmds++;
+            if (monitor) {
+                stat->toggles++;
+                stat->toggle_us += us;
+                if (us > stat->toggle_max_us) stat->toggle_max_us = us;
+                stat->toggle_cpu_us += host_now_us(CLOCK_PROCESS_CPUTIME_ID) - cmd_cpu_us;
+            }
+            monitor = host_is_monitor(step->cmd);
+            break;
+        }
+
+        case HOST_STEP_WAIT:
+            host_clock_advance((uint64_t)step->ms * 1000);
+            ok = host_sync(script, &s, i, i, stat);
+            break;
+
+        case HOST_STEP_CONNECT:
+            host_session_end(&s);
+            link.peer = step->peer;
+            s.id = elm_session_open("elm-host", &link);
+            ok = s.id != 0 && host_sync(script, &s, i, i, stat);
+            monitor = false;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (s.id) host_session_end(&s);
+    fclose(s.out);
+    free(s.out_buf);
+
+    stat->runs++;
+    stat->wall_us += host_now_us(CLOCK_MONOTONIC) - wall_us;
+    stat->cpu_us += host_now_us(CLOCK_PROCESS_CPUTIME_ID) - cpu_us;
+    stat->out_len += s.out_len;
+    return ok;
+}
+
+// -----------------------------  main  -----------------------------
+
+static void host_usage()
+{
+    fprintf(stderr, "usage: elm_host [-v] [-c|-r] [-n runs] session...\n"
+                    "  -c  check the output and the budgets, exit 1 on failure\n"
+                    "  -r  record: write the session with the emulator output on stdout\n"
+                    "  -n  replay each session n times, up to 100, 5 by default with -c\n"
+                    "  -v  log the emulator\n");
+}
+
+int main(int argc, char** argv)
+{
+    int runs = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "vcrn:")) != -1) {
+        switch (opt) {
+        case 'v':
+            host_log_level(ESP_LOG_INFO);
+            break;
+        case 'c':
+            host_mode = HOST_MODE_CHECK;
+            break;
+        case 'r':
+            host_mode = HOST_MODE_RECORD;
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        default:
+            host_usage();
+            return 2;
+        }
+    }
+    if (runs == 0) runs = host_mode == HOST_MODE_CHECK ? 5 : 1;
+    if (optind >= argc || runs < 1 || runs > HOST_RUNS_MAX) {
+        host_usage();
+        return 2;
+    }
+    if (host_mode == HOST_MODE_RECORD) runs = 1;
+    host_clock_virtual(true);
+    elm_init();
+
+    FILE* report = host_mode == HOST_MODE_RECORD ? stderr : stdout;
+    int rc = 0;
+    for (int a = optind; a < argc; a++) {
+        host_script_t script;
+        if (!host_script_load(argv[a], &script)) {
+            host_script_free(&script);
+            rc = 1;
+            continue;
+        }
+
+        host_stat_t stat = {0};
+        stat.cmd_latency_us = calloc(script.step_count * HOST_RUNS_MAX, sizeof(uint64_t));
+        bool ok = stat.cmd_latency_us != NULL;
+        for (int r = 0; r < runs && ok; r++)
+            ok = host_replay(&script, &stat);
+
+        if (ok && host_mode == HOST_MODE_RECORD) host_script_record(&script, stdout);
+
+        // the wall times follow the host scheduler: the latency of a command
+        // is its median over the runs, and the toggle is measured in cpu time
+        double cpu_ms = stat.runs ? stat.cpu_us / 1000.0 / stat.runs : 0;
+        double latency_ms = 0;
+        for (int i = 0; i < script.step_count && stat.runs && stat.cmd_latency_us; i++) {
+            uint64_t* us = &stat.cmd_latency_us[i * HOST_RUNS_MAX];
+            qsort(us, stat.runs, sizeof(uint64_t), host_cmp_u64);
+            if (us[stat.runs / 2] / 1000.0 > latency_ms) latency_ms = us[stat.runs / 2] / 1000.0;
+        }
+        double toggle_ms = stat.toggles ? stat.toggle_cpu_us / 1000.0 / stat.toggles : 0;
+        if (host_mode == HOST_MODE_CHECK) {
+            if (stat.mismatch) ok = false;
+            if (script.budget_cpu_ms && cpu_ms > script.budget_cpu_ms) {
+                fprintf(stderr, "%s: cpu %.3f ms over budget %.3f ms\n", script.name, cpu_ms, script.budget_cpu_ms);
+                ok = false;
+            }
+            if (script.budget_latency_ms && latency_ms > script.budget_latency_ms) {
+                fprintf(stderr, "%s: latency %.3f ms over budget %.3f ms\n", script.name, latency_ms, script.budget_latency_ms);
+                ok = false;
+            }
+            if (script.budget_toggle_ms && toggle_ms > script.budget_toggle_ms) {
+                fprintf(stderr, "%s: toggle cpu %.3f ms over budget %.3f ms\n", script.name, toggle_ms, script.budget_toggle_ms);
+                ok = false;
+            }
+        }
+        if (!ok) rc = 1;
+
+        fprintf(report, "%s: %s%u runs, %u cmds %.0f cmd/s, %u frames %.0f frame/s, %zu B out, cpu %.3f ms/run, latency %.3f ms max %.3f ms",
+                script.name,
+                host_mode == HOST_MODE_CHECK ? (ok ? "PASS " : "FAIL ") : "",
+                stat.runs,
+                stat.cmds, stat.cmd_us ? stat.cmds * 1e6 / stat.cmd_us : 0,
+                stat.frames, stat.frame_us ? stat.frames * 1e6 / stat.frame_us : 0,
+                stat.out_len,
+                cpu_ms,
+                latency_ms,
+                stat.latency_max_us / 1000.0);
+        if (stat.toggles)
+            fprintf(report, ", %u toggles avg %.3f ms max %.3f ms cpu %.3f ms", stat.toggles, stat.toggle_us / 1000.0 / stat.toggles, stat.toggle_max_us / 1000.0, toggle_ms);
+        fprintf(report, "\n");
+
+        free(stat.cmd_latency_us);
+        host_script_free(&script);
+    }
+    return rc;
+}
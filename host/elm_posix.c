@@ -0,0 +1,376 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "elm_port.h"
+#include "host.h"
+
+// POSIX binding of the elm core, see main/elm_freertos.c for the ESP32 one
+
+#define HOST_STORE_ENTRIES 16
+#define HOST_STORE_KEY_LEN 16
+#define HOST_STORE_DATA_LEN 4096
+#define HOST_TASK_MAX 8
+
+typedef struct {
+    char key[HOST_STORE_KEY_LEN];
+    size_t size;
+    uint8_t data[HOST_STORE_DATA_LEN];
+} host_store_entry_t;
+
+typedef struct {
+    void (*fn)(void* param);
+    void* param;
+    bool notified;
+    bool blocked; // waiting in elm_port_task_wait
+} host_task_t;
+
+static pthread_mutex_t host_mux = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t elm_port_mux = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t host_cond;
+static pthread_once_t host_once = PTHREAD_ONCE_INIT;
+static int host_active;
+static bool host_virtual;
+static uint64_t host_clock_us = 1000000; // a zero timestamp means never seen
+static int host_log = ESP_LOG_ERROR;
+static host_store_entry_t host_store[HOST_STORE_ENTRIES];
+static host_task_t* host_tasks[HOST_TASK_MAX]; // the tasks never end
+static int host_task_count;
+static __thread host_task_t* host_task_self;
+
+// -----------------------------  log  -----------------------------
+
+void host_log_level(int level)
+{
+    host_log = level;
+}
+
+void esp_log_level_set(const char* tag, esp_log_level_t level)
+{
+    host_log = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char* tag, const char* format, ...)
+{
+    if (level > host_log) return;
+    static const char level_char[] = "NEWIDV";
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%c (%s) ", level_char[level], tag);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+// -----------------------------  idle tracking  -----------------------------
+
+static void host_init()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&host_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static uint64_t host_real_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void host_lock()
+{
+    pthread_once(&host_once, host_init);
+    pthread_mutex_lock(&host_mux);
+}
+
+void host_unlock()
+{
+    pthread_mutex_unlock(&host_mux);
+}
+
+void host_signal()
+{
+    pthread_cond_broadcast(&host_cond);
+}
+
+void host_wait(uint32_t timeout_ms)
+{
+    uint64_t us = host_real_us() + (uint64_t)timeout_ms * 1000;
+    struct timespec ts = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+    pthread_cond_timedwait(&host_cond, &host_mux, &ts);
+}
+
+void host_thread_start()
+{
+    host_lock();
+    host_active++;
+    host_unlock();
+}
+
+void host_thread_end()
+{
+    host_lock();
+    host_active--;
+    host_signal();
+    host_unlock();
+}
+
+void host_block(bool* blocked)
+{
+    if (*blocked) return;
+    *blocked = true;
+    host_active--;
+    host_signal();
+}
+
+void host_unblock(bool* blocked)
+{
+    if (!*blocked) return;
+    *blocked = false;
+    host_active++;
+    host_signal();
+}
+
+bool host_wait_idle(uint32_t timeout_ms)
+{
+    uint64_t end_us = host_real_us() + (uint64_t)timeout_ms * 1000;
+    host_lock();
+    while (host_active > 0) {
+        uint64_t us = host_real_us();
+        if (us >= end_us) break;
+        host_wait((end_us - us + 999) / 1000);
+    }
+    bool idle = host_active <= 0;
+    host_unlock();
+    return idle;
+}
+
+// -----------------------------  clock  -----------------------------
+
+void host_reset()
+{
+    host_lock();
+    host_clock_us = 1000000;
+    memset(host_store, 0, sizeof(host_store));
+    host_can_reset();
+    host_unlock();
+}
+
+void host_clock_virtual(bool virtual)
+{
+    host_virtual = virtual;
+}
+
+bool host_clock_is_virtual()
+{
+    return host_virtual;
+}
+
+void host_clock_advance(uint64_t us)
+{
+    host_lock();
+    host_clock_us += us;
+    // the waiting tasks check their deadline
+    for (int i = 0; i < host_task_count; i++)
+        host_unblock(&host_tasks[i]->blocked);
+    host_signal();
+    host_unlock();
+}
+
+uint64_t host_time_us()
+{
+    return host_virtual ? host_clock_us : host_real_us();
+}
+
+uint64_t elm_port_time_us()
+{
+    if (!host_virtual) return host_real_us();
+    host_lock();
+    uint64_t us = host_clock_us;
+    host_unlock();
+    return us;
+}
+
+// -----------------------------  task, lock  -----------------------------
+
+static void* host_task(void* param)
+{
+    host_task_t* task = param;
+    host_task_self = task;
+    task->fn(task->param);
+    host_thread_end();
+    return NULL;
+}
+
+bool elm_port_task_start(void (*fn)(void* param), const char* name, void* param, int core)
+{
+    if (host_task_count >= HOST_TASK_MAX) return false;
+    host_task_t* task = calloc(1, sizeof(host_task_t));
+    if (task == NULL) return false;
+    task->fn = fn;
+    task->param = param;
+
+    pthread_t thread;
+    host_thread_start();
+    host_lock();
+    host_tasks[host_task_count++] = task;
+    host_unlock();
+    if (pthread_create(&thread, NULL, host_task, task) != 0) {
+        host_lock();
+        host_tasks[--host_task_count] = NULL;
+        host_unlock();
+        host_thread_end();
+        free(task);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void* elm_port_task_self()
+{
+    return host_task_self;
+}
+
+void host_task_notify(void* task)
+{
+    host_task_t* t = task;
+    if (t == NULL) return;
+    t->notified = true;
+    host_unblock(&t->blocked);
+    host_signal();
+}
+
+void elm_port_task_notify(void* task)
+{
+    host_lock();
+    host_task_notify(task);
+    host_unlock();
+}
+
+void elm_port_task_wait(uint32_t timeout_ms)
+{
+    host_task_t* t = host_task_self;
+    if (t == NULL) return;
+    host_lock();
+    uint64_t end_us = host_time_us() + (uint64_t)timeout_ms * 1000;
+    while (!t->notified) {
+        // virtual time only passes by the session, the clock advance wakes
+        // the task up to check its deadline
+        uint64_t us = host_time_us();
+        if (us >= end_us) break;
+        host_block(&t->blocked);
+        host_wait(host_virtual ? 100 : (end_us - us) / 1000 + 1);
+    }
+    host_unblock(&t->blocked);
+    t->notified = false;
+    host_unlock();
+}
+
+void elm_port_lock()
+{
+    pthread_mutex_lock(&elm_port_mux);
+}
+
+void elm_port_unlock()
+{
+    pthread_mutex_unlock(&elm_port_mux);
+}
+
+// -----------------------------  store  -----------------------------
+
+bool elm_port_store_get(const char* key, void* data, size_t size)
+{
+    bool ok = false;
+    host_lock();
+    for (int i = 0; i < HOST_STORE_ENTRIES; i++) {
+        host_store_entry_t* e = &host_store[i];
+        if (e->size == size && strcmp(e->key, key) == 0) {
+            memcpy(data, e->data, size);
+            ok = true;
+            break;
+        }
+    }
+    host_unlock();
+    return ok;
+}
+
+bool elm_port_store_set(const char* key, const void* data, size_t size)
+{
+    if (size > HOST_STORE_DATA_LEN || strlen(key) >= HOST_STORE_KEY_LEN) return false;
+    host_store_entry_t* e = NULL;
+    host_lock();
+    for (int i = 0; i < HOST_STORE_ENTRIES && e == NULL; i++) {
+        if (strcmp(host_store[i].key, key) == 0) e = &host_store[i];
+    }
+    for (int i = 0; i < HOST_STORE_ENTRIES && e == NULL; i++) {
+        if (host_store[i].size == 0) e = &host_store[i];
+    }
+    if (e) {
+        strcpy(e->key, key);
+        memcpy(e->data, data, size);
+        e->size = size;
+    }
+    host_unlock();
+    return e != NULL;
+}
+
+bool elm_port_store_del(const char* key)
+{
+    bool ok = false;
+    host_lock();
+    for (int i = 0; i < HOST_STORE_ENTRIES; i++) {
+        host_store_entry_t* e = &host_store[i];
+        if (e->size != 0 && strcmp(e->key, key) == 0) {
+            memset(e, 0, sizeof(*e));
+            ok = true;
+        }
+    }
+    host_unlock();
+    return ok;
+}
+
+// -----------------------------  shell  -----------------------------
+
+elm_port_shell_t elm_port_shell(char* cmd, FILE* out, elm_port_job_t** job)
+{
+    // no platform commands on the host
+    return ELM_PORT_SHELL_NONE;
+}
+
+// no jobs on the host
+
+elm_port_shell_t elm_port_job_poll(elm_port_job_t* job, FILE* out)
+{
+    return ELM_PORT_SHELL_ERROR;
+}
+
+void elm_port_job_drop(elm_port_job_t* job)
+{
+}
@@ -0,0 +1,55 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hal/can_types.h"
+
+// host side of the POSIX binding: virtual clock, canned CAN input and
+// idle tracking, so a session can be replayed step by step
+
+// clock, real (monotonic) or virtual, only advanced by host_clock_advance
+void host_clock_virtual(bool virtual);
+bool host_clock_is_virtual();
+void host_clock_advance(uint64_t us);
+uint64_t host_time_us(); // host lock held
+
+// raise a frame to the known IDs and all sources, wait for room in full sources
+bool host_can_raise(const can_message_t* msg);
+int host_can_sources();
+
+// notify an elm task, host lock held
+void host_task_notify(void* task);
+
+// idle tracking: a thread is active unless it waits for input, the host
+// is idle when all the elm threads wait for input
+void host_lock();
+void host_unlock();
+void host_signal();                      // host state changed, host lock held
+void host_wait(uint32_t timeout_ms);     // wait a host state change, host lock held
+void host_thread_start();                // a thread becomes active
+void host_thread_end();
+void host_block(bool* blocked);          // the thread waits for input, host lock held
+void host_unblock(bool* blocked);        // input available for a waiting thread, host lock held
+bool host_wait_idle(uint32_t timeout_ms);
+
+// forget the clock, bus and store state of the previous replay
+void host_reset();
+void host_can_reset(); // host lock held
+
+// log level of the shim
+void host_log_level(int level);
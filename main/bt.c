@@ -24,6 +24,7 @@
 #include "esp_gap_bt_api.h"
 #include "esp_log.h"
 #include "esp_spp_api.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/ringbuf.h"
 #include "freertos/semphr.h"
@@ -38,73 +39,114 @@
 #define SPP_SERVER_NAME "teslap-server"
 #define SPP_DEVICE_NAME "TeslapLX"
 
-#define BT_SPP_RINGBUF_RX_SIZE 100
-#define BT_SPP_RINGBUF_TX_SIZE (10 * 1024)
-
 #define BT_SPP_DATA_MAX_SIZE ESP_SPP_MAX_MTU // (3 * 330)
 
+#define BT_SPP_RINGBUF_RX_SIZE BT_SPP_DATA_MAX_SIZE // a packet bt_data_cb did not take
+#define BT_SPP_RINGBUF_TX_SIZE (10 * 1024)
+#define BT_SPP_TX_FILL_MS 5                 // default wait for a full packet
+#define BT_SPP_TX_STALL_US (5 * 1000000)    // no write event, restart the tx
+
+// tx state machine, driven by bt_write, the SPP WRITE/CONG events and the fill timer
+typedef enum {
+    BT_TX_IDLE,    // nothing in flight
+    BT_TX_FILL,    // partial packet, wait for more data or the fill timer
+    BT_TX_WRITING, // a packet in flight, wait ESP_SPP_WRITE_EVT
+    BT_TX_CONG,    // congested, wait ESP_SPP_CONG_EVT
+} bt_tx_state_t;
+
+// a SPP connection; each has at most one packet in flight, so the stack
+// queue alternates the connections a full packet at a time
+typedef struct {
+    uint32_t handle; // 0 if free
+    esp_bd_addr_t peer;
+    RingbufHandle_t rx_buffer; // kept until the slot is reused
+    uint8_t* rx_item;          // received from rx_buffer, partly taken by bt_data_cb
+    size_t rx_item_len;
+    size_t rx_item_taken;
+    RingbufHandle_t tx_buffer;
+    bt_tx_state_t tx_state;
+    esp_timer_handle_t tx_timer;
+    uint32_t size;
+    uint32_t packets;
+    uint32_t stat_us;
+    uint32_t last_us; // last tx event
+    int rx_buffer_min_free;
+    int tx_buffer_min_free;
+} bt_conn_t;
+
 static const esp_spp_mode_t esp_spp_mode = ESP_SPP_MODE_CB;
 
 static const esp_spp_sec_t sec_mask = ESP_SPP_SEC_AUTHENTICATE;
 static const esp_spp_role_t role_slave = ESP_SPP_ROLE_SLAVE;
 
-static uint32_t spp_handle = 0;
-static RingbufHandle_t spp_rx_buffer = NULL;
-static RingbufHandle_t spp_tx_buffer = NULL;
+static bt_conn_t spp_conn[BT_CONN_MAX];
 static bt_cb_t spp_open_cb = NULL;
 static bt_cb_t spp_close_cb = NULL;
-static uint32_t spp_size;
-static uint32_t spp_stat_us;
-static uint32_t spp_last_us;
-static int spp_rx_buffer_min_free;
-static int spp_tx_buffer_min_free;
-static TickType_t spp_tx_ticksToWait = 1;
+static bt_data_cb_t spp_data_cb = NULL;
 
-static bool spp_writing = false;
-static bool spp_second_connexion = false;
+static portMUX_TYPE spp_tx_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t spp_rx_mutex = NULL; // rx_buffer and rx_item with bt_data_cb
+static uint32_t spp_tx_fill_ms = BT_SPP_TX_FILL_MS;
+
+// connection of handle, NULL if none
+static bt_conn_t* _conn_get(uint32_t handle)
+{
+    if (handle == 0) return NULL;
+    for (int i = 0; i < BT_CONN_MAX; i++) {
+        if (spp_conn[i].handle == handle) return &spp_conn[i];
+    }
+    return NULL;
+}
 
-void _open(uint32_t handle)
+void _open(uint32_t handle, const esp_bd_addr_t peer)
 {
-    if (spp_handle != 0) {
-        ESP_LOGE(SPP_TAG, "connexion already oppened (handle=%d)", spp_handle);
-        spp_second_connexion = true;
+    bt_conn_t* conn = NULL;
+    for (int i = 0; i < BT_CONN_MAX && conn == NULL; i++) {
+        if (spp_conn[i].handle == 0) conn = &spp_conn[i];
+    }
+    if (conn == NULL) {
+        ESP_LOGE(SPP_TAG, "no free connexion, %i oppened (handle=%d)", BT_CONN_MAX, handle);
         esp_spp_disconnect(handle);
         return;
     }
     ESP_LOGD(SPP_TAG, "_open handle=%u", handle);
-    spp_rx_buffer = xRingbufferCreate(BT_SPP_RINGBUF_RX_SIZE, RINGBUF_TYPE_BYTEBUF);
-    spp_tx_buffer = xRingbufferCreate(BT_SPP_RINGBUF_TX_SIZE, RINGBUF_TYPE_BYTEBUF);
-    if (spp_rx_buffer == NULL || spp_tx_buffer == NULL) {
-        spp_handle = 0;
-        if (spp_rx_buffer)
-            vRingbufferDelete(spp_rx_buffer);
-        spp_rx_buffer = NULL;
-        if (spp_tx_buffer)
-            vRingbufferDelete(spp_tx_buffer);
-        spp_tx_buffer = NULL;
+    if (conn->rx_buffer == NULL) conn->rx_buffer = xRingbufferCreate(BT_SPP_RINGBUF_RX_SIZE, RINGBUF_TYPE_BYTEBUF);
+    if (conn->tx_buffer == NULL) conn->tx_buffer = xRingbufferCreate(BT_SPP_RINGBUF_TX_SIZE, RINGBUF_TYPE_BYTEBUF);
+    if (conn->rx_buffer == NULL || conn->tx_buffer == NULL) {
+        ESP_LOGE(SPP_TAG, "no mem for connexion buffers (handle=%d)", handle);
+        esp_spp_disconnect(handle);
         return;
     }
-
-    spp_handle = handle;
-    spp_rx_buffer_min_free = BT_SPP_RINGBUF_RX_SIZE;
-    spp_tx_buffer_min_free = BT_SPP_RINGBUF_TX_SIZE;
-    // spp_buffer_init();
-    spp_writing = false;
-    spp_size = 0;
-    spp_stat_us = esp_timer_get_time();
+    // drop what the previous connection left
+    size_t size;
+    void* data;
+    xSemaphoreTake(spp_rx_mutex, portMAX_DELAY);
+    if (conn->rx_item) vRingbufferReturnItem(conn->rx_buffer, conn->rx_item);
+    conn->rx_item = NULL;
+    while ((data = xRingbufferReceiveUpTo(conn->rx_buffer, &size, 0, BT_SPP_RINGBUF_RX_SIZE)) != NULL)
+        vRingbufferReturnItem(conn->rx_buffer, data);
+    xSemaphoreGive(spp_rx_mutex);
+    while ((data = xRingbufferReceiveUpTo(conn->tx_buffer, &size, 0, BT_SPP_RINGBUF_TX_SIZE)) != NULL)
+        vRingbufferReturnItem(conn->tx_buffer, data);
+
+    memcpy(conn->peer, peer, sizeof(conn->peer));
+    conn->rx_buffer_min_free = BT_SPP_RINGBUF_RX_SIZE;
+    conn->tx_buffer_min_free = BT_SPP_RINGBUF_TX_SIZE;
+    conn->tx_state = BT_TX_IDLE;
+    conn->size = 0;
+    conn->packets = 0;
+    conn->stat_us = esp_timer_get_time();
+    conn->handle = handle;
 
     if (spp_open_cb) spp_open_cb(handle);
 }
 
 void _close(uint32_t handle)
 {
-    if (handle != spp_handle) {
-        if (spp_second_connexion) {
-            ESP_LOGE(SPP_TAG, "second connexion closed (handle=%d)", handle);
-            spp_second_connexion = false;
-            return;
-        }
-        if (spp_handle != 0) ESP_LOGE(SPP_TAG, "_close handle error %u != %u", handle, spp_handle);
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL) {
+        // refused connexion
+        ESP_LOGD(SPP_TAG, "_close unknown handle=%u", handle);
         errno = EBADF;
         return;
     }
@@ -112,183 +154,290 @@ void _close(uint32_t handle)
     ESP_LOGD(SPP_TAG, "_close handle=%u", handle);
     if (spp_close_cb) spp_close_cb(handle);
 
-    if (spp_rx_buffer)
-        vRingbufferDelete(spp_rx_buffer);
-    spp_rx_buffer = NULL;
-    if (spp_tx_buffer)
-        vRingbufferDelete(spp_tx_buffer);
-    spp_tx_buffer = NULL;
-    spp_handle = 0;
+    esp_timer_stop(conn->tx_timer);
+    portENTER_CRITICAL(&spp_tx_mux);
+    conn->tx_state = BT_TX_IDLE;
+    conn->handle = 0;
+    portEXIT_CRITICAL(&spp_tx_mux);
 }
 
 void _read(uint32_t handle, uint8_t* data, uint16_t len)
 {
-    if (handle != spp_handle) {
-        if (spp_handle != 0) ESP_LOGE(SPP_TAG, "read handle error %u != %u", handle, spp_handle);
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL) {
+        ESP_LOGE(SPP_TAG, "read handle error %u", handle);
+        return;
+    }
+    BaseType_t done;
+    if (spp_data_cb) {
+        // after what waits in the rx buffer, the rest is kept for bt_rx_resume
+        xSemaphoreTake(spp_rx_mutex, portMAX_DELAY);
+        if (conn->rx_item == NULL && xRingbufferGetCurFreeSize(conn->rx_buffer) == BT_SPP_RINGBUF_RX_SIZE) {
+            size_t rest = spp_data_cb(handle, data, len);
+            data += len - rest;
+            len = rest;
+        }
+        done = len == 0 || xRingbufferSend(conn->rx_buffer, data, len, 0);
+        xSemaphoreGive(spp_rx_mutex);
+        if (done == 0) ESP_LOGW(SPP_TAG, "rx buffer full handle=%u, %u bytes dropped", handle, len);
         return;
     }
 
-    BaseType_t done = xRingbufferSend(spp_rx_buffer, data, len, 0);
+    done = xRingbufferSend(conn->rx_buffer, data, len, 0);
     if (done == 0)
         ESP_LOGW(SPP_TAG, "rx buffer full handle=%u", handle);
     else {
-        int free = xRingbufferGetCurFreeSize(spp_rx_buffer);
-        if (spp_rx_buffer_min_free > free) spp_rx_buffer_min_free = free;
+        int free = xRingbufferGetCurFreeSize(conn->rx_buffer);
+        if (conn->rx_buffer_min_free > free) conn->rx_buffer_min_free = free;
     }
 }
 
-void _write(uint32_t handle)
+// send a packet from the tx ring, the state is BT_TX_WRITING
+void _tx_send(bt_conn_t* conn, uint32_t handle)
 {
-    if (handle != spp_handle) {
-        if (spp_handle != 0) ESP_LOGE(SPP_TAG, "write handle error %u != %u", handle, spp_handle);
+    size_t len;
+    uint8_t* data = xRingbufferReceiveUpTo(conn->tx_buffer, &len, 0, BT_SPP_DATA_MAX_SIZE);
+    if (data == NULL) {
+        portENTER_CRITICAL(&spp_tx_mux);
+        conn->tx_state = BT_TX_IDLE;
+        portEXIT_CRITICAL(&spp_tx_mux);
+        return;
+    }
+    ESP_LOGD(SPP_TAG, "write handle=%u len=%i", handle, len);
+
+    // the contiguous ring region goes to the stack as is, the stack
+    // queues its own copy so the region is returned at once
+    esp_err_t err = esp_spp_write(handle, len, data);
+    vRingbufferReturnItem(conn->tx_buffer, data);
+    conn->last_us = esp_timer_get_time();
+    if (err != ESP_OK) {
+        ESP_LOGE(SPP_TAG, "esp_spp_write error %x %s, handle=%u", err, esp_err_to_name(err), handle);
+        portENTER_CRITICAL(&spp_tx_mux);
+        conn->tx_state = BT_TX_IDLE;
+        portEXIT_CRITICAL(&spp_tx_mux);
         return;
     }
 
-    size_t len;
-    uint8_t* data = xRingbufferReceiveUpTo(spp_tx_buffer, &len, spp_tx_ticksToWait, BT_SPP_DATA_MAX_SIZE);
-    if (data) {
-        ESP_LOGD(SPP_TAG, "write handle=%u len=%i", handle, len);
-        // if (len != 21) ESP_LOGI(SPP_TAG, "write handle=%u len=%i", handle, len);
-
-        esp_err_t err = esp_spp_write(handle, len, data);
-        vRingbufferReturnItem(spp_tx_buffer, data);
-        if (err != ESP_OK) {
-            ESP_LOGE(SPP_TAG, "esp_spp_write error %x %s, handle=%u", err, esp_err_to_name(err), handle);
-            return;
-        }
+    // stat
+    conn->size += len;
+    conn->packets++;
+    uint32_t time_us = conn->last_us - conn->stat_us;
+    if (time_us >= 10 * 1000000) {
+        float time_s = (float)time_us / 1000000;
+        ESP_LOGI(SPP_TAG, "stat: handle=%u size=%uB %iB/s packets=%i/s avg=%uB rxbuf=%0.1f%% txbuf=%0.1f%%",
+                 handle,
+                 conn->size,
+                 (int)(conn->size / time_s),
+                 (int)(conn->packets / time_s),
+                 conn->size / conn->packets,
+                 (float)conn->rx_buffer_min_free / BT_SPP_RINGBUF_RX_SIZE * 100,
+                 (float)conn->tx_buffer_min_free / BT_SPP_RINGBUF_TX_SIZE * 100);
+        conn->size = 0;
+        conn->packets = 0;
+        conn->stat_us = conn->last_us;
+    }
+}
 
-        spp_last_us = esp_timer_get_time();
-
-        // stat
-        spp_size += len;
-        uint32_t time_us = spp_last_us - spp_stat_us;
-        if (time_us >= 10 * 1000000) {
-            // ESP_LOGI(SPP_TAG, "stat: size=%uB %iB/s",
-            //          spp_size,
-            //          (int)((float)spp_size / ((float)time_us / 1000000)));
-            ESP_LOGI(SPP_TAG, "stat: size=%uB %iB/s rxbuf=%0.1f%% txbuf=%0.1f%%",
-                     spp_size,
-                     (int)((float)spp_size / ((float)time_us / 1000000)),
-                     (float)spp_rx_buffer_min_free / BT_SPP_RINGBUF_RX_SIZE * 100,
-                     (float)spp_tx_buffer_min_free / BT_SPP_RINGBUF_TX_SIZE * 100);
-            spp_size = 0;
-            spp_stat_us = spp_last_us;
+// start the next packet if the link is free: a full packet at once,
+// a partial one when the fill time is over
+void _tx_next(bt_conn_t* conn, bool fill_over)
+{
+    bool send = false;
+    bool fill = false;
+    portENTER_CRITICAL(&spp_tx_mux);
+    uint32_t handle = conn->handle;
+    if (handle != 0 && (conn->tx_state == BT_TX_IDLE || conn->tx_state == BT_TX_FILL)) {
+        size_t pending = BT_SPP_RINGBUF_TX_SIZE - xRingbufferGetCurFreeSize(conn->tx_buffer);
+        if (pending >= BT_SPP_DATA_MAX_SIZE || (pending > 0 && (fill_over || spp_tx_fill_ms == 0))) {
+            conn->tx_state = BT_TX_WRITING;
+            send = true;
+        }
+        else if (pending > 0 && conn->tx_state == BT_TX_IDLE) {
+            conn->tx_state = BT_TX_FILL;
+            fill = true;
         }
     }
-    else {
-        ESP_LOGD(SPP_TAG, "spp_writing false");
-        spp_writing = false;
+    portEXIT_CRITICAL(&spp_tx_mux);
+
+    if (fill) {
+        esp_timer_stop(conn->tx_timer);
+        esp_timer_start_once(conn->tx_timer, spp_tx_fill_ms * 1000);
+    }
+    if (send) _tx_send(conn, handle);
+}
+
+void _tx_fill_timeout(void* arg)
+{
+    _tx_next((bt_conn_t*)arg, true);
+}
+
+// ESP_SPP_WRITE_EVT and ESP_SPP_CONG_EVT
+void _tx_event(uint32_t handle, bool write, bool cong)
+{
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL) return;
+
+    bool next = false;
+    portENTER_CRITICAL(&spp_tx_mux);
+    conn->last_us = esp_timer_get_time();
+    if (cong) {
+        // a packet in flight ends with its write event
+        if (write || conn->tx_state != BT_TX_WRITING) conn->tx_state = BT_TX_CONG;
     }
+    else if (write ? conn->tx_state == BT_TX_WRITING : conn->tx_state == BT_TX_CONG) {
+        conn->tx_state = BT_TX_IDLE;
+        next = true;
+    }
+    portEXIT_CRITICAL(&spp_tx_mux);
+    if (next) _tx_next(conn, false);
+}
+
+void bt_set_tx_fill(uint32_t ms)
+{
+    ESP_LOGI(SPP_TAG, "tx fill %ums", ms);
+    spp_tx_fill_ms = ms;
 }
 
 size_t bt_write(uint32_t handle, const void* buf, size_t count)
 {
     if (buf == NULL || count == 0) return 0;
-    if (handle != spp_handle) {
-        if (spp_handle != 0) ESP_LOGE(SPP_TAG, "bt_write handle error %u != %u", handle, spp_handle);
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL) {
+        ESP_LOGE(SPP_TAG, "bt_write handle error %u", handle);
         errno = EBADF;
         return -1;
     }
 
-    BaseType_t done = xRingbufferSend(spp_tx_buffer, buf, count, 0);
-    ESP_LOGV(SPP_TAG, "bt_write handle=%i count=%i done=%i spp_writing=%i", handle, count, done, spp_writing);
-    // ESP_LOGI(SPP_TAG, "bt_write handle=%i count=%i done=%i spp_writing=%i", handle, count, done, spp_writing);
+    BaseType_t done = xRingbufferSend(conn->tx_buffer, buf, count, 0);
+    ESP_LOGV(SPP_TAG, "bt_write handle=%i count=%i done=%i state=%i", handle, count, done, conn->tx_state);
     if (!done) {
-        ESP_LOGD(SPP_TAG, "tx buffer full handle=%u", handle);
         ESP_LOGW(SPP_TAG, "tx buffer full handle=%u", handle);
 
-        if (spp_writing && (esp_timer_get_time() - spp_last_us) > 5 * 1000000) {
-            // bug: spp_writing = true and no event
-            ESP_LOGE(SPP_TAG, "tx buffer full and timeout, reinit write handle=%u", handle);
-            _write(handle);
+        bool stall = false;
+        portENTER_CRITICAL(&spp_tx_mux);
+        if ((conn->tx_state == BT_TX_WRITING || conn->tx_state == BT_TX_CONG) &&
+            (uint32_t)(esp_timer_get_time() - conn->last_us) > BT_SPP_TX_STALL_US) {
+            conn->tx_state = BT_TX_IDLE;
+            stall = true;
         }
-        if (!spp_writing) {
-            // bug: spp_writing = false and no event
-            ESP_LOGE(SPP_TAG, "tx buffer full and not spp_writing, reinit write handle=%u", handle);
-            spp_writing = true;
-            _write(handle);
+        portEXIT_CRITICAL(&spp_tx_mux);
+        if (stall) {
+            // a lost WRITE/CONG event, restart the tx
+            ESP_LOGE(SPP_TAG, "tx buffer full and no event, restart write handle=%u", handle);
+            _tx_next(conn, true);
         }
         return 0;
     }
-    else {
-        int free = xRingbufferGetCurFreeSize(spp_tx_buffer);
-        if (spp_tx_buffer_min_free > free) spp_tx_buffer_min_free = free;
-    }
-    if (!spp_writing) {
-        spp_writing = true;
-        _write(handle);
-    }
 
+    int free = xRingbufferGetCurFreeSize(conn->tx_buffer);
+    if (conn->tx_buffer_min_free > free) conn->tx_buffer_min_free = free;
+    _tx_next(conn, false);
     return count;
 }
 
 size_t bt_read(uint32_t handle, void* buf, size_t count, TickType_t ticksToWait)
 {
-    if (handle != spp_handle) {
-        if (spp_handle != 0) ESP_LOGE(SPP_TAG, "bt_read handle error %u != %u", handle, spp_handle);
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL) {
+        ESP_LOGE(SPP_TAG, "bt_read handle error %u", handle);
         errno = EBADF;
         return -1;
     }
 
     size_t size = 0;
-    uint8_t* data = xRingbufferReceiveUpTo(spp_rx_buffer, &size, ticksToWait, count);
+    uint8_t* data = xRingbufferReceiveUpTo(conn->rx_buffer, &size, ticksToWait, count);
     if (data == NULL || size == 0) return 0;
     if (size > count) size = count;
 
     memcpy(buf, data, size);
-    vRingbufferReturnItem(spp_rx_buffer, data);
+    vRingbufferReturnItem(conn->rx_buffer, data);
 
     return size;
 }
 
+void bt_rx_resume(uint32_t handle)
+{
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL || spp_data_cb == NULL) return;
+
+    xSemaphoreTake(spp_rx_mutex, portMAX_DELAY);
+    while (conn->handle == handle) {
+        if (conn->rx_item == NULL) {
+            conn->rx_item = xRingbufferReceiveUpTo(conn->rx_buffer, &conn->rx_item_len, 0, BT_SPP_RINGBUF_RX_SIZE);
+            conn->rx_item_taken = 0;
+            if (conn->rx_item == NULL) break;
+        }
+        size_t len = conn->rx_item_len - conn->rx_item_taken;
+        size_t rest = spp_data_cb(handle, conn->rx_item + conn->rx_item_taken, len);
+        conn->rx_item_taken += len - rest;
+        if (rest) break;
+        vRingbufferReturnItem(conn->rx_buffer, conn->rx_item);
+        conn->rx_item = NULL;
+    }
+    xSemaphoreGive(spp_rx_mutex);
+}
+
 int bt_close(uint32_t handle)
 {
-    if (handle != spp_handle) {
-        if (spp_handle != 0) ESP_LOGE(SPP_TAG, "bt_close handle error %u != %u", handle, spp_handle);
+    if (_conn_get(handle) == NULL) {
+        // closed by the peer
         errno = EBADF;
         return -1;
     }
 
     ESP_LOGI(SPP_TAG, "bt_close handle=%u", handle);
     esp_spp_disconnect(handle);
-    // _close(handle);
     return 0;
 }
 
 size_t bt_get_tx_free(uint32_t handle)
 {
-    if (handle != spp_handle) {
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL) {
         errno = EBADF;
         return -1;
     }
-    return xRingbufferGetCurFreeSize(spp_tx_buffer);
+    return xRingbufferGetCurFreeSize(conn->tx_buffer);
+}
+
+size_t bt_get_tx_size(uint32_t handle)
+{
+    return BT_SPP_RINGBUF_TX_SIZE;
+}
+
+// remote BT address, 0 on bad handle
+uint64_t bt_get_peer(uint32_t handle)
+{
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL) return 0;
+    uint64_t peer = 0;
+    for (int i = 0; i < ESP_BD_ADDR_LEN; i++)
+        peer = (peer << 8) | conn->peer[i];
+    return peer;
 }
 
 size_t bt_get_rx_free(uint32_t handle)
 {
-    if (handle != spp_handle) {
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL) {
         errno = EBADF;
         return -1;
     }
-    return xRingbufferGetCurFreeSize(spp_rx_buffer);
+    return xRingbufferGetCurFreeSize(conn->rx_buffer);
 }
 
 int bt_discard_tx_buffer(uint32_t handle)
 {
-    if (handle != spp_handle) {
+    bt_conn_t* conn = _conn_get(handle);
+    if (conn == NULL) {
         errno = EBADF;
         return -1;
     }
 
     size_t size = 0;
-    // while (true) {
-    //     uint8_t* data = xRingbufferReceiveUpTo(spp_tx_buffer, &size, 0, BT_SPP_RINGBUF_TX_SIZE);
-    //     if (data == NULL) break;
-    //     vRingbufferReturnItem(spp_tx_buffer, data);
-    // }
-    uint8_t* data = xRingbufferReceiveUpTo(spp_tx_buffer, &size, 0, BT_SPP_RINGBUF_TX_SIZE);
+    uint8_t* data = xRingbufferReceiveUpTo(conn->tx_buffer, &size, 0, BT_SPP_RINGBUF_TX_SIZE);
     if (data == NULL) return 0;
-    vRingbufferReturnItem(spp_tx_buffer, data);
+    vRingbufferReturnItem(conn->tx_buffer, data);
     return size;
 }
 
@@ -310,7 +459,7 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t* param)
         break;
     case ESP_SPP_SRV_OPEN_EVT:
         ESP_LOGI(SPP_TAG, "ESP_SPP_SRV_OPEN_EVT addr=" ESP_BD_ADDR_STR " handle=%d", ESP_BD_ADDR_HEX(param->srv_open.rem_bda), param->srv_open.handle);
-        _open(param->srv_open.handle);
+        _open(param->srv_open.handle, param->srv_open.rem_bda);
         break;
     case ESP_SPP_CLOSE_EVT:
         ESP_LOGI(SPP_TAG, "ESP_SPP_CLOSE_EVT handle=%d", param->close.handle);
@@ -325,12 +474,7 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t* param)
     case ESP_SPP_WRITE_EVT:
         ESP_LOGV(SPP_TAG, "ESP_SPP_WRITE_EVT handle=%d, len=%d, cong=%d", param->write.handle, param->write.len, param->write.cong);
         // ESP_LOGI(SPP_TAG, "ESP_SPP_WRITE_EVT handle=%d, len=%d, cong=%d", param->write.handle, param->write.len, param->write.cong);
-        if (param->write.cong == 0) {
-            _write(param->write.handle);
-        }
-        // else {
-        //     ESP_LOGW(SPP_TAG, "ESP_SPP_WRITE_EVT handle=%d, len=%d, cong=%d", param->write.handle, param->write.len, param->write.cong);
-        // }
+        _tx_event(param->write.handle, true, param->write.cong);
         break;
     case ESP_SPP_DATA_IND_EVT:
         ESP_LOGV(SPP_TAG, "ESP_SPP_DATA_IND_EVT handle=%d len=%d",
@@ -341,13 +485,7 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t* param)
     case ESP_SPP_CONG_EVT:
         ESP_LOGD(SPP_TAG, "ESP_SPP_CONG_EVT handle=%d, cong=%d", param->cong.handle, param->cong.cong);
         // ESP_LOGI(SPP_TAG, "ESP_SPP_CONG_EVT handle=%d, cong=%d", param->cong.handle, param->cong.cong);
-        if (param->cong.cong == 0) {
-            // bt_discard_tx_buffer(param->cong.handle);
-            _write(param->cong.handle);
-        }
-        else {
-            ESP_LOGI(SPP_TAG, "ESP_SPP_CONG_EVT handle=%d, cong=%d", param->cong.handle, param->cong.cong);
-        }
+        _tx_event(param->cong.handle, false, param->cong.cong);
         break;
     default:
         ESP_LOGI(SPP_TAG, "ESP_SPP event: %d", event);
@@ -405,11 +543,23 @@ void esp_bt_gap_cb(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param)
     return;
 }
 
-int bt_init(bt_cb_t bt_open_cb, bt_cb_t bt_close_cb)
+int bt_init(bt_cb_t bt_open_cb, bt_cb_t bt_close_cb, bt_data_cb_t bt_data_cb)
 {
     esp_err_t ret;
 
     ESP_LOGI(SPP_TAG, "Initialize bt");
+    spp_rx_mutex = xSemaphoreCreateMutex();
+    for (int i = 0; i < BT_CONN_MAX; i++) {
+        const esp_timer_create_args_t tx_timer_args = {
+            .callback = _tx_fill_timeout,
+            .arg = &spp_conn[i],
+            .name = "bt_tx_fill"};
+        if ((ret = esp_timer_create(&tx_timer_args, &spp_conn[i].tx_timer)) != ESP_OK) {
+            ESP_LOGE(SPP_TAG, "%s tx timer create failed: %s\n", __func__, esp_err_to_name(ret));
+            return -1;
+        }
+    }
+
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_BLE));
 
     esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
@@ -465,6 +615,7 @@ int bt_init(bt_cb_t bt_open_cb, bt_cb_t bt_close_cb)
 
     spp_open_cb = bt_open_cb;
     spp_close_cb = bt_close_cb;
+    spp_data_cb = bt_data_cb;
     return 0;
 }
 
@@ -22,15 +22,26 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/ringbuf.h"
 
+#define BT_CONN_MAX 3 // concurrent SPP clients
+
 typedef void (*bt_cb_t)(uint32_t handle);
+typedef size_t (*bt_data_cb_t)(uint32_t handle, const uint8_t* data, size_t len); // bytes not taken
 
-int bt_init(bt_cb_t bt_open_cb, bt_cb_t bt_close_cb);
+// with bt_data_cb, input is pushed to it instead of bt_read; what it does
+// not take waits in the rx buffer until bt_rx_resume
+int bt_init(bt_cb_t bt_open_cb, bt_cb_t bt_close_cb, bt_data_cb_t bt_data_cb);
+void bt_rx_resume(uint32_t handle);
 size_t bt_write(uint32_t handle, const void *buf, size_t count);
 size_t bt_read(uint32_t handle, void *buf, size_t count, TickType_t ticksToWait);
 int bt_close(uint32_t handle);
 
-// size_t bt_get_tx_free(uint32_t handle);
-// size_t bt_get_rx_free(uint32_t handle);
+// wait up to ms for a full packet before sending a partial one, 0 to send at once
+void bt_set_tx_fill(uint32_t ms);
+
+size_t bt_get_tx_free(uint32_t handle);
+size_t bt_get_tx_size(uint32_t handle);
+size_t bt_get_rx_free(uint32_t handle);
+uint64_t bt_get_peer(uint32_t handle);
 int bt_discard_tx_buffer(uint32_t handle);
 
 FILE *bt_fopen(uint32_t handle, const char *mode);
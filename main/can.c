@@ -27,7 +27,11 @@
 #include "sdkconfig.h"
 
 // #include "dbc_vehicle.h"
+#include "bt.h"
 #include "can.h"
+#include "can_vehiclebus.h"
+#include "httpd.h"
+#include "wifi.h"
 
 static const char* TAG = "can";
 
@@ -41,10 +45,21 @@ static const char* TAG = "can";
 
 #define CAN_TASK_PRIO 9
 #define CAN_TASK_CORE 1 // tskNO_AFFINITY
-#define CAN_MAX_CB 10
-
+// a session holds its monitor ring for its life and a request ring while
+// it waits for a frame: two per session of each transport (uart, bt, tcp,
+// ws), and the udp stream
+#define CAN_SESSIONS_MAX (1 + BT_CONN_MAX + WIFI_TCP_CONN_MAX + HTTPD_WS_CONN_MAX)
+#define CAN_MAX_CB (2 * CAN_SESSIONS_MAX + 1)
+
+// the slots are taken and freed by the elm workers of both cores while
+// the can task sends, all under can_rx_mux
+static portMUX_TYPE can_rx_mux = portMUX_INITIALIZER_UNLOCKED;
 static RingbufHandle_t can_rx_ringbuf[CAN_MAX_CB];
+static TaskHandle_t can_rx_task[CAN_MAX_CB]; // notified on send
+static bool can_rx_enabled[CAN_MAX_CB];
+static bool can_rx_planned[CAN_MAX_CB]; // up to CAN_ID_PLAN_MAX_RATE per ID, else CAN_ID_MAX_RATE
 static bool can_simu_task_run;
+static uint32_t can_seq;
 
 static can_filter_config_t can_filter_config = CAN_FILTER_CONFIG_ACCEPT_ALL();
 static can_timing_config_t can_timing_config = CAN_TIMING_CONFIG_500KBITS();
@@ -70,196 +85,201 @@ static can_general_config_t can_general_config = {
     .clkout_divider = 0,
 };
 
-#ifndef VEHICLEBUS_ID
-#define VEHICLEBUS_ID                                        \
-    {                                                        \
-        0x00C,     /* 12 UI Status */                        \
-            0x04F, /* 79 GPS Lat Long */                     \
-            0x082, /* 130 UI Trip Planning */                \
-            0x102, /* 258 VCLEFT Door Status */              \
-            0x103, /* 259 VCRIGHT Door Status */             \
-            0x108, /* 264 DIR Torque */                      \
-            0x118, /* 280 Drive System Status */             \
-            0x123, /* 291 UI Alert Matrix1 */                \
-            0x126, /* 294 Rear HV Status */                  \
-            0x129, /* 297 Steering Angle */                  \
-            0x132, /* 306 HV Battery */                      \
-            0x13D, /* 317 CP Charge Status */                \
-            0x142, /* 322 VCLEFT Liftgate Status */          \
-            0x154, /* 340 Rear Torque Old */                 \
-            0x186, /* 390 DIF Torque */                      \
-            0x1A5, /* 421 Front HV Status */                 \
-            0x1D4, /* 468 Front Torque Old */                \
-            0x1D5, /* 469 Front Torque */                    \
-            0x1D8, /* 472 Rear Torque */                     \
-            0x201, /* 513 VCFRONT Logging And Vitals 10Hz */ \
-            0x20A, /* 522 HVP Contactor State */             \
-            0x20C, /* 524 VCRIGHT Hvac Request */            \
-            0x212, /* 530 BMS Status */                      \
-            0x214, /* 532 Fast Charge VA */                  \
-            0x215, /* 533 FC Isolation */                    \
-            0x217, /* 535 FC Info */                         \
-            0x21D, /* 541 CP Evse Status */                  \
-            0x221, /* 545 VCFRONT LV Power State */          \
-            0x224, /* 548 PCS DCDC Status */                 \
-            0x228, /* 552 EPB Right Status */                \
-            0x229, /* 553 Gear Lever */                      \
-            0x22E, /* 558 PARK Sdi Rear */                   \
-            0x23D, /* 573 DCP charge Status */               \
-            0x241, /* 577 VCFRONT Coolant */                 \
-            0x243, /* 579 VCRIGHT Hvac Status */             \
-            0x244, /* 580 Fast Charge Limits */              \
-            0x247, /* 583 DAS Autopilot Debug */             \
-            0x249, /* 585 SCCM Left Stalk */                 \
-            0x252, /* 594 Power Available */                 \
-            0x257, /* 599 UI Speed */                        \
-            0x25D, /* 605 DCP Status */                      \
-            0x261, /* 609 12v Batt Status */                 \
-            0x263, /* 611 VCRIGHT Logging 10Hz */            \
-            0x264, /* 612 Charge Line Status */              \
-            0x266, /* 614 Rear Inverter Power */             \
-            0x267, /* 615 DI Vehicle Estimates */            \
-            0x268, /* 616 System Power */                    \
-            0x281, /* 641 VCFRONT CMP Request */             \
-            0x282, /* 642 VCLEFT Hvac Blower Feedback */     \
-            0x284, /* 644 UI Vehicle Modes */                \
-            0x287, /* 647 PTC Cabin Heat Sensor Status */    \
-            0x288, /* 648 EPB Left Status */                 \
-            0x292, /* 658 BMS SOC */                         \
-            0x293, /* 659 UI Chassis Control */              \
-            0x29D, /* 669 CP DC Charge Status */             \
-            0x2A8, /* 680 CMPD State */                      \
-            0x2B3, /* 691 VCRIGHT Logging 1Hz */             \
-            0x2B4, /* 692 PCS DCDC Rail Status */            \
-            0x2B6, /* 694 DI Chassis Control Status */       \
-            0x2C1, /* 705 VCFront 10hz */                    \
-            0x2C4, /* 708 PCS Logging */                     \
-            0x2D2, /* 722 BMS VA Limits */                   \
-            0x2E1, /* 737 VCFRONT Status */                  \
-            0x2E5, /* 741 Front Inverter Power */            \
-            0x2F1, /* 753 VCFRONT EFuse Debug Status */      \
-            0x2F3, /* 755 UI Hvac Request */                 \
-            0x300, /* 768 BMS Info */                        \
-            0x301, /* 769 VCFRONT Info */                    \
-            0x309, /* 777 DAS Object */                      \
-            0x312, /* 786 BMS Thermal */                     \
-            0x313, /* 787 UI Track Mode Settings */          \
-            0x315, /* 789 Rear Inverter Temps */             \
-            0x318, /* 792 System Time UTC */                 \
-            0x31C, /* 796 CC Chg Status */                   \
-            0x31D, /* 797 CC Chg Status 2 */                 \
-            0x320, /* 800 BMS Alert Matrix */                \
-            0x321, /* 801 VCFRONT Sensors */                 \
-            0x32C, /* 812 CC Log Data */                     \
-            0x332, /* 818 Batt Cell Min Max */               \
-            0x333, /* 819 UI Charge Request */               \
-            0x334, /* 820 UI Powertrain Control */           \
-            0x335, /* 821 Rear DI Info */                    \
-            0x336, /* 822 Max Power Rating */                \
-            0x33A, /* 826 UI Range SOC */                    \
-            0x352, /* 850 BMS Energy Status */               \
-            0x376, /* 886 Front Inverter Temps */            \
-            0x381, /* 897 VCFRONT Logging 1Hz */             \
-            0x383, /* 899 VCRIGHT Ths Status */              \
-            0x393, /* 915 VCRIGHT Epbm Debug */              \
-            0x395, /* 917 DIR Oil Pump */                    \
-            0x396, /* 918 Front Oil Pump */                  \
-            0x399, /* 921 DAS Status */                      \
-            0x3A1, /* 929 VCFRONT Vehicle Status */          \
-            0x3B2, /* 946 BMS Log2 */                        \
-            0x3B3, /* 947 UI Vehicle Control2 */             \
-            0x3B6, /* 950 Odometer */                        \
-            0x3BB, /* 955 UI Power */                        \
-            0x3C2, /* 962 VCLEFT_switch Status */            \
-            0x3C3, /* 963 VCRIGHT Switch Status */           \
-            0x3D2, /* 978 Total Charge Discharge */          \
-            0x3D8, /* 984 Elevation */                       \
-            0x3D9, /* 985 UI GPS Vehicle Speed */            \
-            0x3E2, /* 994 VCLEFT Light Status */             \
-            0x3E3, /* 995 VCRIGHT Light Status */            \
-            0x3E9, /* 1001 DAS Body Controls */              \
-            0x3F2, /* 1010 BMS Counters */                   \
-            0x3F5, /* 1013 VCFRONT Lighting */               \
-            0x3FE, /* 1022 Brake Temps Estimated */          \
-            0x401, /* 1025 Cell Voltages */                  \
-            0x405, /* 1029 VIN */                            \
-            0x42A, /* 1066 VCSEC TPMS Connection Data */     \
-            0x43D, /* 1085 CP Charge Status Log */           \
-            0x51E, /* 1310 FC Info */                        \
-            0x528, /* 1320 Unix Time */                      \
-            0x541, /* 1345 Fast Charge Max Limits */         \
-            0x556, /* 1366 Front DI Temps */                 \
-            0x557, /* 1367 Front Thermal Control */          \
-            0x5D5, /* 1493 Rear DI Temps */                  \
-            0x5D7, /* 1495 Rear Thermal Control */           \
-            0x628, /* 1576 UDS MCU to PCS */                 \
-            0x629, /* 1577 UDS PCS to MCU */                 \
-            0x656, /* 1622 Front DI Info */                  \
-            0x743, /* 1859 VCRIGHT Recall Status */          \
-            0x757, /* 1879 DIF Debugs */                     \
-            0x75D, /* 1885 CP Sensor Data */                 \
-            0x7AA, /* 1962 HVP Debug Message */              \
-            0x7D5, /* 2005 DIR Debug */                      \
-            0x7FF, /* 2047 Car Config */                     \
-    }
-#endif
-
 // STFAP 132,7FF
 // STM
 
 static const uint32_t can_id[] = VEHICLEBUS_ID;
 static const int can_id_count = sizeof(can_id) / sizeof(*can_id);
-static const uint32_t can_id_delay_us = 1000000 / 11; // max msg per second
-static uint32_t can_id_last_us[sizeof(can_id) / sizeof(*can_id)] = {0};
+static const uint32_t can_id_delay_us = 1000000 / CAN_ID_MAX_RATE;
+static const uint32_t can_id_plan_delay_us = 1000000 / CAN_ID_PLAN_MAX_RATE;
+static uint32_t can_id_last_us[sizeof(can_id) / sizeof(*can_id)] = {0};      // raised to all the sources
+static uint32_t can_id_plan_last_us[sizeof(can_id) / sizeof(*can_id)] = {0}; // raised to the planned sources
+static uint32_t can_id_seen_us[sizeof(can_id) / sizeof(*can_id)] = {0};
+static uint32_t can_id_period_us[sizeof(can_id) / sizeof(*can_id)] = {0}; // native bus period, filtered
+static uint8_t can_id_dlc[sizeof(can_id) / sizeof(*can_id)] = {0};
+static can_message_timestamp_t can_id_latest[sizeof(can_id) / sizeof(*can_id)] = {0}; // last frame, not rate limited
+static uint32_t can_id_data_gen[sizeof(can_id) / sizeof(*can_id)] = {0};
+static portMUX_TYPE can_id_latest_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// index of id in the known ID list (sorted), -1 if unknown
+int can_id_index(uint32_t id)
+{
+    int lo = 0;
+    int hi = can_id_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (can_id[mid] == id) return mid;
+        if (can_id[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+int can_id_get_count()
+{
+    return can_id_count;
+}
+
+uint32_t can_id_get(int index)
+{
+    if (index < 0 || index >= can_id_count) return 0;
+    return can_id[index];
+}
+
+// native bus period and last dlc of a known ID, false if never seen
+bool can_id_stat(int index, uint32_t* period_us, uint8_t* dlc)
+{
+    if (index < 0 || index >= can_id_count || can_id_period_us[index] == 0) return false;
+    *period_us = can_id_period_us[index];
+    *dlc = can_id_dlc[index];
+    return true;
+}
 
-void _can_raise(can_message_timestamp_t* msg)
+// last frame of a known ID, false if never seen
+bool can_id_latest_get(uint32_t id, can_message_timestamp_t* msg)
 {
+    int i = can_id_index(id);
+    if (i < 0) return false;
+    portENTER_CRITICAL(&can_id_latest_mux);
+    *msg = can_id_latest[i];
+    portEXIT_CRITICAL(&can_id_latest_mux);
+    return msg->timestamp != 0;
+}
+
+uint32_t can_id_gen(int index)
+{
+    if (index < 0 || index >= can_id_count) return 0;
+    return __atomic_load_n(&can_id_data_gen[index], __ATOMIC_RELAXED);
+}
+
+void _can_id_seen(int i, const can_message_t* msg, uint64_t ts)
+{
+    uint32_t period = (uint32_t)ts - can_id_seen_us[i];
+    if (can_id_seen_us[i] != 0 && period < 10 * 1000000) {
+        if (can_id_period_us[i] == 0)
+            can_id_period_us[i] = period;
+        else
+            can_id_period_us[i] = (can_id_period_us[i] * 7 + period) / 8;
+    }
+    can_id_seen_us[i] = ts;
+    can_id_dlc[i] = msg->data_length_code;
+
+    portENTER_CRITICAL(&can_id_latest_mux);
+    can_message_t* last = &can_id_latest[i].msg;
+    if (can_id_latest[i].timestamp == 0 || last->data_length_code != msg->data_length_code || memcmp(last->data, msg->data, sizeof(msg->data)) != 0)
+        can_id_data_gen[i]++;
+    can_id_latest[i].msg = *msg;
+    can_id_latest[i].timestamp = ts;
+    portEXIT_CRITICAL(&can_id_latest_mux);
+}
+
+// all: to all the sources, else only to the planned ones
+void _can_raise(can_message_timestamp_t* msg, bool all)
+{
+    msg->seq = __atomic_add_fetch(&can_seq, 1, __ATOMIC_RELAXED);
+    if (msg->seq == 0) msg->seq = __atomic_add_fetch(&can_seq, 1, __ATOMIC_RELAXED); // 0 is never a valid seq
+
+    // the ISR variants do not block nor yield in the critical section
+    BaseType_t woken = pdFALSE;
+    int full = 0;
+    portENTER_CRITICAL(&can_rx_mux);
     for (int i = 0; i < CAN_MAX_CB; i++) {
-        if (can_rx_ringbuf[i]) {
-            BaseType_t done = xRingbufferSend(can_rx_ringbuf[i], msg, sizeof(can_message_timestamp_t), 0);
+        if (can_rx_ringbuf[i] && can_rx_enabled[i] && (all || can_rx_planned[i])) {
+            BaseType_t done = xRingbufferSendFromISR(can_rx_ringbuf[i], msg, sizeof(can_message_timestamp_t), &woken);
             if (done == 0)
-                ESP_LOGW(TAG, "rx buffer full");
+                full++;
+            else if (can_rx_task[i])
+                vTaskNotifyGiveFromISR(can_rx_task[i], &woken);
         }
     }
+    portEXIT_CRITICAL(&can_rx_mux);
+    if (full) ESP_LOGW(TAG, "rx buffer full x%d", full);
+    if (woken) portYIELD();
 }
 
 RingbufHandle_t can_ringbuf_new(size_t itemNum)
 {
-    for (int i = 0; i < CAN_MAX_CB; i++) {
+    RingbufHandle_t ringbuf = xRingbufferCreateNoSplit(sizeof(can_message_timestamp_t), itemNum);
+    if (ringbuf == NULL) return NULL;
+
+    int slot = -1;
+    portENTER_CRITICAL(&can_rx_mux);
+    for (int i = 0; i < CAN_MAX_CB && slot < 0; i++) {
         if (can_rx_ringbuf[i] == NULL) {
-            can_rx_ringbuf[i] = xRingbufferCreateNoSplit(sizeof(can_message_timestamp_t), itemNum);
-            return can_rx_ringbuf[i];
+            can_rx_task[i] = xTaskGetCurrentTaskHandle();
+            can_rx_enabled[i] = true;
+            can_rx_planned[i] = false;
+            can_rx_ringbuf[i] = ringbuf;
+            slot = i;
         }
     }
-    return NULL;
+    portEXIT_CRITICAL(&can_rx_mux);
+    if (slot < 0) {
+        ESP_LOGW(TAG, "no free rx slot of %d", CAN_MAX_CB);
+        vRingbufferDelete(ringbuf);
+        return NULL;
+    }
+    return ringbuf;
 }
 
+// the slot is freed first, no send is in progress when the ring is deleted
 bool can_ringbuf_del(RingbufHandle_t ringbuf)
 {
     if (ringbuf == NULL) return true;
-    for (int i = 0; i < CAN_MAX_CB; i++) {
+    bool found = false;
+    portENTER_CRITICAL(&can_rx_mux);
+    for (int i = 0; i < CAN_MAX_CB && !found; i++) {
         if (can_rx_ringbuf[i] == ringbuf) {
-            vRingbufferDelete(can_rx_ringbuf[i]);
             can_rx_ringbuf[i] = NULL;
-            return true;
+            can_rx_task[i] = NULL;
+            found = true;
         }
     }
-    return false;
+    portEXIT_CRITICAL(&can_rx_mux);
+    if (found) vRingbufferDelete(ringbuf);
+    return found;
 }
 
-bool _can_filter_id(uint32_t id, uint32_t ts)
+void can_ringbuf_planned(RingbufHandle_t ringbuf, bool planned)
 {
-    for (int i = 0; i < can_id_count; i++) {
-        if (id != can_id[i]) continue;
+    portENTER_CRITICAL(&can_rx_mux);
+    for (int i = 0; i < CAN_MAX_CB; i++) {
+        if (can_rx_ringbuf[i] == ringbuf) can_rx_planned[i] = planned;
+    }
+    portEXIT_CRITICAL(&can_rx_mux);
+}
 
-        if ((ts - can_id_last_us[i]) >= can_id_delay_us) {
-            can_id_last_us[i] = ts;
-            return true;
+void can_ringbuf_enable(RingbufHandle_t ringbuf, bool enable)
+{
+    for (int i = 0; i < CAN_MAX_CB; i++) {
+        if (can_rx_ringbuf[i] != ringbuf) continue;
+        if (enable && !can_rx_enabled[i]) {
+            size_t size;
+            void* item;
+            while ((item = xRingbufferReceive(ringbuf, &size, 0)) != NULL)
+                vRingbufferReturnItem(ringbuf, item);
         }
-        else
-            return false;
+        portENTER_CRITICAL(&can_rx_mux);
+        can_rx_enabled[i] = enable;
+        portEXIT_CRITICAL(&can_rx_mux);
+        return;
     }
-    return false;
+}
+
+// false if the frame is over both guards, all if it is under the default one
+bool _can_filter_id(const can_message_t* msg, uint64_t ts, bool* all)
+{
+    int i = can_id_index(msg->identifier);
+    if (i < 0) return false;
+    _can_id_seen(i, msg, ts);
+
+    if (((uint32_t)ts - can_id_plan_last_us[i]) < can_id_plan_delay_us) return false;
+    can_id_plan_last_us[i] = ts;
+    *all = ((uint32_t)ts - can_id_last_us[i]) >= can_id_delay_us;
+    if (*all) can_id_last_us[i] = ts;
+    return true;
 }
 
 void can_simu_task(void* param)
@@ -322,7 +342,8 @@ void can_simu_task(void* param)
         msg.msg.data[5] = 0;
         msg.msg.data[6] = 0xFF; // Charge Time Remaining
         msg.msg.data[7] = 0x0F;
-        _can_raise(&msg);
+        _can_id_seen(can_id_index(msg.msg.identifier), &msg.msg, msg.timestamp);
+        _can_raise(&msg, true);
         can_count++;
 
         // 257 C3 49 1F 00 02 00 00 00 
@@ -337,7 +358,8 @@ void can_simu_task(void* param)
         msg.msg.data[5] = 0x00;
         msg.msg.data[6] = 0x00;
         msg.msg.data[7] = 0x00;
-        _can_raise(&msg);
+        _can_id_seen(can_id_index(msg.msg.identifier), &msg.msg, msg.timestamp);
+        _can_raise(&msg, true);
         can_count++;
 
         // stat
@@ -358,6 +380,7 @@ void can_task(void* param)
 {
     can_message_t rx_msg;
     can_message_timestamp_t rx_msg_ts;
+    bool all;
     uint32_t alerts;
     int can_count = 0;
     int can_count_all = 0;
@@ -384,12 +407,12 @@ void can_task(void* param)
             ESP_LOGE(TAG, "receive error 0x%x %s", err, esp_err_to_name(err));
             break;
         }
-        else if (_can_filter_id(rx_msg.identifier, (uint32_t)ts)) {
+        else if (_can_filter_id(&rx_msg, ts, &all)) {
             can_count_all++;
             can_count++;
             rx_msg_ts.timestamp = ts;
             memcpy(&rx_msg_ts.msg, &rx_msg, sizeof(rx_msg));
-            _can_raise(&rx_msg_ts); // can msg
+            _can_raise(&rx_msg_ts, all); // can msg
         }
         else {
             // filtered msg
@@ -453,6 +476,10 @@ bool can_init()
         return false;
     }
     memset(can_id_last_us, 0, sizeof(can_id_last_us));
+    memset(can_id_plan_last_us, 0, sizeof(can_id_plan_last_us));
+    memset(can_id_seen_us, 0, sizeof(can_id_seen_us));
+    memset(can_id_period_us, 0, sizeof(can_id_period_us));
+    memset(can_id_latest, 0, sizeof(can_id_latest));
     ESP_LOGI(TAG, "Driver started");
 
     memset(can_rx_ringbuf, 0, sizeof(can_rx_ringbuf));
@@ -21,17 +21,16 @@
 
 #include "hal/can_types.h"
 
-typedef struct {
-    can_message_t msg;
-    uint64_t timestamp;
-} can_message_timestamp_t;
+#include "can_id.h"
 
 typedef void (*can_rx_cb_t)(can_message_t* rx_msg, uint64_t timestamp, void* ctx);
 
 bool can_init();
 
-RingbufHandle_t can_ringbuf_new(size_t itemNum);
+RingbufHandle_t can_ringbuf_new(size_t itemNum); // the creating task is notified on each frame
 bool can_ringbuf_del(RingbufHandle_t ringbuf);
+void can_ringbuf_enable(RingbufHandle_t ringbuf, bool enable); // enabled when created, drop the queued frames on enable
+void can_ringbuf_planned(RingbufHandle_t ringbuf, bool planned); // frames up to CAN_ID_PLAN_MAX_RATE per ID, not when created
 
 void can_simu_start();
 void can_simu_stop();
@@ -0,0 +1,41 @@
+// Copyright 2020 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "hal/can_types.h"
+
+// frames and known IDs, without OS dependency: implemented by can.c on the
+// ESP32 and by the host binding on Linux
+
+typedef struct {
+    can_message_t msg;
+    uint64_t timestamp;
+    uint32_t seq; // raise sequence number, same for all subscribers
+} can_message_timestamp_t;
+
+#define CAN_ID_MAX_RATE 11      // bus guard, max msg per second and per ID
+#define CAN_ID_PLAN_MAX_RATE 50 // bus guard of the sources planning their own rate per ID
+
+int can_id_index(uint32_t id);
+int can_id_get_count();
+uint32_t can_id_get(int index);
+bool can_id_stat(int index, uint32_t* period_us, uint8_t* dlc);
+bool can_id_latest_get(uint32_t id, can_message_timestamp_t* msg);
+uint32_t can_id_gen(int index); // bumped when the data of the ID changes, 0 if never seen
@@ -0,0 +1,151 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+// known Vehicle Bus IDs, sorted, shared by can.c and the host binding
+
+#ifndef VEHICLEBUS_ID
+#define VEHICLEBUS_ID                                        \
+    {                                                        \
+        0x00C,     /* 12 UI Status */                        \
+            0x04F, /* 79 GPS Lat Long */                     \
+            0x082, /* 130 UI Trip Planning */                \
+            0x102, /* 258 VCLEFT Door Status */              \
+            0x103, /* 259 VCRIGHT Door Status */             \
+            0x108, /* 264 DIR Torque */                      \
+            0x118, /* 280 Drive System Status */             \
+            0x123, /* 291 UI Alert Matrix1 */                \
+            0x126, /* 294 Rear HV Status */                  \
+            0x129, /* 297 Steering Angle */                  \
+            0x132, /* 306 HV Battery */                      \
+            0x13D, /* 317 CP Charge Status */                \
+            0x142, /* 322 VCLEFT Liftgate Status */          \
+            0x154, /* 340 Rear Torque Old */                 \
+            0x186, /* 390 DIF Torque */                      \
+            0x1A5, /* 421 Front HV Status */                 \
+            0x1D4, /* 468 Front Torque Old */                \
+            0x1D5, /* 469 Front Torque */                    \
+            0x1D8, /* 472 Rear Torque */                     \
+            0x201, /* 513 VCFRONT Logging And Vitals 10Hz */ \
+            0x20A, /* 522 HVP Contactor State */             \
+            0x20C, /* 524 VCRIGHT Hvac Request */            \
+            0x212, /* 530 BMS Status */                      \
+            0x214, /* 532 Fast Charge VA */                  \
+            0x215, /* 533 FC Isolation */                    \
+            0x217, /* 535 FC Info */                         \
+            0x21D, /* 541 CP Evse Status */                  \
+            0x221, /* 545 VCFRONT LV Power State */          \
+            0x224, /* 548 PCS DCDC Status */                 \
+            0x228, /* 552 EPB Right Status */                \
+            0x229, /* 553 Gear Lever */                      \
+            0x22E, /* 558 PARK Sdi Rear */                   \
+            0x23D, /* 573 DCP charge Status */               \
+            0x241, /* 577 VCFRONT Coolant */                 \
+            0x243, /* 579 VCRIGHT Hvac Status */             \
+            0x244, /* 580 Fast Charge Limits */              \
+            0x247, /* 583 DAS Autopilot Debug */             \
+            0x249, /* 585 SCCM Left Stalk */                 \
+            0x252, /* 594 Power Available */                 \
+            0x257, /* 599 UI Speed */                        \
+            0x25D, /* 605 DCP Status */                      \
+            0x261, /* 609 12v Batt Status */                 \
+            0x263, /* 611 VCRIGHT Logging 10Hz */            \
+            0x264, /* 612 Charge Line Status */              \
+            0x266, /* 614 Rear Inverter Power */             \
+            0x267, /* 615 DI Vehicle Estimates */            \
+            0x268, /* 616 System Power */                    \
+            0x281, /* 641 VCFRONT CMP Request */             \
+            0x282, /* 642 VCLEFT Hvac Blower Feedback */     \
+            0x284, /* 644 UI Vehicle Modes */                \
+            0x287, /* 647 PTC Cabin Heat Sensor Status */    \
+            0x288, /* 648 EPB Left Status */                 \
+            0x292, /* 658 BMS SOC */                         \
+            0x293, /* 659 UI Chassis Control */              \
+            0x29D, /* 669 CP DC Charge Status */             \
+            0x2A8, /* 680 CMPD State */                      \
+            0x2B3, /* 691 VCRIGHT Logging 1Hz */             \
+            0x2B4, /* 692 PCS DCDC Rail Status */            \
+            0x2B6, /* 694 DI Chassis Control Status */       \
+            0x2C1, /* 705 VCFront 10hz */                    \
+            0x2C4, /* 708 PCS Logging */                     \
+            0x2D2, /* 722 BMS VA Limits */                   \
+            0x2E1, /* 737 VCFRONT Status */                  \
+            0x2E5, /* 741 Front Inverter Power */            \
+            0x2F1, /* 753 VCFRONT EFuse Debug Status */      \
+            0x2F3, /* 755 UI Hvac Request */                 \
+            0x300, /* 768 BMS Info */                        \
+            0x301, /* 769 VCFRONT Info */                    \
+            0x309, /* 777 DAS Object */                      \
+            0x312, /* 786 BMS Thermal */                     \
+            0x313, /* 787 UI Track Mode Settings */          \
+            0x315, /* 789 Rear Inverter Temps */             \
+            0x318, /* 792 System Time UTC */                 \
+            0x31C, /* 796 CC Chg Status */                   \
+            0x31D, /* 797 CC Chg Status 2 */                 \
+            0x320, /* 800 BMS Alert Matrix */                \
+            0x321, /* 801 VCFRONT Sensors */                 \
+            0x32C, /* 812 CC Log Data */                     \
+            0x332, /* 818 Batt Cell Min Max */               \
+            0x333, /* 819 UI Charge Request */               \
+            0x334, /* 820 UI Powertrain Control */           \
+            0x335, /* 821 Rear DI Info */                    \
+            0x336, /* 822 Max Power Rating */                \
+            0x33A, /* 826 UI Range SOC */                    \
+            0x352, /* 850 BMS Energy Status */               \
+            0x376, /* 886 Front Inverter Temps */            \
+            0x381, /* 897 VCFRONT Logging 1Hz */             \
+            0x383, /* 899 VCRIGHT Ths Status */              \
+            0x393, /* 915 VCRIGHT Epbm Debug */              \
+            0x395, /* 917 DIR Oil Pump */                    \
+            0x396, /* 918 Front Oil Pump */                  \
+            0x399, /* 921 DAS Status */                      \
+            0x3A1, /* 929 VCFRONT Vehicle Status */          \
+            0x3B2, /* 946 BMS Log2 */                        \
+            0x3B3, /* 947 UI Vehicle Control2 */             \
+            0x3B6, /* 950 Odometer */                        \
+            0x3BB, /* 955 UI Power */                        \
+            0x3C2, /* 962 VCLEFT_switch Status */            \
+            0x3C3, /* 963 VCRIGHT Switch Status */           \
+            0x3D2, /* 978 Total Charge Discharge */          \
+            0x3D8, /* 984 Elevation */                       \
+            0x3D9, /* 985 UI GPS Vehicle Speed */            \
+            0x3E2, /* 994 VCLEFT Light Status */             \
+            0x3E3, /* 995 VCRIGHT Light Status */            \
+            0x3E9, /* 1001 DAS Body Controls */              \
+            0x3F2, /* 1010 BMS Counters */                   \
+            0x3F5, /* 1013 VCFRONT Lighting */               \
+            0x3FE, /* 1022 Brake Temps Estimated */          \
+            0x401, /* 1025 Cell Voltages */                  \
+            0x405, /* 1029 VIN */                            \
+            0x42A, /* 1066 VCSEC TPMS Connection Data */     \
+            0x43D, /* 1085 CP Charge Status Log */           \
+            0x51E, /* 1310 FC Info */                        \
+            0x528, /* 1320 Unix Time */                      \
+            0x541, /* 1345 Fast Charge Max Limits */         \
+            0x556, /* 1366 Front DI Temps */                 \
+            0x557, /* 1367 Front Thermal Control */          \
+            0x5D5, /* 1493 Rear DI Temps */                  \
+            0x5D7, /* 1495 Rear Thermal Control */           \
+            0x628, /* 1576 UDS MCU to PCS */                 \
+            0x629, /* 1577 UDS PCS to MCU */                 \
+            0x656, /* 1622 Front DI Info */                  \
+            0x743, /* 1859 VCRIGHT Recall Status */          \
+            0x757, /* 1879 DIF Debugs */                     \
+            0x75D, /* 1885 CP Sensor Data */                 \
+            0x7AA, /* 1962 HVP Debug Message */              \
+            0x7D5, /* 2005 DIR Debug */                      \
+            0x7FF, /* 2047 Car Config */                     \
+    }
+#endif
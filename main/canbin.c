@@ -0,0 +1,81 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "canbin.h"
+
+static inline char* canbin_u16(char* p, uint16_t v)
+{
+    *p++ = v & 0xff;
+    *p++ = (v >> 8) & 0xff;
+    return p;
+}
+
+static inline char* canbin_u32(char* p, uint32_t v)
+{
+    p = canbin_u16(p, v & 0xffff);
+    return canbin_u16(p, v >> 16);
+}
+
+size_t canbin_format(const can_message_t* msg, char* buf)
+{
+    char* p = buf;
+    uint8_t dlc = msg->data_length_code > 8 ? 8 : msg->data_length_code;
+    bool extd = msg->extd || msg->identifier > CAN_STD_ID_MASK;
+
+    *p++ = dlc | (extd ? CANBIN_EXTD : 0) | (msg->rtr ? CANBIN_RTR : 0);
+    if (extd)
+        p = canbin_u32(p, msg->identifier & CAN_EXTD_ID_MASK);
+    else
+        p = canbin_u16(p, msg->identifier & CAN_STD_ID_MASK);
+    if (!msg->rtr) {
+        memcpy(p, msg->data, dlc);
+        p += dlc;
+    }
+    return p - buf;
+}
+
+size_t canbin_format_ts(uint64_t ts_us, uint64_t* last_us, bool sync, char* buf)
+{
+    char* p = buf;
+    uint64_t delta = ts_us - *last_us;
+    if (sync || delta > CANBIN_DELTA_MAX) {
+        p = canbin_u16(p, CANBIN_SYNC);
+        p = canbin_u32(p, (uint32_t)ts_us);
+    }
+    else {
+        p = canbin_u16(p, delta);
+    }
+    *last_us = ts_us;
+    return p - buf;
+}
+
+size_t canbin_cmd_len(const uint8_t* cmd, size_t len)
+{
+    if (len < 3) return 0;
+    size_t need = 3 + cmd[2];
+    return len < need ? 0 : need;
+}
+
+size_t canbin_reply(uint8_t op, bool ok, char* buf)
+{
+    char* p = canbin_u16(buf, CANBIN_REPLY);
+    *p++ = op;
+    *p++ = ok ? 0 : 1;
+    return p - buf;
+}
@@ -0,0 +1,71 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "hal/can_types.h"
+
+// CANBIN, packed binary CAN stream of a binary link (WebSocket dashboards),
+// the session side is in elm.c; little endian
+//   command: CB op n payload[n], n <= CANBIN_PAYLOAD_MAX
+//     01 id[4]..: subscribe to the IDs, bit 31 for 29 bits ID
+//     02 id[4]..: unsubscribe from the IDs
+//     03: clear the subscriptions, all IDs are streamed when there is none
+//     04 rate[2]: max frames/s per ID, 0 for the native rate
+//     05: start the stream, 06: stop it
+//   the records are a byte stream across the messages:
+//     delta[2] frame: us since the previous record, up to FFFD
+//     FFFF ts[4] frame: absolute us, the first of the stream or after a
+//     write dropped on a full link
+//     FFFE op status: reply to a command, 0 ok, 1 error
+//   frame: (dlc | 10 29 bits ID | 20 rtr) id[2] or id[4] data[dlc]
+
+#define CANBIN_START 0xCB
+#define CANBIN_PAYLOAD_MAX 124 // 31 IDs
+#define CANBIN_TS_LEN 6        // FFFF ts[4]
+#define CANBIN_FRAME_LEN 13    // delta, 11 bits ID, 8 data bytes
+#define CANBIN_REPLY_LEN 4
+
+#define CANBIN_SUBSCRIBE 0x01
+#define CANBIN_UNSUBSCRIBE 0x02
+#define CANBIN_CLEAR 0x03
+#define CANBIN_RATE 0x04
+#define CANBIN_STREAM_START 0x05
+#define CANBIN_STREAM_STOP 0x06
+
+#define CANBIN_DELTA_MAX 0xFFFD
+#define CANBIN_REPLY 0xFFFE
+#define CANBIN_SYNC 0xFFFF
+
+#define CANBIN_EXTD 0x10
+#define CANBIN_RTR 0x20
+
+// format the frame of msg in buf without its timestamp, return the length
+size_t canbin_format(const can_message_t* msg, char* buf);
+
+// format the timestamp before a frame in buf, absolute if sync or out of
+// delta range, update last_us, return the length; the absolute ts is the
+// low 32 bits of the uptime
+size_t canbin_format_ts(uint64_t ts_us, uint64_t* last_us, bool sync, char* buf);
+
+// length of the command in cmd[len] (CB op n ...), 0 if more bytes are needed
+size_t canbin_cmd_len(const uint8_t* cmd, size_t len);
+
+// reply to the command op in buf, return the length
+size_t canbin_reply(uint8_t op, bool ok, char* buf);
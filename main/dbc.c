@@ -0,0 +1,119 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dbc.h"
+
+// -----------------------------  signals  -----------------------------
+
+const sg_t SG_132_BattVoltage132 = {"BattVoltage132", 0x132, 0, 16, true, false, 0.01, 0, 0, 655.35, "V", "HV Battery Voltage", {{0, NULL}}};
+const sg_t SG_132_SmoothBattCurrent132 = {"SmoothBattCurrent132", 0x132, 16, 16, true, true, -0.1, 0, -3276.7, 3276.7, "A", "HV Battery Current", {{0, NULL}}};
+const sg_t SG_257_UIspeed_signed257 = {"UIspeed_signed257", 0x257, 12, 12, true, false, 0.08, -40, -40, 287.6, "KPH", "Vehicle Speed", {{0, NULL}}};
+const sg_t SG_292_SOCUI292 = {"SOCUI292", 0x292, 10, 10, true, false, 0.1, 0, 0, 102.3, "%", "BMS SOC", {{0, NULL}}};
+const sg_t SG_321_VCFRONT_tempAmbient = {"VCFRONT_tempAmbient", 0x321, 24, 8, true, false, 0.5, -40, -40, 87.5, "C", "Ambient Temperature", {{0, NULL}}};
+
+static const sg_t* const dbc_signals[] = {
+    &SG_132_BattVoltage132,
+    &SG_132_SmoothBattCurrent132,
+    &SG_257_UIspeed_signed257,
+    &SG_292_SOCUI292,
+    &SG_321_VCFRONT_tempAmbient,
+};
+
+_Static_assert(sizeof(dbc_signals) / sizeof(*dbc_signals) <= DBC_SIGNALS_MAX, "too many signals");
+
+int dbc_signal_count()
+{
+    return sizeof(dbc_signals) / sizeof(*dbc_signals);
+}
+
+const sg_t* dbc_signal_get(int index)
+{
+    if (index < 0 || index >= dbc_signal_count()) return NULL;
+    return dbc_signals[index];
+}
+
+int dbc_signal_find(const char* name)
+{
+    for (int i = 0; i < dbc_signal_count(); i++) {
+        if (strcmp(dbc_signals[i]->name, name) == 0) return i;
+    }
+    return -1;
+}
+
+bool dbc_set_empty(const dbc_set_t* set)
+{
+    for (int i = 0; i < sizeof(set->bits) / sizeof(*set->bits); i++) {
+        if (set->bits[i]) return false;
+    }
+    return true;
+}
+
+void dbc_set_all(dbc_set_t* set)
+{
+    memset(set, 0, sizeof(*set));
+    for (int i = 0; i < dbc_signal_count(); i++)
+        dbc_set_add(set, i);
+}
+
+// FNV-1a of the bits, a short name of the set for logs and ETags
+uint32_t dbc_set_hash(const dbc_set_t* set)
+{
+    uint32_t hash = 0x811C9DC5;
+    const uint8_t* p = (const uint8_t*)set->bits;
+    for (int i = 0; i < sizeof(set->bits); i++)
+        hash = (hash ^ p[i]) * 0x01000193;
+    return hash;
+}
+
+// -----------------------------  dbc_decode  -----------------------------
+
+uint64_t _dbc_raw(const sg_t* sg, const uint8_t* data)
+{
+    uint64_t raw = 0;
+    if (sg->little_endian) {
+        for (int i = sg->len - 1; i >= 0; i--) {
+            int bit = sg->start + i;
+            raw = (raw << 1) | ((data[bit / 8] >> (bit % 8)) & 1);
+        }
+    }
+    else {
+        // motorola: from msb, bit 7 of a byte is followed by bit 0 of the previous one
+        int bit = sg->start;
+        for (int i = 0; i < sg->len; i++) {
+            raw = (raw << 1) | ((data[bit / 8] >> (bit % 8)) & 1);
+            if (bit % 8 == 0)
+                bit += 15;
+            else
+                bit--;
+        }
+    }
+    return raw;
+}
+
+// physical value of a signal, 0 if the frame is too short
+float dbc_decode(const sg_t* sg, const uint8_t* data, uint8_t dlc)
+{
+    int last_byte = sg->little_endian ? (sg->start + sg->len - 1) / 8 : sg->start / 8 + (sg->len + 6 - sg->start % 8) / 8;
+    if (sg->len == 0 || sg->len > 64 || last_byte >= dlc) return 0;
+
+    uint64_t raw = _dbc_raw(sg, data);
+    if (sg->is_signed && sg->len < 64 && (raw >> (sg->len - 1)) & 1)
+        return (float)(int64_t)(raw | (~0ULL << sg->len)) * sg->factor + sg->offset;
+    return (float)raw * sg->factor + sg->offset;
+}
@@ -0,0 +1,70 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define SG_VALUES_MAX 4
+#define DBC_SIGNALS_MAX 512
+
+typedef struct {
+    int value;
+    const char* desc;
+} sg_value_t;
+
+// dbc signal
+typedef struct {
+    const char* name;
+    uint32_t id;
+    uint8_t start; // start bit, lsb for little endian, msb for big endian
+    uint8_t len;
+    bool little_endian;
+    bool is_signed;
+    float factor;
+    float offset;
+    float min;
+    float max;
+    const char* unit;
+    const char* desc;
+    sg_value_t values[SG_VALUES_MAX];
+} sg_t;
+
+extern const sg_t SG_132_BattVoltage132;
+extern const sg_t SG_132_SmoothBattCurrent132;
+extern const sg_t SG_257_UIspeed_signed257;
+extern const sg_t SG_292_SOCUI292;
+extern const sg_t SG_321_VCFRONT_tempAmbient;
+
+// known signals by index
+int dbc_signal_count();
+const sg_t* dbc_signal_get(int index); // NULL if out of range
+int dbc_signal_find(const char* name); // index, -1 if unknown
+
+// a set of signals by index
+typedef struct {
+    uint32_t bits[(DBC_SIGNALS_MAX + 31) / 32];
+} dbc_set_t;
+
+static inline void dbc_set_add(dbc_set_t* set, int i) { set->bits[i / 32] |= 1u << (i % 32); }
+static inline bool dbc_set_has(const dbc_set_t* set, int i) { return (set->bits[i / 32] >> (i % 32)) & 1; }
+static inline bool dbc_set_equal(const dbc_set_t* a, const dbc_set_t* b) { return memcmp(a, b, sizeof(*a)) == 0; }
+bool dbc_set_empty(const dbc_set_t* set);
+void dbc_set_all(dbc_set_t* set); // the known signals
+uint32_t dbc_set_hash(const dbc_set_t* set);
+
+float dbc_decode(const sg_t* sg, const uint8_t* data, uint8_t dlc);
@@ -17,50 +17,179 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
-#include "esp32/himem.h"
-#include "esp_err.h"
-#include "esp_heap_caps.h"
-#include "esp_timer.h"
-#include "freertos/FreeRTOS.h"
-#include "freertos/ringbuf.h"
-#include "freertos/task.h"
 #include "hal/can_types.h"
-#include "sdkconfig.h"
 
 // #define LOG_LOCAL_LEVEL 4 // ESP_LOG_DEBUG
 #include "esp_log.h"
 
-#include "can.h"
+#include "can_id.h"
+#include "dbc.h"
 #include "elm.h"
-#include "elog.h"
-#include "ota.h"
-#include "wifi.h"
+#include "elm_port.h"
+#include "filter.h"
+#include "slcan.h"
+#include "gvret.h"
+#include "canbin.h"
 
 static const char* ELM_TAG = "elm";
 
-#define ELM_MONITOR_TASK_RUN_PRIO 8
-#define ELM_MONITOR_TASK_RUN_CORE 0 // tskNO_AFFINITY
-
 #define ELM_BUFFER_LEN 128
+#define ELM_INPUT_LEN 256 // pushed input not parsed yet, commands pasted or sent back to back
 #define ELM_ST_FILTER_LEN 100
+#define ELM_FILTER_MAP_IDS 0x800 // compiled filter for all 11 bits ID
+#define ELM_MONITOR_OUT_LEN 512
+#define ELM_MONITOR_BUFFER 100
+#define ELM_MONITOR_POLL_MS 100 // timeout and plan check without frames
+#define ELM_MONITOR_BATCHES 4   // writes per run, then the other sessions run
+
+#define ELM_WORKERS 2            // event loop tasks, one per core
+#define ELM_WORKER_WAIT_MS 1000  // nothing to do
+
+#define ELM_FMT_HEADERS 0x01
+#define ELM_FMT_SPACES 0x02
+#define ELM_FMT_DLC 0x04
+#define ELM_FMT_LINEFEED 0x08
+#define ELM_FMT_SLCAN 0x10    // SLCAN frames instead of ELM lines
+#define ELM_FMT_SLCAN_TS 0x20 // SLCAN ms timestamp
+#define ELM_FMT_GVRET 0x40    // GVRET binary frames
+#define ELM_FMT_CANBIN 0x80   // CANBIN frames, the timestamp is written by the monitor
+
+#define ELM_MODE_ELM 0
+#define ELM_MODE_SLCAN 1
+#define ELM_MODE_GVRET 2
+#define ELM_MODE_CANBIN 3
+
+#define ELM_THIN_PERIOD_US (200 * 1000)           // thinning evaluation period
+#define ELM_THIN_MAX 64.0f                        // max thinning factor
+#define ELM_THIN_HIGH 0.5f                        // tx buffer occupancy or blocked ratio to thin more
+#define ELM_THIN_LOW 0.1f                         // tx buffer occupancy and blocked ratio to relax
+#define ELM_THIN_UP 1.25f
+#define ELM_THIN_DOWN 1.1f
+
+#define ELM_PLAN_PERIOD_US (2 * 1000000) // replan to follow the measured bus periods
+#define ELM_PLAN_RATE_DEFAULT 40000      // link budget B/s when the transport does not tell
+#define ELM_PLAN_INTERVAL_MAX_US (10 * 1000000)
+
+#define ELM_REQUEST_FRESH_US (200 * 1000) // latest frame max age when the ID period is unknown
+#define ELM_REQUEST_BUFFER 20
+
+#define ELM_CACHE_ENTRIES 4 // init sequences per client
+#define ELM_CACHE_PEERS 8   // clients in the store, the least recently used is evicted
+#define ELM_CACHE_INDEX_KEY "peers"
+#define ELM_FNV_OFFSET 2166136261u
+#define ELM_FNV_PRIME 16777619u
+
+#define ELM_FMT_PROFILE_MAX 4
+#define ELM_FMT_CACHE_LEN 16
+#define ELM_FMT_LINE_LEN 40 // "12345678 08 11 22 33 44 55 66 77 88 \r\n"
+#define ELM_TS_LEN 21       // "18446744073709551615 "
+
+#define ELM_TS_OFF 0
+#define ELM_TS_ABSOLUTE 1 // since boot
+#define ELM_TS_DELTA 2    // since the previous forwarded frame
 
 typedef struct {
     uint32_t pattern;
     uint32_t mask;
 } elm_filter_t;
 
+typedef struct {
+    uint32_t seq;
+    uint8_t len;
+    char line[ELM_FMT_LINE_LEN];
+} elm_fmt_line_t;
+
+// formatted lines shared by all the monitors with the same format
+typedef struct {
+    uint8_t fmt;
+    int refcount;
+    uint32_t hit;
+    uint32_t miss;
+    elm_fmt_line_t cache[ELM_FMT_CACHE_LEN];
+} elm_fmt_profile_t;
+
+// monitor adaptive thinning, follow the transport drain
+typedef struct {
+    float factor;          // 1 = no thinning
+    uint32_t* id_last_us;  // last sent timestamp per known ID
+    uint32_t period_us;    // start of the evaluation period
+    uint32_t bytes;        // written in the period
+    uint32_t blocked_us;   // time blocked in write in the period
+    uint32_t drop;         // frames dropped on tx buffer full in the period
+    uint32_t skip;         // frames thinned since last stat
+    uint32_t drop_stat;    // frames dropped since last stat
+    uint32_t drain;        // last drain rate, B/s
+    float occupancy;       // last tx buffer occupancy
+} elm_thin_t;
+
+// settings and compiled filters at the end of an init sequence
+typedef struct {
+    uint32_t hash;       // peer and init sequence, 0 = empty
+    uint32_t reset_hash; // peer and commands up to the reset starting the sequence
+    uint8_t fmt;
+    bool echo;
+    uint8_t ts;
+    bool ts_us;
+    uint32_t timeout;
+    uint8_t filter_map[ELM_FILTER_MAP_IDS / 8];
+} elm_cache_entry_t;
+
+// client cache, kept in the platform store (nvs) by transport peer
+typedef struct {
+    uint32_t next; // entry to replace
+    elm_cache_entry_t entry[ELM_CACHE_ENTRIES];
+} elm_cache_t;
+
+// peers of the store, most recently used first, 0 = empty
+typedef struct {
+    uint64_t peer[ELM_CACHE_PEERS];
+} elm_cache_index_t;
+
+// monitor rate plan, forwarding interval per known ID fitting the link budget
+typedef struct {
+    uint8_t* weight;       // per known ID, 0 = default
+    uint32_t* interval_us; // per known ID, 0 = not forwarded
+    uint32_t budget;       // B/s
+    uint32_t planned;      // B/s
+    float factor;          // thinning factor of the plan
+    uint32_t plan_us;      // last plan
+} elm_plan_t;
+
+struct elm_worker_s;
+
 typedef struct elm_globals_s {
     const char* elm_tag;
 
+    // session
+    uint32_t elm_id;
+    struct elm_globals_s* elm_next; // worker session list
+    struct elm_worker_s* elm_worker;
+    bool elm_started;               // banner written
+    uint8_t elm_mode;               // ELM_MODE_
+    bool elm_detected;              // first command seen, the mode is known
+    bool elm_closing;               // transport closed
+    char elm_in[ELM_INPUT_LEN];     // pushed input, ring
+    size_t elm_in_head;
+    size_t elm_in_len;
+    bool elm_in_short;              // a push was not taken whole, rx_resume when parsed
+    char elm_line[ELM_BUFFER_LEN];  // command being received
+    int elm_line_pos;
+    uint64_t elm_hold_us;           // output and input held until, 0 if not
+
     bool elm_echo;
     bool elm_linefeed;
     bool elm_headers;
     bool elm_spaces;
     bool elm_dlc;
+    uint8_t elm_ts;    // ELM_TS_ mode
+    bool elm_ts_us;    // timestamp in us instead of ms
+    uint64_t elm_ts_last;
     uint32_t elm_timeout;
+    uint32_t elm_header; // request ID
     char* elm_device_identifier;
     char elm_previous_cmd[ELM_BUFFER_LEN];
 
@@ -76,16 +205,55 @@ typedef struct elm_globals_s {
 
     // monitor
     bool elm_monitor;
-    bool elm_monitor_task_run;
-    FILE* elm_monitor_out;
+    elm_port_source_t* elm_monitor_src;
+    char* elm_monitor_buf;
+    uint32_t elm_monitor_last_us; // last frame through the filters
+    uint32_t elm_monitor_stat_us;
+    uint32_t elm_monitor_count;
+    uint32_t elm_monitor_write_count;
+    elm_fmt_profile_t* elm_monitor_fmt;
+    bool elm_plan_off; // full rate, no rate plan
+    bool elm_slcan_ts;
+    uint16_t elm_id_rate; // max msg/s per ID, 0 for the native rate
+    bool elm_ts_sync;     // CANBIN: next frame with the absolute time
+    elm_thin_t elm_thin;
+    elm_plan_t elm_plan;
+
+    // request waiting for a frame
+    elm_port_source_t* elm_request_src; // NULL if none
+    elm_port_job_t* elm_job;            // shell command in a helper task, NULL if none
+    uint64_t elm_request_end_us;
+
+    // transport
+    const elm_link_t* elm_link;
+    FILE* elm_out;
+
+    // client cache
+    elm_cache_t* elm_cache;  // NULL if unknown client
+    uint32_t elm_init_hash;  // commands since connect or last reset
+    bool elm_init_frozen;    // init hash taken at the first monitor start
+    uint32_t elm_reset_hash; // commands up to the last reset, 0 if none
 
     // filter
     elm_filter_t elm_filter;
     elm_filter_t pass_filter[ELM_ST_FILTER_LEN];
     elm_filter_t block_filter[ELM_ST_FILTER_LEN];
+    uint8_t elm_filter_map[ELM_FILTER_MAP_IDS / 8];
+    filter_t* elm_filter_expr; // payload predicate, NULL if none
 
 } elm_globals_t;
 
+// event loop running the sessions, the parser, command handler and
+// monitor pump never block it
+typedef struct elm_worker_s {
+    void* task;
+    elm_globals_t* sessions;
+    int count;
+} elm_worker_t;
+
+static elm_worker_t elm_workers[ELM_WORKERS];
+static uint32_t elm_session_last_id;
+
 #define G (*g)
 #define TAG G.elm_tag
 
@@ -158,6 +326,11 @@ static const elm_protocol_t elm_protocols[] = {
 /// Default timeout, milliseconds
 #define ELM_TIMEOUT 5000
 
+/// Default header, functional OBD request
+#define ELM_HEADER 0x7DF
+#define ELM_HEADER_ECU 0x7E0 // physical OBD request to the emulated ECU
+#define ELM_HEADER_ECU_RESPONSE 0x7E8
+
 /// Adaptive timing [0,1,2]
 #define ELM_ADAPTIVETIMING 1
 
@@ -165,7 +338,7 @@ static const elm_protocol_t elm_protocols[] = {
 #define ELM_DISPLAYDLC false
 
 ///
-#define ELM_CAN_AUTO_FORMAT false
+#define ELM_CAN_AUTO_FORMAT true
 
 ///
 #define ELM_CAN_FLOW_CONTROL true
@@ -213,6 +386,9 @@ static const elm_protocol_t elm_protocols[] = {
 
 void elm_monitor_start(elm_globals_t* g);
 void elm_monitor_stop(elm_globals_t* g);
+void elm_request(elm_globals_t* g, const char* cmd);
+void elm_hold(elm_globals_t* g, uint32_t ms);
+void elm_slcan_start(elm_globals_t* g, bool plan);
 
 // -----------------------------  st_filter  -----------------------------
 
@@ -237,6 +413,20 @@ bool elm_filter_add(elm_globals_t* g, elm_filter_t* filter, uint32_t pattern, ui
     return false;
 }
 
+// remove a filter added with the same pattern and mask, false if none
+bool elm_filter_remove(elm_globals_t* g, elm_filter_t* filter, uint32_t pattern, uint32_t mask)
+{
+    int i = 0;
+    while (i < ELM_ST_FILTER_LEN && filter[i].mask != 0 && (filter[i].pattern != pattern || filter[i].mask != mask))
+        i++;
+    if (i == ELM_ST_FILTER_LEN || filter[i].mask == 0) return false;
+    for (; i < ELM_ST_FILTER_LEN - 1 && filter[i].mask != 0; i++)
+        filter[i] = filter[i + 1];
+    filter[i].pattern = 0;
+    filter[i].mask = 0;
+    return true;
+}
+
 void elm_filter_log(elm_globals_t* g, elm_filter_t* filter)
 {
     ESP_LOGI(TAG, "  pattern=%03X mask=%03X", filter->pattern, filter->mask);
@@ -287,6 +477,489 @@ bool elm_filter_test(elm_globals_t* g, uint32_t id, uint32_t us)
     return ok;
 }
 
+void elm_filter_compile(elm_globals_t* g)
+{
+    memset(G.elm_filter_map, 0, sizeof(G.elm_filter_map));
+    for (uint32_t id = 0; id < ELM_FILTER_MAP_IDS; id++) {
+        if (elm_filter_test(g, id, 0))
+            G.elm_filter_map[id >> 3] |= 1 << (id & 7);
+    }
+}
+
+static inline bool elm_filter_map_test(elm_globals_t* g, uint32_t id)
+{
+    if (id < ELM_FILTER_MAP_IDS)
+        return (G.elm_filter_map[id >> 3] & (1 << (id & 7))) != 0;
+    return elm_filter_test(g, id, 0);
+}
+
+// -----------------------------  elm_fmt  -----------------------------
+
+static const char elm_hex_digits[] = "0123456789ABCDEF";
+
+static elm_fmt_profile_t elm_fmt_profiles[ELM_FMT_PROFILE_MAX];
+
+static inline char* elm_format_hex8(char* p, uint8_t b)
+{
+    *p++ = elm_hex_digits[b >> 4];
+    *p++ = elm_hex_digits[b & 0xf];
+    return p;
+}
+
+// frame timestamp, in decimal and followed by a space
+// uptime us, absolute timestamps do not wrap
+size_t elm_format_ts(elm_globals_t* g, uint64_t ts, char* buf)
+{
+    uint64_t t = G.elm_ts == ELM_TS_DELTA ? ts - G.elm_ts_last : ts;
+    G.elm_ts_last = ts;
+    if (!G.elm_ts_us) t /= 1000;
+
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + t % 10;
+        t /= 10;
+    } while (t);
+    char* p = buf;
+    while (n > 0)
+        *p++ = digits[--n];
+    *p++ = ' ';
+    return p - buf;
+}
+
+size_t elm_format_can(uint8_t fmt, const can_message_t* msg, char* buf)
+{
+    char* p = buf;
+    if (fmt & ELM_FMT_HEADERS) {
+        uint32_t id = msg->identifier;
+        int n = 3;
+        while (n < 8 && (id >> (4 * n)) != 0)
+            n++;
+        while (n-- > 0)
+            *p++ = elm_hex_digits[(id >> (4 * n)) & 0xf];
+        if (fmt & ELM_FMT_SPACES) *p++ = ' ';
+    }
+    if (fmt & ELM_FMT_DLC) {
+        p = elm_format_hex8(p, msg->data_length_code);
+        if (fmt & ELM_FMT_SPACES) *p++ = ' ';
+    }
+    for (int i = 0; i < msg->data_length_code && i < 8; i++) {
+        p = elm_format_hex8(p, msg->data[i]);
+        if (fmt & ELM_FMT_SPACES) *p++ = ' ';
+    }
+    *p++ = '\r';
+    if (fmt & ELM_FMT_LINEFEED) *p++ = '\n';
+    return p - buf;
+}
+
+uint8_t elm_fmt_get(elm_globals_t* g)
+{
+    return (G.elm_headers ? ELM_FMT_HEADERS : 0) |
+           (G.elm_spaces ? ELM_FMT_SPACES : 0) |
+           (G.elm_dlc ? ELM_FMT_DLC : 0) |
+           (G.elm_linefeed ? ELM_FMT_LINEFEED : 0);
+}
+
+// format of the forwarded frames
+uint8_t elm_monitor_fmt_get(elm_globals_t* g)
+{
+    if (G.elm_mode == ELM_MODE_SLCAN) return ELM_FMT_SLCAN | (G.elm_slcan_ts ? ELM_FMT_SLCAN_TS : 0);
+    if (G.elm_mode == ELM_MODE_GVRET) return ELM_FMT_GVRET;
+    if (G.elm_mode == ELM_MODE_CANBIN) return ELM_FMT_CANBIN;
+    return elm_fmt_get(g);
+}
+
+size_t elm_format_frame(uint8_t fmt, const can_message_timestamp_t* msg, char* buf)
+{
+    if (fmt & ELM_FMT_GVRET)
+        return gvret_format(&msg->msg, (uint32_t)msg->timestamp, buf);
+    if (fmt & ELM_FMT_CANBIN)
+        return canbin_format(&msg->msg, buf);
+    if (fmt & ELM_FMT_SLCAN)
+        return slcan_format(&msg->msg, fmt & ELM_FMT_SLCAN_TS ? (int32_t)(msg->timestamp / 1000 % 60000) : -1, buf);
+    return elm_format_can(fmt, &msg->msg, buf);
+}
+
+elm_fmt_profile_t* elm_fmt_acquire(uint8_t fmt)
+{
+    elm_fmt_profile_t* profile = NULL;
+    elm_port_lock();
+    for (int i = 0; i < ELM_FMT_PROFILE_MAX; i++) {
+        if (elm_fmt_profiles[i].refcount > 0 && elm_fmt_profiles[i].fmt == fmt) {
+            profile = &elm_fmt_profiles[i];
+            break;
+        }
+    }
+    if (profile == NULL) {
+        for (int i = 0; i < ELM_FMT_PROFILE_MAX; i++) {
+            if (elm_fmt_profiles[i].refcount == 0) {
+                profile = &elm_fmt_profiles[i];
+                memset(profile, 0, sizeof(*profile));
+                profile->fmt = fmt;
+                break;
+            }
+        }
+    }
+    if (profile) profile->refcount++;
+    elm_port_unlock();
+    return profile;
+}
+
+void elm_fmt_release(elm_fmt_profile_t* profile)
+{
+    if (profile == NULL) return;
+    elm_port_lock();
+    profile->refcount--;
+    elm_port_unlock();
+}
+
+// format msg in buf, only the first monitor of a profile format a msg, the others copy it
+size_t elm_fmt_line(elm_fmt_profile_t* profile, const can_message_timestamp_t* msg, char* buf)
+{
+    elm_fmt_line_t* line = &profile->cache[msg->seq % ELM_FMT_CACHE_LEN];
+    size_t len = 0;
+
+    elm_port_lock();
+    if (line->seq == msg->seq) {
+        len = line->len;
+        memcpy(buf, line->line, len);
+        profile->hit++;
+    }
+    elm_port_unlock();
+    if (len > 0) return len;
+
+    len = elm_format_frame(profile->fmt, msg, buf);
+
+    elm_port_lock();
+    memcpy(line->line, buf, len);
+    line->len = len;
+    line->seq = msg->seq;
+    profile->miss++;
+    elm_port_unlock();
+    return len;
+}
+
+// -----------------------------  elm_thin  -----------------------------
+
+void elm_thin_update(elm_globals_t* g, uint32_t us)
+{
+    elm_thin_t* t = &G.elm_thin;
+    uint32_t time_us = us - t->period_us;
+    if (time_us < ELM_THIN_PERIOD_US) return;
+
+    float occupancy = 0;
+    const elm_link_t* link = G.elm_link;
+    if (link && link->tx_free && link->tx_size) {
+        size_t free = link->tx_free(link->ctx);
+        if (free < link->tx_size) occupancy = 1.0f - (float)free / link->tx_size;
+    }
+    float blocked = (float)t->blocked_us / time_us;
+
+    if (t->drop > 0 || occupancy > ELM_THIN_HIGH || blocked > ELM_THIN_HIGH) {
+        t->factor *= ELM_THIN_UP;
+        if (t->factor > ELM_THIN_MAX) t->factor = ELM_THIN_MAX;
+    }
+    else if (occupancy < ELM_THIN_LOW && blocked < ELM_THIN_LOW && t->factor > 1.0f) {
+        t->factor /= ELM_THIN_DOWN;
+        if (t->factor < 1.0f) t->factor = 1.0f;
+    }
+
+    t->occupancy = occupancy;
+    t->drain = (uint32_t)((float)t->bytes / ((float)time_us / 1000000));
+    t->drop_stat += t->drop;
+    t->bytes = 0;
+    t->blocked_us = 0;
+    t->drop = 0;
+    t->period_us = us;
+}
+
+// the per ID table is kept for the next monitor of the session
+bool elm_thin_init(elm_globals_t* g)
+{
+    elm_thin_t* t = &G.elm_thin;
+    uint32_t* id_last_us = t->id_last_us;
+    memset(t, 0, sizeof(*t));
+    t->factor = 1.0f;
+    t->period_us = elm_port_time_us();
+    if (id_last_us)
+        memset(id_last_us, 0, can_id_get_count() * sizeof(uint32_t));
+    else
+        id_last_us = calloc(can_id_get_count(), sizeof(uint32_t));
+    t->id_last_us = id_last_us;
+    return t->id_last_us != NULL;
+}
+
+void elm_thin_deinit(elm_globals_t* g)
+{
+    free(G.elm_thin.id_last_us);
+    G.elm_thin.id_last_us = NULL;
+}
+
+// -----------------------------  elm_plan  -----------------------------
+
+// weight, line cost (B) and max rate (msg/s) of a known ID
+void elm_plan_id(elm_globals_t* g, int i, uint8_t fmt, float* w, uint32_t* cost, float* max_rate)
+{
+    // CAN priority: low IDs weight more by default
+    *w = G.elm_plan.weight[i] ? G.elm_plan.weight[i] : 10.0f * (1.5f - (float)i / can_id_get_count());
+
+    uint32_t period_us;
+    uint8_t dlc;
+    if (!can_id_stat(i, &period_us, &dlc)) {
+        period_us = 0;
+        dlc = 8;
+    }
+    can_message_timestamp_t msg = {.msg = {.identifier = can_id_get(i), .data_length_code = dlc}};
+    char line[ELM_FMT_LINE_LEN];
+    *cost = elm_format_frame(fmt, &msg, line);
+    if (fmt & ELM_FMT_CANBIN)
+        *cost += 2; // delta
+    else if (G.elm_ts != ELM_TS_OFF)
+        *cost += G.elm_ts == ELM_TS_DELTA ? 3 : 8; // typical width
+
+    *max_rate = CAN_ID_PLAN_MAX_RATE;
+    if (period_us > 0 && 1000000.0f / period_us < *max_rate) *max_rate = 1000000.0f / period_us;
+    if (G.elm_id_rate > 0 && G.elm_id_rate < *max_rate) *max_rate = G.elm_id_rate;
+}
+
+// maximize sum(w * log(rate)) with sum(cost * rate) <= budget and rate <= max rate:
+// rate = w * budget / (cost * sum(w)), IDs over their max rate are capped and the rest shared again
+void elm_plan_compute(elm_globals_t* g, uint32_t us)
+{
+    elm_plan_t* p = &G.elm_plan;
+    int count = can_id_get_count();
+    uint8_t fmt = elm_monitor_fmt_get(g);
+    const elm_link_t* link = G.elm_link;
+    float factor = G.elm_thin.factor > 1.0f ? G.elm_thin.factor : 1.0f;
+    uint32_t rate = link ? (link->rate_get ? link->rate_get(link->ctx) : link->rate) : 0;
+    float budget = (rate ? rate : ELM_PLAN_RATE_DEFAULT) / factor;
+    float left = budget;
+    float w_sum = 0;
+
+    for (int i = 0; i < count; i++) {
+        p->interval_us[i] = 0;
+        if (!elm_filter_map_test(g, can_id_get(i))) continue;
+        float w, max_rate;
+        uint32_t cost;
+        elm_plan_id(g, i, fmt, &w, &cost, &max_rate);
+        p->interval_us[i] = UINT32_MAX; // not planned
+        w_sum += w;
+    }
+
+    bool capped = true;
+    while (capped && w_sum > 0) {
+        capped = false;
+        for (int i = 0; i < count; i++) {
+            if (p->interval_us[i] != UINT32_MAX) continue;
+            float w, max_rate;
+            uint32_t cost;
+            elm_plan_id(g, i, fmt, &w, &cost, &max_rate);
+            if (w * left / (w_sum * cost) >= max_rate) {
+                p->interval_us[i] = (uint32_t)(1000000 / max_rate);
+                left -= max_rate * cost;
+                w_sum -= w;
+                capped = true;
+            }
+        }
+    }
+
+    p->planned = (uint32_t)(budget - left);
+    for (int i = 0; i < count; i++) {
+        if (p->interval_us[i] != UINT32_MAX) continue;
+        float w, max_rate;
+        uint32_t cost;
+        elm_plan_id(g, i, fmt, &w, &cost, &max_rate);
+        float rate = w * left / (w_sum * cost);
+        p->interval_us[i] = rate > 1000000.0f / ELM_PLAN_INTERVAL_MAX_US ? (uint32_t)(1000000 / rate) : ELM_PLAN_INTERVAL_MAX_US;
+        p->planned += (uint32_t)(rate * cost);
+    }
+
+    p->budget = (uint32_t)budget;
+    p->factor = G.elm_thin.factor;
+    p->plan_us = us;
+    ESP_LOGD(TAG, "plan budget=%uB/s planned=%uB/s thin=%.2f", p->budget, p->planned, factor);
+}
+
+// return false if the frame is not in the plan now
+bool elm_plan_test(elm_globals_t* g, uint32_t id, uint32_t ts)
+{
+    elm_thin_t* t = &G.elm_thin;
+    int i = can_id_index(id);
+    if (i < 0 || t->id_last_us == NULL) return true;
+
+    // tolerate 1/8 of jitter, or a 100 ms native period would be forwarded every 200 ms
+    uint32_t interval_us = G.elm_plan.interval_us[i];
+    if ((ts - t->id_last_us[i]) < interval_us - interval_us / 8) {
+        t->skip++;
+        return false;
+    }
+    t->id_last_us[i] = ts;
+    return true;
+}
+
+void elm_plan_print(elm_globals_t* g)
+{
+    elm_plan_t* p = &G.elm_plan;
+    int count = can_id_get_count();
+    uint8_t fmt = elm_fmt_get(g);
+
+    fprintf(G.elm_out, "BUDGET %u PLANNED %u THIN %.2f DRAIN %u%s", p->budget, p->planned, p->factor, G.elm_thin.drain, ELM_NEWLINE(g));
+    fprintf(G.elm_out, "ID    W PERIOD COST   RATE%s", ELM_NEWLINE(g));
+    for (int i = 0; i < count; i++) {
+        if (p->interval_us[i] == 0) continue;
+        float w, max_rate;
+        uint32_t cost;
+        elm_plan_id(g, i, fmt, &w, &cost, &max_rate);
+        uint32_t period_us;
+        uint8_t dlc;
+        if (!can_id_stat(i, &period_us, &dlc)) period_us = 0;
+        fprintf(G.elm_out, "%03X %3.0f %6u %4u %6.2f%s",
+               can_id_get(i), w, period_us / 1000, cost, 1000000.0f / p->interval_us[i], ELM_NEWLINE(g));
+    }
+}
+
+// -----------------------------  elm_cache  -----------------------------
+
+uint32_t elm_hash(uint32_t h, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+    while (len--)
+        h = (h ^ *p++) * ELM_FNV_PRIME;
+    return h;
+}
+
+void elm_cache_key(uint64_t peer, char* key)
+{
+    sprintf(key, "p%012llx", (unsigned long long)peer);
+}
+
+// move the peer first in the store index, the last one is evicted when
+// full; written only when the order changes
+void elm_cache_touch(elm_globals_t* g)
+{
+    uint64_t peer = G.elm_link->peer;
+    elm_cache_index_t index;
+    if (!elm_port_store_get(ELM_CACHE_INDEX_KEY, &index, sizeof(index))) memset(&index, 0, sizeof(index));
+    if (index.peer[0] == peer) return;
+
+    // the peer, the first empty place or the last one
+    int i = 0;
+    while (i < ELM_CACHE_PEERS - 1 && index.peer[i] != peer && index.peer[i] != 0)
+        i++;
+    if (index.peer[i] != peer && index.peer[i] != 0) {
+        char key[16];
+        elm_cache_key(index.peer[i], key);
+        ESP_LOGI(TAG, "client %s evicted from cache", key);
+        elm_port_store_del(key);
+    }
+    memmove(&index.peer[1], &index.peer[0], i * sizeof(*index.peer));
+    index.peer[0] = peer;
+    if (!elm_port_store_set(ELM_CACHE_INDEX_KEY, &index, sizeof(index)))
+        ESP_LOGE(TAG, "cache index write error");
+}
+
+// state after a reset only depends on the commands that follow
+void elm_cache_seq_reset(elm_globals_t* g)
+{
+    G.elm_reset_hash = G.elm_init_hash;
+    uint64_t peer = G.elm_link ? G.elm_link->peer : 0;
+    G.elm_init_hash = elm_hash(ELM_FNV_OFFSET, &peer, sizeof(peer));
+    G.elm_init_frozen = false;
+}
+
+// add a command to the init sequence, case and spaces are not significant
+void elm_cache_seq(elm_globals_t* g, const char* cmd)
+{
+    if (G.elm_init_frozen) return;
+    for (; *cmd; cmd++) {
+        if (*cmd == ' ') continue;
+        char c = TO_UPPER(*cmd);
+        G.elm_init_hash = elm_hash(G.elm_init_hash, &c, 1);
+    }
+    G.elm_init_hash = elm_hash(G.elm_init_hash, "\r", 1);
+}
+
+void elm_cache_load(elm_globals_t* g)
+{
+    if (G.elm_link == NULL || G.elm_link->peer == 0) return;
+
+    char key[16];
+    elm_cache_key(G.elm_link->peer, key);
+    elm_cache_t* cache = malloc(sizeof(elm_cache_t));
+    if (cache && elm_port_store_get(key, cache, sizeof(elm_cache_t))) {
+        ESP_LOGI(TAG, "known client %s", key);
+        G.elm_cache = cache;
+        elm_cache_touch(g);
+    }
+    else
+        free(cache);
+}
+
+// a new peer evicts the least recently used one before its write
+void elm_cache_save(elm_globals_t* g)
+{
+    char key[16];
+    elm_cache_key(G.elm_link->peer, key);
+    elm_cache_touch(g);
+    if (!elm_port_store_set(key, G.elm_cache, sizeof(elm_cache_t)))
+        ESP_LOGE(TAG, "cache write error %s", key);
+}
+
+// the commands up to this reset started a cached init sequence: the
+// client has known settings, the reset needs no delay
+bool elm_cache_reset_known(elm_globals_t* g)
+{
+    if (G.elm_cache == NULL || G.elm_init_frozen) return false;
+    for (int i = 0; i < ELM_CACHE_ENTRIES; i++) {
+        elm_cache_entry_t* e = &G.elm_cache->entry[i];
+        if (e->hash != 0 && e->reset_hash == G.elm_init_hash) return true;
+    }
+    return false;
+}
+
+// restore the state of a known init sequence, false if unknown
+bool elm_cache_restore(elm_globals_t* g)
+{
+    if (G.elm_cache == NULL) return false;
+    for (int i = 0; i < ELM_CACHE_ENTRIES; i++) {
+        elm_cache_entry_t* e = &G.elm_cache->entry[i];
+        if (e->hash != G.elm_init_hash) continue;
+        G.elm_headers = (e->fmt & ELM_FMT_HEADERS) != 0;
+        G.elm_spaces = (e->fmt & ELM_FMT_SPACES) != 0;
+        G.elm_dlc = (e->fmt & ELM_FMT_DLC) != 0;
+        G.elm_linefeed = (e->fmt & ELM_FMT_LINEFEED) != 0;
+        G.elm_echo = e->echo;
+        G.elm_ts = e->ts;
+        G.elm_ts_us = e->ts_us;
+        G.elm_timeout = e->timeout;
+        memcpy(G.elm_filter_map, e->filter_map, sizeof(G.elm_filter_map));
+        ESP_LOGI(TAG, "init sequence %08X restored from cache", G.elm_init_hash);
+        return true;
+    }
+    return false;
+}
+
+void elm_cache_store(elm_globals_t* g)
+{
+    if (G.elm_link == NULL || G.elm_link->peer == 0) return;
+    if (G.elm_cache == NULL) {
+        G.elm_cache = calloc(1, sizeof(elm_cache_t));
+        if (G.elm_cache == NULL) return;
+    }
+    elm_cache_entry_t* e = &G.elm_cache->entry[G.elm_cache->next];
+    G.elm_cache->next = (G.elm_cache->next + 1) % ELM_CACHE_ENTRIES;
+    e->hash = G.elm_init_hash;
+    e->reset_hash = G.elm_reset_hash;
+    e->fmt = elm_fmt_get(g);
+    e->echo = G.elm_echo;
+    e->ts = G.elm_ts;
+    e->ts_us = G.elm_ts_us;
+    e->timeout = G.elm_timeout;
+    memcpy(e->filter_map, G.elm_filter_map, sizeof(e->filter_map));
+    ESP_LOGI(TAG, "init sequence %08X stored in cache", G.elm_init_hash);
+    elm_cache_save(g);
+}
+
 // -----------------------------  util  -----------------------------
 
 void elm_reset(elm_globals_t* g)
@@ -296,7 +969,10 @@ void elm_reset(elm_globals_t* g)
     G.elm_headers = ELM_HEADERS;
     G.elm_spaces = ELM_SPACES;
     G.elm_dlc = ELM_DISPLAYDLC;
+    G.elm_ts = ELM_TS_OFF;
+    G.elm_ts_us = false;
     G.elm_timeout = ELM_TIMEOUT;
+    G.elm_header = ELM_HEADER;
     G.elm_previous_cmd[0] = 0;
 
     G.elm_memory = ELM_MEMORY;
@@ -314,35 +990,39 @@ void elm_reset(elm_globals_t* g)
     G.elm_filter.mask = 0;
     elm_filter_clear(g, G.pass_filter);
     elm_filter_clear(g, G.block_filter);
+    filter_free(G.elm_filter_expr);
+    G.elm_filter_expr = NULL;
+    memset(G.elm_plan.weight, 0, can_id_get_count() * sizeof(uint8_t));
+    G.elm_id_rate = 0;
+    elm_cache_seq_reset(g);
 }
 
+// output is flushed by the session once the input chunk is done
 void elm_newline(elm_globals_t* g)
 {
-    printf(ELM_NEWLINE(g));
-    fflush(stdout);
+    fputs(ELM_NEWLINE(g), G.elm_out);
 }
 
 void elm_writeln(elm_globals_t* g, const char* str)
 {
-    if (str) printf(str);
+    if (str) fputs(str, G.elm_out);
     elm_newline(g);
 }
 
 void elm_write_prompt(elm_globals_t* g)
 {
-    printf(ELM_PROMPT);
-    fflush(stdout);
+    fputs(ELM_PROMPT, G.elm_out);
 }
 
 void elm_write_ok(elm_globals_t* g)
 {
-    printf(ELM_OK_PROMPT);
+    fputs(ELM_OK_PROMPT, G.elm_out);
     elm_newline(g);
 }
 
 void elm_write_error(elm_globals_t* g)
 {
-    printf(ELM_ERROR_PROMPT);
+    fputs(ELM_ERROR_PROMPT, G.elm_out);
     elm_newline(g);
 }
 
@@ -366,6 +1046,18 @@ elm_protocol_t elm_get_protocol(char protocol_num)
     return elm_protocols[p];
 }
 
+bool elm_is_hexa(const char* c)
+{
+    bool digit = false;
+    for (; *c; c++) {
+        if ((*c >= '0' && *c <= '9') || (*c >= 'A' && *c <= 'F') || (*c >= 'a' && *c <= 'f'))
+            digit = true;
+        else if (*c != ' ')
+            return false;
+    }
+    return digit;
+}
+
 char* elm_read_hexa(char* c, uint32_t* h)
 {
     *h = 0;
@@ -410,125 +1102,37 @@ char* elm_read_str(char* c, char** str)
     return c;
 }
 
-// -----------------------------  cmd_ps  -----------------------------
-
-int _cmd_ps_cmp(const void* a, const void* b)
-{
-    const TaskStatus_t* pa = a;
-    const TaskStatus_t* pb = b;
-    if (pa->xTaskNumber > pb->xTaskNumber) return 1;
-    if (pa->xTaskNumber < pb->xTaskNumber) return -1;
-    return 0;
-}
+// -----------------------------  elm_do_cmd  -----------------------------
 
-int cmd_ps()
+// answer a shell command, a pending one is answered by elm_job_pump
+void elm_shell_end(elm_globals_t* g, elm_port_shell_t shell)
 {
-    static uint32_t prev_totalRunTime;
-    static TaskStatus_t* prev_stats = NULL;
-
-    uint32_t n = uxTaskGetNumberOfTasks();
-    TaskStatus_t* stats = malloc(n * sizeof(TaskStatus_t));
-    if (stats == NULL) {
-        fprintf(stderr, "ps: no mem\r\n");
-        return 1;
-    }
-
-    uint32_t totalRunTime;
-    uint32_t m = uxTaskGetSystemState(stats, n, &totalRunTime);
-    if (m < n) {
-        fprintf(stderr, "ps: error getting status\r\n");
-        return 1;
-    }
-
-    qsort(stats, n, sizeof(TaskStatus_t), _cmd_ps_cmp);
-
-    static const char* state_char = "*RBSD";
-    printf("PID  STAT  PRIO    HWM  CORE  LAST  TOTAL  NAME\r\n");
-    float t = (float)totalRunTime / 100.0f;
-    float t_last = (float)(totalRunTime - prev_totalRunTime) / 100.0f;
-    if (t == 0) t = 1;
-    if (t_last == 0) t_last = 1;
-
-    for (int i = 0; i < n; i++) {
-
-        int i_last = 0;
-        while (prev_stats != NULL && i_last >= 0 && stats[i].xTaskNumber != prev_stats[i_last].xTaskNumber) {
-            i_last++;
-            if (i_last >= n) i_last = -1;
-        }
-
-        printf("%3u    %c   %3u   %5u   %2hd %5.1f%% %5.1f%%  %s\r\n",
-               stats[i].xTaskNumber,
-               state_char[stats[i].eCurrentState],
-               stats[i].uxCurrentPriority,
-               stats[i].usStackHighWaterMark,
-               (int)stats[i].xCoreID,
-               (prev_stats != NULL && i_last >= 0) ? (float)(stats[i].ulRunTimeCounter - prev_stats[i_last].ulRunTimeCounter) / t_last : (float)stats[i].ulRunTimeCounter / t,
-               (float)stats[i].ulRunTimeCounter / t,
-               stats[i].pcTaskName);
+    if (shell == ELM_PORT_SHELL_OK || shell == ELM_PORT_SHELL_ERROR) {
+        elm_write_ok_error(g, shell == ELM_PORT_SHELL_OK);
+        G.elm_previous_cmd[0] = 0;
     }
-
-    free(prev_stats);
-    prev_totalRunTime = totalRunTime;
-    prev_stats = stats;
-
-    return 0;
-}
-
-// -----------------------------  cmd_free  -----------------------------
-
-void _cmd_free_print_info(const char* name, multi_heap_info_t* info)
-{
-    printf("%-10s %10u %10u %10u %10u %10u\r\n",
-           name,
-           info->total_allocated_bytes + info->total_free_bytes,
-           info->total_allocated_bytes,
-           info->total_free_bytes,
-           info->largest_free_block,
-           info->minimum_free_bytes);
+    else if (shell == ELM_PORT_SHELL_SYNTAX)
+        elm_writeln(g, ELM_QUERY_PROMPT);
 }
 
-// void himem_get_info(multi_heap_info_t* info)
-// {
-//     memset(info, 0, sizeof(*info));
-//     info->total_free_bytes = esp_himem_get_free_size();
-//     info->total_allocated_bytes = esp_himem_get_phys_size() - info->total_free_bytes;
-// }
-
-int cmd_free()
+// answer the shell command of the helper task when done, return false
+// while still running
+bool elm_job_pump(elm_globals_t* g)
 {
-    multi_heap_info_t multi_heap_info;
-
-    printf("                total       used       free    largest   life-min\r\n");
-    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_DEFAULT);
-    _cmd_free_print_info("DEFAULT:", &multi_heap_info);
-    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_INTERNAL);
-    _cmd_free_print_info("INTERNAL:", &multi_heap_info);
-    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_SPIRAM);
-    _cmd_free_print_info("SPIRAM:", &multi_heap_info);
-    // himem_get_info(&multi_heap_info);
-    // _cmd_free_print_info("HIMEM:", &multi_heap_info);
-
-    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_EXEC);
-    _cmd_free_print_info("EXEC:", &multi_heap_info);
-    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_32BIT);
-    _cmd_free_print_info("32BIT:", &multi_heap_info);
-    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_8BIT);
-    _cmd_free_print_info("8BIT:", &multi_heap_info);
-    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_DMA);
-    _cmd_free_print_info("DMA:", &multi_heap_info);
-    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_INVALID);
-    _cmd_free_print_info("INVALID:", &multi_heap_info);
-
-    return 0;
+    elm_port_shell_t shell = elm_port_job_poll(G.elm_job, G.elm_out);
+    if (shell == ELM_PORT_SHELL_PENDING) return false;
+    G.elm_job = NULL;
+    elm_shell_end(g, shell);
+    elm_write_prompt(g);
+    fflush(G.elm_out);
+    return true;
 }
 
-// -----------------------------  elm_do_cmd  -----------------------------
-
 void elm_do_cmd(elm_globals_t* g, char* cmd)
 {
     if (cmd == NULL) return;
     ESP_LOGD(TAG, "Do cmd: '%s'", cmd);
+    elm_cache_seq(g, cmd);
 
     // Previous command v1.0
     if (*cmd == 0) {
@@ -543,112 +1147,22 @@ void elm_do_cmd(elm_globals_t* g, char* cmd)
 
     // do shell commands
 
-    if (strcasecmp(cmd, "REBOOT") == 0 || strcasecmp(cmd, "RESTART") == 0) {
-        esp_restart();
-        return;
-    }
-    if (strcasecmp(cmd, "PS") == 0) {
-        printf("\r\n");
-        cmd_ps();
-        return;
-    }
-    else if (strcasecmp(cmd, "FREE") == 0) {
-        printf("\r\n");
-        cmd_free();
-        return;
-    }
-    else if (strncasecmp(cmd, "ELOG", 4) == 0) {
-        cmd += 4;
-        while (*cmd == ' ')
-            cmd++;
-        uint32_t level = ESP_LOG_INFO;
-        char* tag = "*";
-        if (*cmd != 0) cmd = elm_read_hexa(cmd, &level);
-        while (*cmd == ' ')
-            cmd++;
-        if (*cmd != 0) tag = cmd;
-        elog_out_set(stdout);
-        elog_level_set(tag, level);
+    elm_port_shell_t shell = elm_port_shell(cmd, G.elm_out, &G.elm_job);
+    if (shell != ELM_PORT_SHELL_NONE) {
+        elm_shell_end(g, shell);
         return;
     }
-    else if (strncasecmp(cmd, "SIMU", 4) == 0) {
-        cmd += 4;
-        while (*cmd == ' ')
-            cmd++;
-        if (strncasecmp(cmd, "START", 3) == 0) {
-            can_simu_start();
-            return;
-        }
-        else if (strncasecmp(cmd, "STOP", 3) == 0) {
-            can_simu_stop();
-            return;
-        }
-    }
-    else if (strncasecmp(cmd, "WIFI", 4) == 0) {
-        cmd += 4;
-        while (*cmd == ' ')
-            cmd++;
-
-        if (*cmd == 0) {
-            printf("\r\n");
-            wifi_status();
-            return;
-        }
-        else if (strncasecmp(cmd, "STA", 3) == 0) {
-            cmd += 3;
-            while (*cmd == ' ')
-                cmd++;
-            if (*cmd == 0) {
-                // elm_write_ok_error(g, wifi_sta_disc(false));
-                return;
-            }
 
-            char* ssid;
-            char* pwd;
-            cmd = elm_read_str(cmd, &ssid);
-            cmd = elm_read_str(cmd, &pwd);
-            elm_write_ok_error(g, wifi_sta(ssid, pwd));
-            G.elm_previous_cmd[0] = 0;
-            return;
-        }
-        else if (strncasecmp(cmd, "AP", 2) == 0) {
-            cmd += 2;
-            while (*cmd == ' ')
-                cmd++;
-            if (*cmd == 0) return;
-
-            char* ssid;
-            char* pwd;
-            cmd = elm_read_str(cmd, &ssid);
-            cmd = elm_read_str(cmd, &pwd);
-            ESP_LOGI(TAG, "set wifi ap ssid='%s' pwd='%s'", ssid, pwd);
-            elm_write_ok_error(g, wifi_ap(ssid, pwd));
-            G.elm_previous_cmd[0] = 0;
-            return;
-        }
-        else if (strncasecmp(cmd, "STOP", 4) == 0) {
-            elm_write_ok_error(g, wifi_stop());
-            G.elm_previous_cmd[0] = 0;
-            return;
-        }
-        else if (strncasecmp(cmd, "SCAN", 4) == 0) {
-            printf("\r\n");
-            wifi_scan();
-            return;
-        }
-    }
-    else if (strncasecmp(cmd, "OTA", 3) == 0) {
-        cmd += 3;
-        while (*cmd == ' ')
-            cmd++;
-        if (*cmd == 0) {
-            ota_info();
-            return;
-        }
-        else {
-            ota_update(cmd);
-            return;
-        }
+    // switch the session to SLCAN, full rate or in the rate plan
+    else if (strncasecmp(cmd, "SLCAN", 5) == 0) {
+        char* c = cmd + 5;
+        while (*c == ' ')
+            c++;
+        if (*c != 0 && strcasecmp(c, "PLAN") != 0) goto _err;
+        ESP_LOGI(TAG, "%s ->  SLCAN mode", cmd);
+        elm_slcan_start(g, *c != 0);
+        fputs(SLCAN_OK, G.elm_out);
+        return;
     }
 
     // do ST commands
@@ -746,6 +1260,34 @@ void elm_do_cmd(elm_globals_t* g, char* cmd)
             elm_write_ok(g);
             return;
         }
+        // Clear the payload filter expression
+        if (strcasecmp(c, "FEC") == 0) {
+            ESP_LOGI(TAG, "%s ->  Clear filter expression", cmd);
+            filter_free(G.elm_filter_expr);
+            G.elm_filter_expr = NULL;
+            elm_write_ok(g);
+            return;
+        }
+        // Set the payload filter expression
+        if (strncasecmp(c, "FE", 2) == 0) {
+            c += 2;
+            while (*c == ' ')
+                c++;
+            if (*c == 0) goto _err;
+
+            const char* err = NULL;
+            filter_t* f = filter_compile(c, &err);
+            if (f == NULL) {
+                ESP_LOGW(TAG, "%s ->  Filter expression error: %s", cmd, err);
+                elm_writeln(g, "??");
+                return;
+            }
+            ESP_LOGI(TAG, "%s ->  Set filter expression", cmd);
+            filter_free(G.elm_filter_expr);
+            G.elm_filter_expr = f;
+            elm_write_ok(g);
+            return;
+        }
         // // Add flow control filter
         // if (strncasecmp(c, "FFCA", 3) == 0 || strncasecmp(c, "FAFC", 3) == 0) {
         //     elm_write_ok(g);
@@ -756,6 +1298,55 @@ void elm_do_cmd(elm_globals_t* g, char* cmd)
         //     elm_write_ok(g);
         //     return;
         // }
+        // Timestamp mode: 0 off, 1 absolute, 2 delta
+        if (strncasecmp(c, "TS", 2) == 0 && c[2] >= '0' && c[2] <= '2' && c[3] == 0) {
+            G.elm_ts = c[2] - '0';
+            ESP_LOGI(TAG, "%s ->  Timestamp %s", cmd, G.elm_ts == ELM_TS_OFF ? "off" : G.elm_ts == ELM_TS_ABSOLUTE ? "absolute" : "delta");
+            elm_write_ok(g);
+            return;
+        }
+        // Timestamp resolution: 0 ms, 1 us
+        if (strncasecmp(c, "TSU", 3) == 0 && (c[3] == '0' || c[3] == '1') && c[4] == 0) {
+            G.elm_ts_us = c[3] != '0';
+            ESP_LOGI(TAG, "%s ->  Timestamp resolution %s", cmd, G.elm_ts_us ? "us" : "ms");
+            elm_write_ok(g);
+            return;
+        }
+        // Print the rate plan of the current filters
+        if (strcasecmp(c, "RP") == 0) {
+            ESP_LOGI(TAG, "%s ->  Print rate plan", cmd);
+            elm_filter_compile(g);
+            elm_plan_compute(g, elm_port_time_us());
+            elm_plan_print(g);
+            return;
+        }
+        // Set the plan weight of an ID, 0 for default
+        if (strncasecmp(c, "PW", 2) == 0) {
+            c += 2;
+            while (*c == ' ')
+                c++;
+            if (*c == 0) goto _err;
+
+            uint32_t id;
+            uint32_t w;
+            c = elm_read_hexa(c, &id);
+            while (*c == ' ')
+                c++;
+            if (*c != ',') goto _err;
+            c++;
+            while (*c == ' ')
+                c++;
+            c = elm_read_hexa(c, &w);
+            int i = can_id_index(id);
+            ESP_LOGI(TAG, "%s ->  Set plan weight id=0x%03X w=%u", cmd, id, w);
+            if (i < 0 || w > 0xFF) {
+                elm_writeln(g, "??");
+                return;
+            }
+            G.elm_plan.weight[i] = w;
+            elm_write_ok(g);
+            return;
+        }
         if (strcasecmp(c, "M") == 0) {
             ESP_LOGI(TAG, "%s ->  Monitor bus using current filters", cmd);
             elm_monitor_start(g);
@@ -991,14 +1582,14 @@ void elm_do_cmd(elm_globals_t* g, char* cmd)
         if (strcasecmp(c, "DP") == 0) { // OBD v1.0
             ESP_LOGI(TAG, "%s ->  Describe the current Protocol", cmd);
             elm_protocol_t p = elm_get_protocol(G.elm_protocol);
-            printf("%s%s%s", G.elm_protocol_auto ? "Auto, " : "", p.desc, ELM_NEWLINE(g));
+            fprintf(G.elm_out, "%s%s%s", G.elm_protocol_auto ? "Auto, " : "", p.desc, ELM_NEWLINE(g));
             return;
         }
 
         if (strcasecmp(c, "DPN") == 0) { // OBD v1.0
             ESP_LOGI(TAG, "%s ->  Describe the current Protocol Num", cmd);
             elm_protocol_t p = elm_get_protocol(G.elm_protocol);
-            printf("%s%s%s", G.elm_protocol_auto ? "A" : "", p.num, ELM_NEWLINE(g));
+            fprintf(G.elm_out, "%s%s%s", G.elm_protocol_auto ? "A" : "", p.num, ELM_NEWLINE(g));
             return;
         }
 
@@ -1304,14 +1895,18 @@ void elm_do_cmd(elm_globals_t* g, char* cmd)
         //     return;
         // }
 
-        // if (strncasecmp(c, "SH", 2) == 0) { // OBD v1.0
-        //     c += 2;
-        //     while (*c == ' ')
-        //         c++;
-        //     ESP_LOGI(TAG, "%s ->  -Set Header %s", cmd, c);
-        //     elm_write_ok(g);
-        //     return;
-        // }
+        if (strncasecmp(c, "SH", 2) == 0) { // OBD v1.0
+            c += 2;
+            while (*c == ' ')
+                c++;
+            if (*c == 0) goto _err;
+            uint32_t h;
+            c = elm_read_hexa(c, &h);
+            ESP_LOGI(TAG, "%s ->  Set Header 0x%X", cmd, h);
+            G.elm_header = h;
+            elm_write_ok(g);
+            return;
+        }
 
         // if (strcasecmp(c, "SI") == 0) { // ISO v1.4
         //     ESP_LOGI(TAG, "%s ->  -perform a Slow Initiation", cmd);
@@ -1415,109 +2010,394 @@ void elm_do_cmd(elm_globals_t* g, char* cmd)
 
         if (strcasecmp(c, "WS") == 0) { // General v1.0
             ESP_LOGI(TAG, "%s ->  Warm Start", cmd);
+            bool known = elm_cache_reset_known(g);
             elm_reset(g);
-            vTaskDelay(100 / 2);
+            if (!known) elm_hold(g, 500); // known init sequence, no need to wait
             elm_writeln(g, ELM_VERSION_STRING);
             return;
         }
 
         if (strcasecmp(c, "Z") == 0) { // General v1.0
             ESP_LOGI(TAG, "%s ->  Reset all", cmd);
+            bool known = elm_cache_reset_known(g);
             elm_reset(g);
-            vTaskDelay(100);
+            if (!known) elm_hold(g, 1000); // known init sequence, no need to wait
             elm_writeln(g, ELM_VERSION_STRING);
             return;
         }
     }
 
+    // do requests
+
+    else if (elm_is_hexa(cmd)) {
+        elm_request(g, cmd);
+        return;
+    }
+
 _err:
     if (*cmd) ESP_LOGW(TAG, "Unreconized command '%s'", cmd);
     elm_writeln(g, ELM_QUERY_PROMPT);
 }
 
-// -----------------------------  elm_monitor  -----------------------------
+// -----------------------------  elm_obd  -----------------------------
+
+// OBD mode 01 PID: A [B ...] = value * scale + offset, big endian
+typedef struct {
+    uint8_t pid;
+    uint8_t len;    // data bytes, 1..4
+    const sg_t* sg; // NULL for a constant
+    float scale;
+    float offset;
+} elm_pid_t;
+
+static const elm_pid_t elm_pids[] = {
+    {0x0D, 1, &SG_257_UIspeed_signed257, 1, 0},    // vehicle speed, km/h
+    {0x46, 1, &SG_321_VCFRONT_tempAmbient, 1, 40}, // ambient air temperature, A - 40 C
+    {0x51, 1, NULL, 0, 0x08},                      // fuel type: electric
+    {0x5B, 1, &SG_292_SOCUI292, 2.55f, 0},         // hybrid battery pack remaining life, A / 2.55 %
+};
+
+#define ELM_PIDS_LEN (sizeof(elm_pids) / sizeof(*elm_pids))
+
+// supported PIDs [base+1, base+0x20], the last bit tells if the next range has some
+uint32_t elm_obd_supported(uint8_t base)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < ELM_PIDS_LEN; i++) {
+        int n = elm_pids[i].pid - base - 1;
+        if (n >= 0 && n < 32) bits |= 1u << (31 - n);
+        if (n >= 32) bits |= 1;
+    }
+    return bits;
+}
+
+// PID data from the latest decoded frames, 0 if not available
+int elm_obd_pid(uint8_t pid, uint8_t* data)
+{
+    uint32_t v;
+    int len = 4;
+    if ((pid & 0x1F) == 0) {
+        v = elm_obd_supported(pid);
+        if (v == 0 && pid != 0) return 0;
+    }
+    else {
+        const elm_pid_t* p = NULL;
+        for (int i = 0; i < ELM_PIDS_LEN; i++) {
+            if (elm_pids[i].pid == pid) p = &elm_pids[i];
+        }
+        if (p == NULL) return 0;
+
+        float value = 0;
+        if (p->sg) {
+            can_message_timestamp_t msg;
+            if (!can_id_latest_get(p->sg->id, &msg)) return 0;
+            value = dbc_decode(p->sg, msg.msg.data, msg.msg.data_length_code);
+        }
+        float raw = value * p->scale + p->offset + 0.5f;
+        uint32_t max = p->len == 4 ? UINT32_MAX : (1u << (8 * p->len)) - 1;
+        v = raw < 0 ? 0 : raw > max ? max : (uint32_t)raw;
+        len = p->len;
+    }
+    for (int i = 0; i < len; i++)
+        data[i] = v >> (8 * (len - 1 - i));
+    return len;
+}
 
-bool _elm_write_can(elm_globals_t* g, can_message_t* msg)
+// answer an OBD request from the cache, without bus round trip
+void elm_obd_request(elm_globals_t* g, const char* cmd)
 {
-    if (G.elm_headers) {
-        fprintf(G.elm_monitor_out, "%03X", msg->identifier);
-        if (G.elm_spaces) fprintf(G.elm_monitor_out, " ");
+    uint8_t req[8];
+    int n = 0;
+    int digits = 0;
+    for (const char* c = cmd; *c && n < sizeof(req); c++) {
+        if (*c == ' ') continue;
+        uint8_t h = *c <= '9' ? *c - '0' : TO_UPPER(*c) - 'A' + 10;
+        if (digits++ % 2 == 0)
+            req[n] = h << 4;
+        else
+            req[n++] |= h;
+    }
+
+    // mode 01, single PID; an odd last digit is the ELM response count
+    uint8_t data[8] = {0};
+    int len = 0;
+    if (n >= 2 && req[0] == 0x01) len = elm_obd_pid(req[1], data + 3);
+    if (len == 0) {
+        ESP_LOGI(TAG, "%s ->  obd " ELM_NODATA_PROMPT, cmd);
+        elm_writeln(g, ELM_NODATA_PROMPT);
+        return;
     }
-    if (G.elm_dlc) {
-        fprintf(G.elm_monitor_out, "%02X", msg->data_length_code);
-        if (G.elm_spaces) fprintf(G.elm_monitor_out, " ");
+    data[0] = len + 2; // single frame PCI
+    data[1] = req[0] + 0x40;
+    data[2] = req[1];
+
+    can_message_t msg = {.identifier = ELM_HEADER_ECU_RESPONSE};
+    if (!G.elm_headers && G.elm_can_auto_format) {
+        // without headers, auto format hides the PCI byte
+        memcpy(msg.data, data + 1, len + 2);
+        msg.data_length_code = len + 2;
     }
-    for (int i = 0; i < msg->data_length_code; i++) {
-        fprintf(G.elm_monitor_out, "%02X", msg->data[i]);
-        if (G.elm_spaces) fprintf(G.elm_monitor_out, " ");
+    else {
+        memcpy(msg.data, data, len + 3);
+        msg.data_length_code = len + 3;
     }
-    fprintf(G.elm_monitor_out, ELM_NEWLINE(g));
-    return fflush(G.elm_monitor_out) >= 0;
+    char line[ELM_FMT_LINE_LEN];
+    size_t line_len = elm_format_can(elm_fmt_get(g), &msg, line);
+    ESP_LOGI(TAG, "%s ->  obd pid 0x%02X", cmd, req[1]);
+    fwrite(line, 1, line_len, G.elm_out);
 }
 
-void elm_monitor_task(void* param)
+// -----------------------------  elm_request  -----------------------------
+
+// latest frame of id if fresh, else subscribe and wait for the next one,
+// false and G.elm_request_src set while waiting
+bool elm_request_frame(elm_globals_t* g, uint32_t id, can_message_timestamp_t* msg)
 {
-    elm_globals_t* g = (elm_globals_t*)param;
-    ESP_LOGI(TAG, "Monitor task started");
+    int i = can_id_index(id);
+    if (i < 0) return false;
+
+    uint32_t period_us;
+    uint8_t dlc;
+    uint32_t fresh_us = can_id_stat(i, &period_us, &dlc) ? 2 * period_us : ELM_REQUEST_FRESH_US;
+    if (can_id_latest_get(id, msg) && (uint32_t)(elm_port_time_us() - msg->timestamp) <= fresh_us)
+        return true;
+
+    elm_port_source_t* src = elm_port_source_new(ELM_REQUEST_BUFFER);
+    if (src == NULL) {
+        ESP_LOGE(TAG, "request error create buffer, nomem");
+        return false;
+    }
+    // a frame may have come before the buffer
+    if (can_id_latest_get(id, msg) && (uint32_t)(elm_port_time_us() - msg->timestamp) <= fresh_us) {
+        elm_port_source_del(src);
+        return true;
+    }
+    G.elm_request_src = src;
+    G.elm_request_end_us = elm_port_time_us() + (uint64_t)G.elm_timeout * 1000;
+    return false;
+}
 
-    stdout = G.elm_monitor_out;
-    G.elm_monitor_task_run = true;
+void elm_request_end(elm_globals_t* g)
+{
+    elm_port_source_del(G.elm_request_src);
+    G.elm_request_src = NULL;
+}
 
-    RingbufHandle_t buf = can_ringbuf_new(50);
-    if (buf == NULL) {
-        ESP_LOGE(TAG, "monitor error create buffer, nomem");
-        goto _exit;
+void elm_request_write(elm_globals_t* g, const char* cmd, const can_message_timestamp_t* msg)
+{
+    char line[ELM_FMT_LINE_LEN];
+    size_t len = elm_format_can(elm_fmt_get(g), &msg->msg, line);
+    ESP_LOGI(TAG, "%s ->  request 0x%03X age=%ums", cmd, G.elm_header, (uint32_t)(elm_port_time_us() - msg->timestamp) / 1000);
+    fwrite(line, 1, len, G.elm_out);
+}
+
+// answer a request with the latest frame of the header ID
+void elm_request(elm_globals_t* g, const char* cmd)
+{
+    if (G.elm_header == ELM_HEADER || G.elm_header == ELM_HEADER_ECU) {
+        elm_obd_request(g, cmd);
+        return;
+    }
+
+    can_message_timestamp_t msg;
+    if (elm_request_frame(g, G.elm_header, &msg)) {
+        elm_request_write(g, cmd, &msg);
+        return;
     }
+    if (G.elm_request_src) return; // answered by elm_request_pump
+
+    ESP_LOGI(TAG, "%s ->  request 0x%03X " ELM_NODATA_PROMPT, cmd, G.elm_header);
+    elm_writeln(g, ELM_NODATA_PROMPT);
+}
+
+// answer the request waiting for a frame when it comes or on timeout,
+// return false while still waiting
+bool elm_request_pump(elm_globals_t* g)
+{
+    can_message_timestamp_t msg;
+    while (elm_port_source_receive(G.elm_request_src, &msg, 0)) {
+        if (msg.msg.identifier != G.elm_header) continue;
+        elm_request_end(g);
+        elm_request_write(g, "", &msg);
+        elm_write_prompt(g);
+        fflush(G.elm_out);
+        return true;
+    }
+    if (elm_port_time_us() < G.elm_request_end_us) return false;
+
+    elm_request_end(g);
+    ESP_LOGI(TAG, "request 0x%03X " ELM_NODATA_PROMPT, G.elm_header);
+    elm_writeln(g, ELM_NODATA_PROMPT);
+    elm_write_prompt(g);
+    fflush(G.elm_out);
+    return true;
+}
+
+// -----------------------------  elm_monitor  -----------------------------
 
-    uint32_t stat_us = esp_timer_get_time();
-    uint32_t last_us = stat_us;
-    uint32_t count = 0;
+bool _elm_write_out(elm_globals_t* g, const char* buf, size_t len)
+{
+    if (len > 0 && fwrite(buf, 1, len, G.elm_out) != len) return false;
+    return fflush(G.elm_out) >= 0;
+}
 
-    while (G.elm_monitor) {
+// the source and buffers stay with the session, a client toggles the
+// monitor between each command
+void elm_monitor_end(elm_globals_t* g)
+{
+    ESP_LOGI(TAG, "Monitor ended");
+    if (G.elm_monitor_src) elm_port_source_enable(G.elm_monitor_src, false);
+    elm_fmt_release(G.elm_monitor_fmt);
+    G.elm_monitor_fmt = NULL;
+    G.elm_monitor = false;
+}
 
-        size_t size;
-        can_message_timestamp_t* rx_msg = xRingbufferReceive(buf, &size, pdMS_TO_TICKS(100)); // min timeout: 100 ms
-        uint32_t us = esp_timer_get_time();
+void elm_monitor_free(elm_globals_t* g)
+{
+    elm_port_source_del(G.elm_monitor_src);
+    G.elm_monitor_src = NULL;
+    free(G.elm_monitor_buf);
+    G.elm_monitor_buf = NULL;
+    elm_thin_deinit(g);
+}
 
-        // filter
-        if (rx_msg) {
-            if (elm_filter_test(g, rx_msg->msg.identifier, rx_msg->timestamp)) {
-                // write data
-                last_us = rx_msg->timestamp;
-                count++;
-                if (!_elm_write_can(g, &rx_msg->msg)) {
+// forward the pending frames, return true if some are left for the next run
+bool elm_monitor_pump(elm_globals_t* g)
+{
+    char* out = G.elm_monitor_buf;
+    uint32_t us = elm_port_time_us();
+    bool more = false;
+
+    for (int batch = 0; batch < ELM_MONITOR_BATCHES; batch++) {
+
+        size_t out_len = 0;
+        uint32_t out_count = 0;
+        can_message_timestamp_t msg;
+        can_message_timestamp_t* rx_msg = &msg;
+        bool rx = elm_port_source_receive(G.elm_monitor_src, rx_msg, 0);
+        more = false;
+
+        // filter and format all pending msg, then write them at once
+        while (rx) {
+            if (elm_filter_map_test(g, rx_msg->msg.identifier)) {
+                G.elm_monitor_last_us = rx_msg->timestamp;
+                if ((G.elm_filter_expr == NULL || filter_run(G.elm_filter_expr, &rx_msg->msg)) &&
+                    (G.elm_plan_off || elm_plan_test(g, rx_msg->msg.identifier, rx_msg->timestamp))) {
+                    out_count++;
+                    if (G.elm_ts != ELM_TS_OFF && G.elm_mode == ELM_MODE_ELM) out_len += elm_format_ts(g, rx_msg->timestamp, out + out_len);
+                    if (G.elm_mode == ELM_MODE_CANBIN) {
+                        out_len += canbin_format_ts(rx_msg->timestamp, &G.elm_ts_last, G.elm_ts_sync, out + out_len);
+                        G.elm_ts_sync = false;
+                    }
+                    out_len += elm_fmt_line(G.elm_monitor_fmt, rx_msg, out + out_len);
+                }
+            }
+            if (out_len > ELM_MONITOR_OUT_LEN - ELM_FMT_LINE_LEN - ELM_TS_LEN) {
+                more = true;
+                break;
+            }
+            rx = elm_port_source_receive(G.elm_monitor_src, rx_msg, 0);
+        }
+        if (out_len > 0) {
+            const elm_link_t* link = G.elm_link;
+            if (link && link->tx_free && link->tx_free(link->ctx) < out_len) {
+                // tx buffer full, do not write a partial line
+                G.elm_thin.drop += out_count;
+                G.elm_ts_sync = true; // the deltas of the next write are from dropped frames
+            }
+            else {
+                G.elm_monitor_count += out_count;
+                G.elm_monitor_write_count++;
+                uint32_t write_start_us = elm_port_time_us();
+                bool ok = _elm_write_out(g, out, out_len);
+                uint32_t write_us = elm_port_time_us();
+                G.elm_thin.blocked_us += write_us - write_start_us;
+                G.elm_thin.bytes += out_len;
+                if (!ok) {
                     // error
                     ESP_LOGE(TAG, "monitor write error %s", strerror(errno));
-                    break;
+                    elm_monitor_end(g);
+                    return false;
                 }
+                us = write_us;
             }
-            vRingbufferReturnItem(buf, rx_msg);
-        }
-        // test timeout
-        if ((us - last_us) >= G.elm_timeout * 1000) {
-            ESP_LOGW(TAG, "monitor timeout");
-            printf(ELM_NODATA_PROMPT "%s", ELM_NEWLINE(g));
-            fflush(stdout);
-            break;
         }
+        if (!more) break;
+    }
 
-        // stat
-        uint32_t time_us = us - stat_us;
-        if (time_us >= 10 * 1000000) {
-            ESP_LOGI(TAG, "monitor stat: count=%u %i/s",
-                     count,
-                     (int)((float)count / ((float)time_us / 1000000)));
-            count = 0;
-            stat_us = us;
-        }
+    elm_thin_update(g, us);
+    if (G.elm_thin.factor != G.elm_plan.factor || (us - G.elm_plan.plan_us) >= ELM_PLAN_PERIOD_US)
+        elm_plan_compute(g, us);
+    // test timeout, a SLCAN channel stays open on a quiet bus
+    if (G.elm_mode == ELM_MODE_ELM && (us - G.elm_monitor_last_us) >= G.elm_timeout * 1000) {
+        ESP_LOGW(TAG, "monitor timeout");
+        fprintf(G.elm_out, ELM_NODATA_PROMPT "%s", ELM_NEWLINE(g));
+        fflush(G.elm_out);
+        elm_monitor_end(g);
+        return false;
     }
 
-_exit:
-    ESP_LOGI(TAG, "Monitor task ended");
-    can_ringbuf_del(buf);
-    G.elm_monitor = false;
-    G.elm_monitor_task_run = false;
-    vTaskDelete(NULL);
+    // stat
+    uint32_t time_us = us - G.elm_monitor_stat_us;
+    if (time_us >= 10 * 1000000) {
+        ESP_LOGI(TAG, "monitor stat: count=%u %i/s write=%i/s fmt hit=%u miss=%u plan=%u/%uB/s thin=%.2f skip=%u drop=%u drain=%uB/s txbuf=%.0f%%",
+                 G.elm_monitor_count,
+                 (int)((float)G.elm_monitor_count / ((float)time_us / 1000000)),
+                 (int)((float)G.elm_monitor_write_count / ((float)time_us / 1000000)),
+                 G.elm_monitor_fmt->hit,
+                 G.elm_monitor_fmt->miss,
+                 G.elm_plan.planned,
+                 G.elm_plan.budget,
+                 G.elm_thin.factor,
+                 G.elm_thin.skip,
+                 G.elm_thin.drop_stat,
+                 G.elm_thin.drain,
+                 G.elm_thin.occupancy * 100);
+        G.elm_monitor_count = 0;
+        G.elm_monitor_write_count = 0;
+        G.elm_thin.skip = 0;
+        G.elm_thin.drop_stat = 0;
+        G.elm_monitor_stat_us = us;
+    }
+    return more;
+}
+
+// start forwarding the frames with the compiled filters, false on error
+bool elm_monitor_open(elm_globals_t* g)
+{
+    G.elm_monitor_fmt = elm_fmt_acquire(elm_monitor_fmt_get(g));
+    if (G.elm_monitor_fmt == NULL) {
+        ESP_LOGE(TAG, "monitor error no format profile available");
+        return false;
+    }
+    G.elm_monitor = true;
+    if (G.elm_monitor_src == NULL) G.elm_monitor_src = elm_port_source_new(ELM_MONITOR_BUFFER);
+    if (G.elm_monitor_src == NULL) {
+        ESP_LOGE(TAG, "monitor error create buffer, nomem");
+        elm_monitor_end(g);
+        return false;
+    }
+    // frames queued before the start are not forwarded, the full rate
+    // modes keep the default bus guard
+    elm_port_source_enable(G.elm_monitor_src, true);
+    elm_port_source_planned(G.elm_monitor_src, !G.elm_plan_off);
+    if (G.elm_monitor_buf == NULL) G.elm_monitor_buf = malloc(ELM_MONITOR_OUT_LEN);
+    if (G.elm_monitor_buf == NULL || !elm_thin_init(g)) {
+        ESP_LOGE(TAG, "monitor error create out buffer, nomem");
+        elm_monitor_end(g);
+        return false;
+    }
+    uint64_t now_us = elm_port_time_us();
+    uint32_t us = now_us;
+    elm_plan_compute(g, us);
+    G.elm_ts_last = now_us;
+    G.elm_ts_sync = true;
+    G.elm_monitor_last_us = us;
+    G.elm_monitor_stat_us = us;
+    G.elm_monitor_count = 0;
+    G.elm_monitor_write_count = 0;
+    fflush(G.elm_out);
+    return true;
 }
 
 void elm_monitor_start(elm_globals_t* g)
@@ -1526,9 +2406,19 @@ void elm_monitor_start(elm_globals_t* g)
         return;
     ESP_LOGI(TAG, "Start monitor");
 
-    G.elm_monitor = true;
-    fflush(stdin);
-    xTaskCreatePinnedToCore(elm_monitor_task, "elm-monitor", 4 * 1024, g, ELM_MONITOR_TASK_RUN_PRIO, NULL, ELM_MONITOR_TASK_RUN_CORE);
+    // the init sequence ends at the first monitor, later toggles of the
+    // monitor and filters are not part of it
+    if (G.elm_init_frozen)
+        elm_filter_compile(g);
+    else {
+        G.elm_init_frozen = true;
+        if (!elm_cache_restore(g)) {
+            elm_filter_compile(g);
+            elm_cache_store(g);
+        }
+    }
+    if (!elm_monitor_open(g))
+        elm_write_error(g);
 }
 
 void elm_monitor_stop(elm_globals_t* g)
@@ -1537,13 +2427,207 @@ void elm_monitor_stop(elm_globals_t* g)
         return;
     ESP_LOGI(TAG, "Stop monitor");
 
-    G.elm_monitor = false;
+    elm_monitor_end(g);
+    if (G.elm_mode == ELM_MODE_ELM) fprintf(G.elm_out, "%s" ELM_PROMPT, ELM_NEWLINE(g));
+    fflush(G.elm_out);
+}
+
+// -----------------------------  elm_slcan  -----------------------------
+
+// the bus is fixed at 500 kbit/s listen only: bitrate commands are
+// acknowledged, transmit is refused, M/m map to the 11 bits AT filter
+
+void elm_slcan_start(elm_globals_t* g, bool plan)
+{
+    if (G.elm_monitor) elm_monitor_end(g);
+    G.elm_mode = ELM_MODE_SLCAN;
+    G.elm_detected = true;
+    G.elm_plan_off = !plan;
+}
+
+void elm_slcan_cmd(elm_globals_t* g, const char* cmd)
+{
+    const char* reply = SLCAN_ERROR;
+
+    switch (cmd[0]) {
+    case 'O':
+    case 'L':
+        if (G.elm_monitor) break;
+        ESP_LOGI(TAG, "SLCAN open");
+        elm_filter_compile(g);
+        if (elm_monitor_open(g)) reply = SLCAN_OK;
+        break;
+    case 'C':
+        if (G.elm_monitor) elm_monitor_end(g);
+        reply = SLCAN_OK;
+        break;
+    case 'S':
+    case 's':
+        if (slcan_is_cmd(cmd)) reply = SLCAN_OK;
+        break;
+    case 'Z':
+        if (!slcan_is_cmd(cmd)) break;
+        G.elm_slcan_ts = cmd[1] == '1';
+        reply = SLCAN_OK;
+        break;
+    case 'V':
+        reply = "V1013\r";
+        break;
+    case 'v':
+        reply = "v1013\r";
+        break;
+    case 'N':
+        reply = "NTSLP\r";
+        break;
+    case 'F':
+        reply = "F00\r";
+        break;
+    case 'M':
+        if (!slcan_is_cmd(cmd)) break;
+        G.elm_filter.pattern = (strtoul(cmd + 1, NULL, 16) >> 21) & 0x7FF;
+        reply = SLCAN_OK;
+        break;
+    case 'm':
+        // mask bits set are don't care
+        if (!slcan_is_cmd(cmd)) break;
+        G.elm_filter.mask = ~(strtoul(cmd + 1, NULL, 16) >> 21) & 0x7FF;
+        reply = SLCAN_OK;
+        break;
+    case 0:
+        reply = SLCAN_OK;
+        break;
+    }
+    if (reply[0] == '\a') ESP_LOGW(TAG, "SLCAN %s ->  error", cmd);
+    fputs(reply, G.elm_out);
+}
 
-    while (G.elm_monitor_task_run)
-        vTaskDelay(10);
+// -----------------------------  elm_gvret  -----------------------------
 
-    fprintf(G.elm_monitor_out, "%s" ELM_PROMPT, ELM_NEWLINE(g));
-    fflush(G.elm_monitor_out);
+// binary mode of a binary link, the frames are streamed at once through
+// the rate plan; the bus is listen only, transmit and setup are ignored
+
+void elm_gvret_start(elm_globals_t* g)
+{
+    ESP_LOGI(TAG, "GVRET binary mode");
+    if (G.elm_monitor) elm_monitor_end(g);
+    G.elm_mode = ELM_MODE_GVRET;
+    G.elm_detected = true;
+    G.elm_plan_off = false;
+    elm_filter_compile(g);
+    elm_monitor_open(g);
+}
+
+void elm_gvret_cmd(elm_globals_t* g, const uint8_t* cmd)
+{
+    char reply[GVRET_REPLY_LEN];
+    size_t len = gvret_reply(cmd, elm_port_time_us(), reply);
+    if (len > 0) {
+        fwrite(reply, 1, len, G.elm_out);
+        return;
+    }
+    if (cmd[1] == GVRET_BUILD_CAN_FRAME || cmd[1] == GVRET_ECHO_CAN_FRAME)
+        ESP_LOGI(TAG, "GVRET frame ignored, listen only");
+    else
+        ESP_LOGI(TAG, "GVRET cmd %02X ignored", cmd[1]);
+}
+
+// -----------------------------  elm_canbin  -----------------------------
+
+// binary mode of a binary link for dashboards, the subscriptions are ST
+// filters: pass filters, or block filters while all IDs are streamed
+
+void elm_canbin_start(elm_globals_t* g)
+{
+    ESP_LOGI(TAG, "CANBIN binary mode");
+    if (G.elm_monitor) elm_monitor_end(g);
+    G.elm_mode = ELM_MODE_CANBIN;
+    G.elm_detected = true;
+    G.elm_plan_off = false;
+    G.elm_id_rate = 0;
+    G.elm_filter.pattern = 0;
+    G.elm_filter.mask = 0;
+    elm_filter_clear(g, G.pass_filter);
+    elm_filter_clear(g, G.block_filter);
+    filter_free(G.elm_filter_expr);
+    G.elm_filter_expr = NULL;
+}
+
+bool elm_canbin_subscribe(elm_globals_t* g, const uint8_t* p, size_t len, bool subscribe)
+{
+    if (len % 4 != 0) return false;
+    for (; len > 0; p += 4, len -= 4) {
+        uint32_t id = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        uint32_t mask = id & (1u << 31) ? CAN_EXTD_ID_MASK : CAN_STD_ID_MASK;
+        id &= mask;
+        ESP_LOGI(TAG, "CANBIN %s id=0x%03X", subscribe ? "subscribe" : "unsubscribe", id);
+        if (subscribe) {
+            elm_filter_remove(g, G.block_filter, id, mask);
+            elm_filter_remove(g, G.pass_filter, id, mask);
+            if (!elm_filter_add(g, G.pass_filter, id, mask)) return false;
+        }
+        else if (!elm_filter_remove(g, G.pass_filter, id, mask) && G.pass_filter[0].mask == 0) {
+            elm_filter_remove(g, G.block_filter, id, mask);
+            if (!elm_filter_add(g, G.block_filter, id, mask)) return false;
+        }
+    }
+    return true;
+}
+
+void elm_canbin_cmd(elm_globals_t* g, const uint8_t* cmd, size_t len)
+{
+    uint8_t op = cmd[1];
+    const uint8_t* p = cmd + 3;
+    size_t n = len - 3;
+    bool ok = len >= 3 && canbin_cmd_len(cmd, len) == len;
+    bool filters = false;
+
+    if (ok) {
+        switch (op) {
+        case CANBIN_SUBSCRIBE:
+        case CANBIN_UNSUBSCRIBE:
+            ok = elm_canbin_subscribe(g, p, n, op == CANBIN_SUBSCRIBE);
+            filters = true;
+            break;
+        case CANBIN_CLEAR:
+            ESP_LOGI(TAG, "CANBIN clear subscriptions");
+            elm_filter_clear(g, G.pass_filter);
+            elm_filter_clear(g, G.block_filter);
+            filters = true;
+            break;
+        case CANBIN_RATE:
+            ok = n == 2;
+            if (!ok) break;
+            G.elm_id_rate = p[0] | p[1] << 8;
+            ESP_LOGI(TAG, "CANBIN rate %u/s per ID", G.elm_id_rate);
+            filters = true;
+            break;
+        case CANBIN_STREAM_START:
+            ESP_LOGI(TAG, "CANBIN start");
+            if (!G.elm_monitor) {
+                elm_filter_compile(g);
+                ok = elm_monitor_open(g);
+            }
+            break;
+        case CANBIN_STREAM_STOP:
+            ESP_LOGI(TAG, "CANBIN stop");
+            if (G.elm_monitor) elm_monitor_end(g);
+            break;
+        default:
+            ESP_LOGI(TAG, "CANBIN cmd %02X unknown", op);
+            ok = false;
+        }
+    }
+    else {
+        ESP_LOGW(TAG, "CANBIN cmd %02X too long", op);
+    }
+    // the stream goes on with the new subscriptions
+    if (filters && G.elm_monitor) {
+        elm_filter_compile(g);
+        elm_plan_compute(g, elm_port_time_us());
+    }
+
+    char reply[CANBIN_REPLY_LEN];
+    fwrite(reply, 1, canbin_reply(op, ok, reply), G.elm_out);
 }
 
 // -----------------------------  elm_globals_  -----------------------------
@@ -1558,7 +2642,16 @@ elm_globals_t* elm_globals_init(const char* tag)
     }
     memset(g, 0, sizeof(*g));
     G.elm_tag = tag;
-    G.elm_monitor_out = stdout;
+    G.elm_out = stdout;
+    G.elm_plan.weight = calloc(can_id_get_count(), sizeof(uint8_t));
+    G.elm_plan.interval_us = calloc(can_id_get_count(), sizeof(uint32_t));
+    if (G.elm_plan.weight == NULL || G.elm_plan.interval_us == NULL) {
+        ESP_LOGE(ELM_TAG, "no mem for plan");
+        free(G.elm_plan.weight);
+        free(G.elm_plan.interval_us);
+        free(g);
+        return NULL;
+    }
     elm_reset(g);
     return g;
 }
@@ -1566,82 +2659,331 @@ elm_globals_t* elm_globals_init(const char* tag)
 void elm_globals_deinit(elm_globals_t* g)
 {
     elm_monitor_stop(g);
+    elm_monitor_free(g);
+    elm_request_end(g);
+    if (G.elm_job) elm_port_job_drop(G.elm_job);
     free(G.elm_device_identifier);
+    free(G.elm_plan.weight);
+    free(G.elm_plan.interval_us);
+    free(G.elm_cache);
+    filter_free(G.elm_filter_expr);
     free(g);
 }
 
-// -----------------------------  elm_do  -----------------------------
+// -----------------------------  elm_session  -----------------------------
 
-void elm_do(const char* tag)
+// flush, then hold the output and the input for ms, as a device reset does
+void elm_hold(elm_globals_t* g, uint32_t ms)
 {
-    // init
-    elm_globals_t* g = elm_globals_init(tag);
-    if (g == NULL) return;
-
-    // loop
-    elm_writeln(g, NULL);
-    printf("TeslapLX %s", TAG);
-    elm_writeln(g, NULL);
-    elm_write_prompt(g);
+    fflush(G.elm_out);
+    G.elm_hold_us = elm_port_time_us() + (uint64_t)ms * 1000;
+}
 
-    char line[ELM_BUFFER_LEN];
-    int pos = 0;
-    while (true) {
-        int c = fgetc(stdin);
-        if (c == 0) continue;
-        if (c == '\n') continue; // do not stop monitor
-        if (c < 0) {
-            ESP_LOGW(TAG, "stop on EOF");
-            break;
+// return false on ctrl-D
+bool elm_session_char(elm_globals_t* g, uint8_t c)
+{
+    // GVRET: binary commands, the bytes before F1 are skipped
+    if (G.elm_mode == ELM_MODE_GVRET) {
+        if (G.elm_line_pos == 0 && c != GVRET_START) return true;
+        G.elm_line[G.elm_line_pos++] = c;
+        if (gvret_cmd_len((uint8_t*)G.elm_line, G.elm_line_pos) > 0) {
+            elm_gvret_cmd(g, (uint8_t*)G.elm_line);
+            G.elm_line_pos = 0;
         }
-        if (c == 4) {
-            ESP_LOGW(TAG, "stop on ctrl-D");
-            break;
+        return true;
+    }
+    if (c == GVRET_BINARY && G.elm_line_pos == 0 && G.elm_mode == ELM_MODE_ELM && G.elm_link && G.elm_link->binary) {
+        elm_gvret_start(g);
+        return true;
+    }
+    if (c == CANBIN_START && G.elm_line_pos == 0 && G.elm_mode == ELM_MODE_ELM && G.elm_link && G.elm_link->binary)
+        elm_canbin_start(g);
+    // CANBIN: binary commands, the bytes before CB are skipped, a command
+    // longer than the line is refused
+    if (G.elm_mode == ELM_MODE_CANBIN) {
+        if (G.elm_line_pos == 0 && c != CANBIN_START) return true;
+        G.elm_line[G.elm_line_pos++] = c;
+        if (canbin_cmd_len((uint8_t*)G.elm_line, G.elm_line_pos) > 0 || G.elm_line_pos == ELM_BUFFER_LEN) {
+            elm_canbin_cmd(g, (uint8_t*)G.elm_line, G.elm_line_pos);
+            G.elm_line_pos = 0;
         }
-        if (G.elm_monitor) {
-            ESP_LOGW(TAG, "char %i receveid, stop monitor", c);
-            elm_monitor_stop(g);
+        return true;
+    }
+
+    if (c == 0) return true;
+    if (c == '\n') return true; // do not stop monitor
+    if (c == 4) {
+        ESP_LOGW(TAG, "stop on ctrl-D");
+        return false;
+    }
+
+    // SLCAN: no echo, no prompt, the channel stays open between commands
+    if (G.elm_mode == ELM_MODE_SLCAN) {
+        if (c == '\r') {
+            G.elm_line[G.elm_line_pos] = 0;
+            elm_slcan_cmd(g, G.elm_line);
+            G.elm_line_pos = 0;
+        }
+        else if (c >= ' ' && G.elm_line_pos < ELM_BUFFER_LEN - 1) {
+            G.elm_line[G.elm_line_pos++] = c;
         }
+        return true;
+    }
 
-        switch (c) {
-        case 8:
-        case 127:
-            if (pos > 0) {
-                pos--;
-                printf("\b \b");
-                fflush(stdout);
-            }
-            break;
+    if (G.elm_monitor) {
+        ESP_LOGW(TAG, "char %i receveid, stop monitor", c);
+        elm_monitor_stop(g);
+    }
 
-        case '\r':
-            line[pos] = 0;
-            elm_newline(g);
-            elm_newline(g);
-            elm_do_cmd(g, line);
-            // new cmd
-            pos = 0;
-            line[0] = 0;
-            if (!G.elm_monitor) {
-                elm_write_prompt(g);
-                fflush(stdout);
+    switch (c) {
+    case 8:
+    case 127:
+        if (G.elm_line_pos > 0) {
+            G.elm_line_pos--;
+            if (G.elm_detected) fputs("\b \b", G.elm_out);
+        }
+        break;
+
+    case '\r':
+        G.elm_line[G.elm_line_pos] = 0;
+        // the first command tells a SLCAN client, its echo waits until then
+        if (!G.elm_detected && G.elm_line_pos > 0) {
+            G.elm_detected = true;
+            if (slcan_is_cmd(G.elm_line)) {
+                ESP_LOGI(TAG, "%s ->  SLCAN client detected", G.elm_line);
+                elm_slcan_start(g, false);
+                elm_slcan_cmd(g, G.elm_line);
+                G.elm_line_pos = 0;
+                break;
             }
-            break;
+            if (G.elm_echo) fputs(G.elm_line, G.elm_out);
+        }
+        elm_newline(g);
+        elm_newline(g);
+        elm_do_cmd(g, G.elm_line);
+        // new cmd
+        G.elm_line_pos = 0;
+        G.elm_line[0] = 0;
+        if (!G.elm_monitor && G.elm_request_src == NULL && G.elm_job == NULL && G.elm_mode == ELM_MODE_ELM)
+            elm_write_prompt(g);
+        break;
+
+    default:
+        if (c < ' ') break;
+        if (G.elm_line_pos >= ELM_BUFFER_LEN - 1) break;
+        G.elm_line[G.elm_line_pos++] = c;
+        if (G.elm_echo && G.elm_detected) putc(c, G.elm_out);
+        break;
+    }
+    return true;
+}
 
-        case '\n':
-            break;
+// commands in a same input chunk are pipelined: echo, responses and
+// prompts are buffered and written at once at the end of the chunk;
+// a request waiting for a frame, a shell job or a hold stop the parsing until done
+bool elm_session_input(elm_globals_t* g)
+{
+    char in[ELM_INPUT_LEN];
+    size_t len = 0;
+    elm_port_lock();
+    for (; len < G.elm_in_len; len++)
+        in[len] = G.elm_in[(G.elm_in_head + len) % ELM_INPUT_LEN];
+    elm_port_unlock();
+    if (len == 0) return true;
+
+    bool run = true;
+    size_t i = 0;
+    while (i < len && run && G.elm_request_src == NULL && G.elm_job == NULL && G.elm_hold_us == 0)
+        run = elm_session_char(g, in[i++]);
+
+    elm_port_lock();
+    G.elm_in_head = (G.elm_in_head + i) % ELM_INPUT_LEN;
+    G.elm_in_len -= i;
+    bool resume = G.elm_in_short && i > 0;
+    if (resume) G.elm_in_short = false;
+    elm_port_unlock();
+    if (resume && G.elm_link && G.elm_link->rx_resume) G.elm_link->rx_resume(G.elm_link->ctx);
+
+    if ((!G.elm_monitor || G.elm_mode != ELM_MODE_ELM) && G.elm_hold_us == 0) fflush(G.elm_out);
+    return run;
+}
 
-        default:
-            if (c < ' ') break;
-            if (pos >= ELM_BUFFER_LEN - 1) break;
-            line[pos++] = c;
-            if (G.elm_echo) {
-                putc(c, stdout);
-                fflush(stdout);
-            }
+// run a session as far as it can go without blocking, return false when
+// it ended, wait_ms tells when to run it again without notification
+bool elm_session_run(elm_globals_t* g, uint32_t* wait_ms)
+{
+    if (G.elm_closing) {
+        ESP_LOGW(TAG, "stop on close");
+        return false;
+    }
+    if (!G.elm_started) {
+        G.elm_started = true;
+        elm_cache_load(g);
+        elm_cache_seq_reset(g);
+        G.elm_reset_hash = 0;
+        elm_writeln(g, NULL);
+        fprintf(G.elm_out, "TeslapLX %s", TAG);
+        elm_writeln(g, NULL);
+        elm_write_prompt(g);
+        fflush(G.elm_out);
+    }
+
+    if (G.elm_hold_us) {
+        uint64_t us = elm_port_time_us();
+        if (us < G.elm_hold_us) {
+            uint32_t ms = (G.elm_hold_us - us + 999) / 1000;
+            if (ms < *wait_ms) *wait_ms = ms;
+            return true;
+        }
+        G.elm_hold_us = 0;
+        fflush(G.elm_out);
+    }
+    if (G.elm_request_src && !elm_request_pump(g)) {
+        if (ELM_MONITOR_POLL_MS < *wait_ms) *wait_ms = ELM_MONITOR_POLL_MS;
+        return true;
+    }
+    // the job notifies the worker when done
+    if (G.elm_job && !elm_job_pump(g)) return true;
+
+    if (!elm_session_input(g)) return false;
+    if (G.elm_hold_us || G.elm_request_src) {
+        // come back for the deadline
+        if (ELM_MONITOR_POLL_MS < *wait_ms) *wait_ms = ELM_MONITOR_POLL_MS;
+        return true;
+    }
+
+    if (G.elm_monitor) {
+        if (elm_monitor_pump(g))
+            *wait_ms = 0;
+        else if (ELM_MONITOR_POLL_MS < *wait_ms)
+            *wait_ms = ELM_MONITOR_POLL_MS;
+    }
+    return true;
+}
+
+void elm_session_end(elm_globals_t* g)
+{
+    elm_worker_t* w = G.elm_worker;
+    elm_port_lock();
+    for (elm_globals_t** p = &w->sessions; *p; p = &(*p)->elm_next) {
+        if (*p == g) {
+            *p = G.elm_next;
             break;
         }
     }
+    w->count--;
+    elm_port_unlock();
 
-    // deinit
+    ESP_LOGI(TAG, "session %u ended", G.elm_id);
+    const elm_link_t* link = G.elm_link;
     elm_globals_deinit(g);
+    if (link && link->close) link->close(link);
+}
+
+void elm_worker_task(void* param)
+{
+    elm_worker_t* w = param;
+    elm_port_lock();
+    w->task = elm_port_task_self();
+    elm_port_unlock();
+
+    while (true) {
+        uint32_t wait_ms = ELM_WORKER_WAIT_MS;
+        elm_port_lock();
+        elm_globals_t* g = w->sessions;
+        elm_port_unlock();
+        while (g) {
+            // only this worker unlinks its sessions, new ones are added in front
+            elm_port_lock();
+            elm_globals_t* next = G.elm_next;
+            elm_port_unlock();
+            if (!elm_session_run(g, &wait_ms)) elm_session_end(g);
+            g = next;
+        }
+        if (wait_ms > 0) elm_port_task_wait(wait_ms);
+    }
+}
+
+void elm_init()
+{
+    for (int i = 0; i < ELM_WORKERS; i++) {
+        if (!elm_port_task_start(elm_worker_task, "elm-worker", &elm_workers[i], i))
+            ESP_LOGE(ELM_TAG, "worker %d error create task", i);
+    }
+}
+
+// look up a session, elm port lock held
+static elm_globals_t* _elm_session_get(uint32_t id)
+{
+    for (int i = 0; i < ELM_WORKERS; i++) {
+        for (elm_globals_t* g = elm_workers[i].sessions; g; g = G.elm_next) {
+            if (G.elm_id == id) return g;
+        }
+    }
+    return NULL;
+}
+
+uint32_t elm_session_open(const char* tag, const elm_link_t* link)
+{
+    elm_globals_t* g = elm_globals_init(tag);
+    if (g == NULL) return 0;
+    G.elm_link = link;
+    if (link && link->out) G.elm_out = link->out;
+
+    // the least loaded worker
+    elm_port_lock();
+    elm_worker_t* w = &elm_workers[0];
+    for (int i = 1; i < ELM_WORKERS; i++) {
+        if (elm_workers[i].count < w->count) w = &elm_workers[i];
+    }
+    G.elm_id = ++elm_session_last_id;
+    if (G.elm_id == 0) G.elm_id = ++elm_session_last_id; // 0 is never a valid id
+    G.elm_worker = w;
+    G.elm_next = w->sessions;
+    w->sessions = g;
+    w->count++;
+    uint32_t id = G.elm_id;
+    void* task = w->task;
+    elm_port_unlock();
+
+    ESP_LOGI(TAG, "session %u opened", id);
+    if (task) elm_port_task_notify(task);
+    return id;
+}
+
+size_t elm_session_push(uint32_t id, const char* buf, size_t len)
+{
+    void* task = NULL;
+    size_t rest = 0;
+    elm_port_lock();
+    elm_globals_t* g = _elm_session_get(id);
+    if (g) {
+        if (len > ELM_INPUT_LEN - G.elm_in_len) {
+            rest = len - (ELM_INPUT_LEN - G.elm_in_len);
+            len -= rest;
+            G.elm_in_short = true;
+        }
+        for (size_t i = 0; i < len; i++)
+            G.elm_in[(G.elm_in_head + G.elm_in_len + i) % ELM_INPUT_LEN] = buf[i];
+        G.elm_in_len += len;
+        task = G.elm_worker->task;
+    }
+    elm_port_unlock();
+
+    if (g == NULL) return 0;
+    if (task && len) elm_port_task_notify(task);
+    return rest;
+}
+
+void elm_session_close(uint32_t id)
+{
+    void* task = NULL;
+    elm_port_lock();
+    elm_globals_t* g = _elm_session_get(id);
+    if (g) {
+        G.elm_closing = true;
+        task = G.elm_worker->task;
+    }
+    elm_port_unlock();
+    if (task) elm_port_task_notify(task);
 }
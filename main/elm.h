@@ -19,4 +19,24 @@
 #include <stdbool.h>
 #include <stdio.h>
 
-void elm_do();
+typedef struct elm_link_s {
+    void* ctx;
+    size_t tx_size;               // transport tx buffer size, 0 if unknown
+    size_t (*tx_free)(void* ctx); // transport tx buffer free size, NULL if unknown
+    uint32_t rate;                // transport nominal rate B/s, 0 if unknown
+    uint32_t (*rate_get)(void* ctx); // current rate B/s when it changes while open, NULL for rate
+    uint64_t peer;                // transport peer address (BT address, IP), 0 if unknown
+    FILE* out;                    // session output, NULL for stdout
+    bool binary;                  // transport carries binary protocols (GVRET)
+    void (*rx_resume)(void* ctx); // input room again after a short push, NULL if the transport retries itself
+    void (*close)(const struct elm_link_s* link); // session ended, NULL if nothing to release
+} elm_link_t;
+
+// sessions run on the elm workers, the transports push their input;
+// link must stay valid until its close callback
+void elm_init();
+uint32_t elm_session_open(const char* tag, const elm_link_t* link); // 0 on error
+// the chars not taken when the input is full, the transport keeps them
+// and pushes them again on rx_resume; 0 if the session is gone
+size_t elm_session_push(uint32_t id, const char* buf, size_t len);
+void elm_session_close(uint32_t id);
@@ -0,0 +1,544 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/ringbuf.h"
+#include "freertos/task.h"
+#include "nvs.h"
+#include "sdkconfig.h"
+
+#include "esp_log.h"
+
+#include "bt.h"
+#include "can.h"
+#include "elm_port.h"
+#include "elog.h"
+#include "ota.h"
+#include "udp.h"
+#include "wifi.h"
+
+static const char* TAG = "elm-freertos";
+
+#define ELM_WORKER_TASK_PRIO 5
+#define ELM_WORKER_TASK_STACK (6 * 1024)
+// OTA runs the http client and TLS
+#define ELM_JOB_TASK_PRIO (ELM_WORKER_TASK_PRIO - 1)
+#define ELM_JOB_TASK_STACK (8 * 1024)
+#define ELM_JOB_CMD_LEN 128
+
+#define ELM_STORE_NAMESPACE "elm-cache"
+
+static portMUX_TYPE elm_port_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// -----------------------------  time, task, lock  -----------------------------
+
+uint64_t elm_port_time_us()
+{
+    return esp_timer_get_time();
+}
+
+bool elm_port_task_start(void (*fn)(void* param), const char* name, void* param, int core)
+{
+    return xTaskCreatePinnedToCore(fn, name, ELM_WORKER_TASK_STACK, param, ELM_WORKER_TASK_PRIO, NULL, core) == pdPASS;
+}
+
+void* elm_port_task_self()
+{
+    return xTaskGetCurrentTaskHandle();
+}
+
+void elm_port_task_notify(void* task)
+{
+    xTaskNotifyGive((TaskHandle_t)task);
+}
+
+void elm_port_task_wait(uint32_t timeout_ms)
+{
+    // at least a tick, or a short wait would spin
+    TickType_t ticks = pdMS_TO_TICKS(timeout_ms);
+    if (ticks == 0) ticks = 1;
+    ulTaskNotifyTake(pdTRUE, ticks);
+}
+
+void elm_port_lock()
+{
+    portENTER_CRITICAL(&elm_port_mux);
+}
+
+void elm_port_unlock()
+{
+    portEXIT_CRITICAL(&elm_port_mux);
+}
+
+// -----------------------------  source  -----------------------------
+
+elm_port_source_t* elm_port_source_new(size_t count)
+{
+    return (elm_port_source_t*)can_ringbuf_new(count);
+}
+
+void elm_port_source_del(elm_port_source_t* source)
+{
+    can_ringbuf_del((RingbufHandle_t)source);
+}
+
+void elm_port_source_enable(elm_port_source_t* source, bool enable)
+{
+    can_ringbuf_enable((RingbufHandle_t)source, enable);
+}
+
+void elm_port_source_planned(elm_port_source_t* source, bool planned)
+{
+    can_ringbuf_planned((RingbufHandle_t)source, planned);
+}
+
+bool elm_port_source_receive(elm_port_source_t* source, can_message_timestamp_t* msg, uint32_t timeout_ms)
+{
+    size_t size;
+    RingbufHandle_t buf = (RingbufHandle_t)source;
+    can_message_timestamp_t* rx_msg = xRingbufferReceive(buf, &size, pdMS_TO_TICKS(timeout_ms));
+    if (rx_msg == NULL) return false;
+    *msg = *rx_msg;
+    vRingbufferReturnItem(buf, rx_msg);
+    return true;
+}
+
+// -----------------------------  store  -----------------------------
+
+bool elm_port_store_get(const char* key, void* data, size_t size)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(ELM_STORE_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) return false;
+    size_t len = size;
+    bool ok = nvs_get_blob(nvs, key, data, &len) == ESP_OK && len == size;
+    nvs_close(nvs);
+    return ok;
+}
+
+bool elm_port_store_set(const char* key, const void* data, size_t size)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(ELM_STORE_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "store nvs open error %d", err);
+        return false;
+    }
+    err = nvs_set_blob(nvs, key, data, size);
+    if (err == ESP_OK) err = nvs_commit(nvs);
+    if (err != ESP_OK) ESP_LOGE(TAG, "store nvs write error %d", err);
+    nvs_close(nvs);
+    return err == ESP_OK;
+}
+
+bool elm_port_store_del(const char* key)
+{
+    nvs_handle_t nvs;
+    if (nvs_open(ELM_STORE_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) return false;
+    esp_err_t err = nvs_erase_key(nvs, key);
+    if (err == ESP_OK) err = nvs_commit(nvs);
+    nvs_close(nvs);
+    return err == ESP_OK;
+}
+
+// -----------------------------  cmd_ps  -----------------------------
+
+int _cmd_ps_cmp(const void* a, const void* b)
+{
+    const TaskStatus_t* pa = a;
+    const TaskStatus_t* pb = b;
+    if (pa->xTaskNumber > pb->xTaskNumber) return 1;
+    if (pa->xTaskNumber < pb->xTaskNumber) return -1;
+    return 0;
+}
+
+int cmd_ps()
+{
+    static uint32_t prev_totalRunTime;
+    static TaskStatus_t* prev_stats = NULL;
+
+    uint32_t n = uxTaskGetNumberOfTasks();
+    TaskStatus_t* stats = malloc(n * sizeof(TaskStatus_t));
+    if (stats == NULL) {
+        fprintf(stderr, "ps: no mem\r\n");
+        return 1;
+    }
+
+    uint32_t totalRunTime;
+    uint32_t m = uxTaskGetSystemState(stats, n, &totalRunTime);
+    if (m < n) {
+        fprintf(stderr, "ps: error getting status\r\n");
+        return 1;
+    }
+
+    qsort(stats, n, sizeof(TaskStatus_t), _cmd_ps_cmp);
+
+    static const char* state_char = "*RBSD";
+    printf("PID  STAT  PRIO    HWM  CORE  LAST  TOTAL  NAME\r\n");
+    float t = (float)totalRunTime / 100.0f;
+    float t_last = (float)(totalRunTime - prev_totalRunTime) / 100.0f;
+    if (t == 0) t = 1;
+    if (t_last == 0) t_last = 1;
+
+    for (int i = 0; i < n; i++) {
+
+        int i_last = 0;
+        while (prev_stats != NULL && i_last >= 0 && stats[i].xTaskNumber != prev_stats[i_last].xTaskNumber) {
+            i_last++;
+            if (i_last >= n) i_last = -1;
+        }
+
+        printf("%3u    %c   %3u   %5u   %2hd %5.1f%% %5.1f%%  %s\r\n",
+               stats[i].xTaskNumber,
+               state_char[stats[i].eCurrentState],
+               stats[i].uxCurrentPriority,
+               stats[i].usStackHighWaterMark,
+               (int)stats[i].xCoreID,
+               (prev_stats != NULL && i_last >= 0) ? (float)(stats[i].ulRunTimeCounter - prev_stats[i_last].ulRunTimeCounter) / t_last : (float)stats[i].ulRunTimeCounter / t,
+               (float)stats[i].ulRunTimeCounter / t,
+               stats[i].pcTaskName);
+    }
+
+    free(prev_stats);
+    prev_totalRunTime = totalRunTime;
+    prev_stats = stats;
+
+    return 0;
+}
+
+// -----------------------------  cmd_free  -----------------------------
+
+void _cmd_free_print_info(const char* name, multi_heap_info_t* info)
+{
+    printf("%-10s %10u %10u %10u %10u %10u\r\n",
+           name,
+           info->total_allocated_bytes + info->total_free_bytes,
+           info->total_allocated_bytes,
+           info->total_free_bytes,
+           info->largest_free_block,
+           info->minimum_free_bytes);
+}
+
+// void himem_get_info(multi_heap_info_t* info)
+// {
+//     memset(info, 0, sizeof(*info));
+//     info->total_free_bytes = esp_himem_get_free_size();
+//     info->total_allocated_bytes = esp_himem_get_phys_size() - info->total_free_bytes;
+// }
+
+int cmd_free()
+{
+    multi_heap_info_t multi_heap_info;
+
+    printf("                total       used       free    largest   life-min\r\n");
+    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_DEFAULT);
+    _cmd_free_print_info("DEFAULT:", &multi_heap_info);
+    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_INTERNAL);
+    _cmd_free_print_info("INTERNAL:", &multi_heap_info);
+    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_SPIRAM);
+    _cmd_free_print_info("SPIRAM:", &multi_heap_info);
+    // himem_get_info(&multi_heap_info);
+    // _cmd_free_print_info("HIMEM:", &multi_heap_info);
+
+    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_EXEC);
+    _cmd_free_print_info("EXEC:", &multi_heap_info);
+    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_32BIT);
+    _cmd_free_print_info("32BIT:", &multi_heap_info);
+    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_8BIT);
+    _cmd_free_print_info("8BIT:", &multi_heap_info);
+    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_DMA);
+    _cmd_free_print_info("DMA:", &multi_heap_info);
+    heap_caps_get_info(&multi_heap_info, MALLOC_CAP_INVALID);
+    _cmd_free_print_info("INVALID:", &multi_heap_info);
+
+    return 0;
+}
+
+// -----------------------------  shell  -----------------------------
+
+struct elm_port_job_s {
+    char cmd[ELM_JOB_CMD_LEN];
+    FILE* out; // memory stream, copied to the session when done
+    char* out_buf;
+    size_t out_len;
+    void* task; // notified when done
+    elm_port_shell_t shell;
+    bool done;
+    bool dropped;
+};
+
+// long commands return PENDING when not in a job, before changing cmd
+elm_port_shell_t _elm_port_shell(char* cmd, FILE* out, bool job)
+{
+    if (strcasecmp(cmd, "REBOOT") == 0 || strcasecmp(cmd, "RESTART") == 0) {
+        esp_restart();
+        return ELM_PORT_SHELL_DONE;
+    }
+    if (strcasecmp(cmd, "PS") == 0) {
+        fprintf(out, "\r\n");
+        cmd_ps();
+        return ELM_PORT_SHELL_DONE;
+    }
+    else if (strcasecmp(cmd, "FREE") == 0) {
+        fprintf(out, "\r\n");
+        cmd_free();
+        return ELM_PORT_SHELL_DONE;
+    }
+    else if (strncasecmp(cmd, "ELOG", 4) == 0) {
+        cmd += 4;
+        while (*cmd == ' ')
+            cmd++;
+        uint32_t level = ESP_LOG_INFO;
+        char* tag = "*";
+        if (*cmd != 0) cmd = elm_read_hexa(cmd, &level);
+        while (*cmd == ' ')
+            cmd++;
+        if (*cmd != 0) tag = cmd;
+        elog_out_set(out);
+        elog_level_set(tag, level);
+        return ELM_PORT_SHELL_DONE;
+    }
+    else if (strncasecmp(cmd, "BT FILL", 7) == 0) {
+        cmd += 7;
+        while (*cmd == ' ')
+            cmd++;
+        if (*cmd == 0) return ELM_PORT_SHELL_SYNTAX;
+        bt_set_tx_fill(strtoul(cmd, NULL, 10));
+        return ELM_PORT_SHELL_OK;
+    }
+    else if (strncasecmp(cmd, "SIMU", 4) == 0) {
+        cmd += 4;
+        while (*cmd == ' ')
+            cmd++;
+        if (strncasecmp(cmd, "START", 3) == 0) {
+            can_simu_start();
+            return ELM_PORT_SHELL_DONE;
+        }
+        else if (strncasecmp(cmd, "STOP", 3) == 0) {
+            can_simu_stop();
+            return ELM_PORT_SHELL_DONE;
+        }
+        return ELM_PORT_SHELL_SYNTAX;
+    }
+    else if (strncasecmp(cmd, "WIFI", 4) == 0) {
+        cmd += 4;
+        while (*cmd == ' ')
+            cmd++;
+
+        if (*cmd == 0) {
+            fprintf(out, "\r\n");
+            wifi_status();
+            return ELM_PORT_SHELL_DONE;
+        }
+        else if (strncasecmp(cmd, "STA", 3) == 0) {
+            cmd += 3;
+            while (*cmd == ' ')
+                cmd++;
+            if (*cmd == 0) {
+                // elm_write_ok_error(g, wifi_sta_disc(false));
+                return ELM_PORT_SHELL_DONE;
+            }
+
+            char* ssid;
+            char* pwd;
+            cmd = elm_read_str(cmd, &ssid);
+            cmd = elm_read_str(cmd, &pwd);
+            return wifi_sta(ssid, pwd) ? ELM_PORT_SHELL_OK : ELM_PORT_SHELL_ERROR;
+        }
+        else if (strncasecmp(cmd, "AP", 2) == 0) {
+            cmd += 2;
+            while (*cmd == ' ')
+                cmd++;
+            if (*cmd == 0) return ELM_PORT_SHELL_DONE;
+
+            char* ssid;
+            char* pwd;
+            cmd = elm_read_str(cmd, &ssid);
+            cmd = elm_read_str(cmd, &pwd);
+            ESP_LOGI(TAG, "set wifi ap ssid='%s' pwd='%s'", ssid, pwd);
+            return wifi_ap(ssid, pwd) ? ELM_PORT_SHELL_OK : ELM_PORT_SHELL_ERROR;
+        }
+        else if (strncasecmp(cmd, "STOP", 4) == 0) {
+            return wifi_stop() ? ELM_PORT_SHELL_OK : ELM_PORT_SHELL_ERROR;
+        }
+        else if (strncasecmp(cmd, "SCAN", 4) == 0) {
+            if (!job) return ELM_PORT_SHELL_PENDING;
+            fprintf(out, "\r\n");
+            wifi_scan();
+            return ELM_PORT_SHELL_DONE;
+        }
+        return ELM_PORT_SHELL_SYNTAX;
+    }
+    else if (strncasecmp(cmd, "UDP", 3) == 0) {
+        cmd += 3;
+        while (*cmd == ' ')
+            cmd++;
+
+        if (*cmd == 0) {
+            fprintf(out, "\r\n");
+            udp_status();
+            return ELM_PORT_SHELL_DONE;
+        }
+        else if (strncasecmp(cmd, "START", 5) == 0) {
+            if (!job) return ELM_PORT_SHELL_PENDING;
+            char* addr;
+            cmd = elm_read_str(cmd + 5, &addr);
+            while (*cmd == ' ')
+                cmd++;
+            uint32_t port = *cmd ? strtoul(cmd, NULL, 10) : UDP_PORT_DEFAULT;
+            if (*addr == 0 || port == 0 || port > 0xFFFF) return ELM_PORT_SHELL_SYNTAX;
+            return udp_start(addr, port) ? ELM_PORT_SHELL_OK : ELM_PORT_SHELL_ERROR;
+        }
+        else if (strncasecmp(cmd, "STOP", 4) == 0) {
+            udp_stop();
+            return ELM_PORT_SHELL_OK;
+        }
+        else if (strncasecmp(cmd, "MS", 2) == 0) {
+            cmd += 2;
+            while (*cmd == ' ')
+                cmd++;
+            if (*cmd == 0) return ELM_PORT_SHELL_SYNTAX;
+            udp_set_interval(strtoul(cmd, NULL, 10));
+            return ELM_PORT_SHELL_OK;
+        }
+        else if (strncasecmp(cmd, "IDS", 3) == 0) {
+            // hexa IDs separated by spaces or commas, none for all
+            cmd += 3;
+            uint32_t ids[UDP_IDS_MAX];
+            int count = 0;
+            while (true) {
+                while (*cmd == ' ' || *cmd == ',')
+                    cmd++;
+                if (*cmd == 0) break;
+                if (count == UDP_IDS_MAX) return ELM_PORT_SHELL_ERROR;
+                char* next = elm_read_hexa(cmd, &ids[count++]);
+                if (next == cmd) return ELM_PORT_SHELL_SYNTAX;
+                cmd = next;
+            }
+            return udp_set_ids(ids, count) ? ELM_PORT_SHELL_OK : ELM_PORT_SHELL_ERROR;
+        }
+        return ELM_PORT_SHELL_SYNTAX;
+    }
+    else if (strncasecmp(cmd, "OTA", 3) == 0) {
+        cmd += 3;
+        while (*cmd == ' ')
+            cmd++;
+        if (*cmd == 0) {
+            ota_info();
+            return ELM_PORT_SHELL_DONE;
+        }
+        else {
+            if (!job) return ELM_PORT_SHELL_PENDING;
+            ota_update(cmd);
+            return ELM_PORT_SHELL_DONE;
+        }
+    }
+    return ELM_PORT_SHELL_NONE;
+}
+
+void _elm_port_job_free(elm_port_job_t* job)
+{
+    if (job->out) fclose(job->out);
+    free(job->out_buf);
+    free(job);
+}
+
+void _elm_port_job_task(void* param)
+{
+    elm_port_job_t* job = param;
+    FILE* std = stdout;
+    stdout = job->out;
+    elm_port_shell_t shell = _elm_port_shell(job->cmd, job->out, true);
+    fflush(stdout);
+    stdout = std;
+    ESP_LOGI(TAG, "job '%s' done, stack high water mark %u", job->cmd, uxTaskGetStackHighWaterMark(NULL));
+
+    // the session may free the job as soon as it is done
+    elm_port_lock();
+    job->shell = shell;
+    job->done = true;
+    bool dropped = job->dropped;
+    void* task = job->task;
+    elm_port_unlock();
+    if (dropped)
+        _elm_port_job_free(job);
+    else
+        elm_port_task_notify(task);
+    vTaskDelete(NULL);
+}
+
+elm_port_job_t* _elm_port_job_start(const char* cmd)
+{
+    if (strlen(cmd) >= ELM_JOB_CMD_LEN) return NULL;
+    elm_port_job_t* job = calloc(1, sizeof(elm_port_job_t));
+    if (job == NULL) return NULL;
+    strcpy(job->cmd, cmd);
+    job->out = open_memstream(&job->out_buf, &job->out_len);
+    job->task = elm_port_task_self();
+    if (job->out == NULL ||
+        xTaskCreate(_elm_port_job_task, "elm-job", ELM_JOB_TASK_STACK, job, ELM_JOB_TASK_PRIO, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "job '%s' start error", cmd);
+        _elm_port_job_free(job);
+        return NULL;
+    }
+    return job;
+}
+
+elm_port_shell_t elm_port_shell(char* cmd, FILE* out, elm_port_job_t** job)
+{
+    // the commands print to stdout, the worker stdout is the session for the command
+    FILE* std = stdout;
+    stdout = out;
+    elm_port_shell_t shell = _elm_port_shell(cmd, out, false);
+    fflush(stdout);
+    stdout = std;
+    if (shell == ELM_PORT_SHELL_PENDING) {
+        *job = _elm_port_job_start(cmd);
+        if (*job == NULL) shell = ELM_PORT_SHELL_ERROR;
+    }
+    return shell;
+}
+
+elm_port_shell_t elm_port_job_poll(elm_port_job_t* job, FILE* out)
+{
+    elm_port_lock();
+    bool done = job->done;
+    elm_port_unlock();
+    if (!done) return ELM_PORT_SHELL_PENDING;
+
+    elm_port_shell_t shell = job->shell;
+    fflush(job->out);
+    fwrite(job->out_buf, 1, job->out_len, out);
+    _elm_port_job_free(job);
+    return shell;
+}
+
+void elm_port_job_drop(elm_port_job_t* job)
+{
+    elm_port_lock();
+    bool done = job->done;
+    job->dropped = true;
+    elm_port_unlock();
+    if (done) _elm_port_job_free(job);
+}
@@ -0,0 +1,80 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "can_id.h"
+
+// what the elm core needs from the platform: elm_freertos.c on the ESP32,
+// host/elm_posix.c on Linux
+
+// time
+uint64_t elm_port_time_us();
+
+// session worker tasks, woken by a notification or a timeout
+bool elm_port_task_start(void (*fn)(void* param), const char* name, void* param, int core);
+void* elm_port_task_self();
+void elm_port_task_notify(void* task);
+void elm_port_task_wait(uint32_t timeout_ms);
+
+// short critical section for state shared between sessions
+void elm_port_lock();
+void elm_port_unlock();
+
+// frame source, a subscription to the known IDs frames, the task creating
+// it is notified when a frame is queued
+typedef struct elm_port_source_s elm_port_source_t;
+elm_port_source_t* elm_port_source_new(size_t count);
+void elm_port_source_del(elm_port_source_t* source);
+bool elm_port_source_receive(elm_port_source_t* source, can_message_timestamp_t* msg, uint32_t timeout_ms);
+// a disabled source gets no frame, enabling it drops the ones queued before
+void elm_port_source_enable(elm_port_source_t* source, bool enable);
+// a source planning its own rate per ID gets up to CAN_ID_PLAN_MAX_RATE
+// frames per second and per ID instead of CAN_ID_MAX_RATE
+void elm_port_source_planned(elm_port_source_t* source, bool planned);
+
+// persistent store
+bool elm_port_store_get(const char* key, void* data, size_t size);
+bool elm_port_store_set(const char* key, const void* data, size_t size);
+bool elm_port_store_del(const char* key);
+
+// platform shell commands (REBOOT, WIFI, ...)
+typedef enum {
+    ELM_PORT_SHELL_NONE,    // not a shell command
+    ELM_PORT_SHELL_DONE,    // done, output written
+    ELM_PORT_SHELL_OK,      // done, write OK
+    ELM_PORT_SHELL_ERROR,   // failed, write ERROR
+    ELM_PORT_SHELL_SYNTAX,  // bad arguments
+    ELM_PORT_SHELL_PENDING, // running in a helper task, *job set
+} elm_port_shell_t;
+
+// long commands (OTA, WIFI SCAN, UDP START) run in a one-shot helper task,
+// the worker serves its other sessions meanwhile: the calling task is
+// notified when the job is done
+typedef struct elm_port_job_s elm_port_job_t;
+elm_port_shell_t elm_port_shell(char* cmd, FILE* out, elm_port_job_t** job);
+// PENDING while running, else the result: the output is written to out
+// and the job freed
+elm_port_shell_t elm_port_job_poll(elm_port_job_t* job, FILE* out);
+// the session ends, a running job frees itself when done
+void elm_port_job_drop(elm_port_job_t* job);
+
+// core helpers for the bindings
+char* elm_read_hexa(char* c, uint32_t* h);
+char* elm_read_str(char* c, char** str);
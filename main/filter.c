@@ -0,0 +1,323 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "can_id.h"
+#include "filter.h"
+
+#define FILTER_PROG_LEN 32 // max instructions, also bounds the execution time
+#define FILTER_STACK_LEN 16
+#define FILTER_CHG_MAX 4 // CHG() per expression
+
+typedef enum {
+    FILTER_OP_ID,
+    FILTER_OP_BITS,
+    FILTER_OP_CONST,
+    FILTER_OP_CHG,
+    FILTER_OP_EQ,
+    FILTER_OP_NE,
+    FILTER_OP_LT,
+    FILTER_OP_GT,
+    FILTER_OP_LE,
+    FILTER_OP_GE,
+    FILTER_OP_AND,
+    FILTER_OP_OR,
+    FILTER_OP_NOT,
+} filter_op_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t start; // BITS, CHG
+    uint8_t len;   // BITS, CHG
+    uint8_t slot;  // CHG
+    uint32_t value; // CONST
+} filter_ins_t;
+
+struct filter_s {
+    filter_ins_t prog[FILTER_PROG_LEN];
+    int len;
+    int chg_count;
+    uint32_t* chg_last; // per known ID and CHG slot
+    uint8_t* chg_seen;  // per known ID, bit per CHG slot
+};
+
+typedef struct {
+    const char* c;
+    const char* err;
+    filter_t* f;
+    int depth; // stack depth at this point of the program
+    int depth_max;
+} filter_parser_t;
+
+// -----------------------------  compile  -----------------------------
+
+static void _filter_skip(filter_parser_t* p)
+{
+    while (*p->c == ' ')
+        p->c++;
+}
+
+static bool _filter_accept(filter_parser_t* p, const char* s)
+{
+    _filter_skip(p);
+    size_t len = strlen(s);
+    if (strncasecmp(p->c, s, len) != 0) return false;
+    p->c += len;
+    return true;
+}
+
+static bool _filter_emit(filter_parser_t* p, filter_ins_t ins, int push)
+{
+    if (p->err) return false;
+    if (p->f->len >= FILTER_PROG_LEN) {
+        p->err = "expression too long";
+        return false;
+    }
+    p->depth += push;
+    if (p->depth > p->depth_max) p->depth_max = p->depth;
+    p->f->prog[p->f->len++] = ins;
+    return true;
+}
+
+// decimal, or hex after 0x; a leading 0 is not octal
+static bool _filter_number(filter_parser_t* p, uint32_t* v)
+{
+    _filter_skip(p);
+    char* end;
+    bool hex = p->c[0] == '0' && (p->c[1] == 'x' || p->c[1] == 'X');
+    *v = strtoul(p->c, &end, hex ? 16 : 10);
+    if (end == p->c) return false;
+    p->c = end;
+    return true;
+}
+
+// payload bits operand, false if not one
+static bool _filter_bits(filter_parser_t* p, uint8_t* start, uint8_t* len)
+{
+    _filter_skip(p);
+    char c = *p->c;
+    uint32_t a;
+    uint32_t b;
+    if (c == 'B' || c == 'b' || c == 'W' || c == 'w') {
+        p->c++;
+        if (!_filter_number(p, &a) || a > 7) goto _err;
+        *start = a * 8;
+        *len = (c == 'W' || c == 'w') ? 16 : 8;
+        if (*len == 8 && *p->c == '.') {
+            p->c++;
+            if (!_filter_number(p, &b) || b > 7) goto _err;
+            *start += b;
+            *len = 1;
+        }
+    }
+    else if (c == 'S' || c == 's') {
+        p->c++;
+        if (!_filter_number(p, &a) || *p->c != ':') goto _err;
+        p->c++;
+        if (!_filter_number(p, &b) || b == 0 || b > 32 || a + b > 64) goto _err;
+        *start = a;
+        *len = b;
+    }
+    else
+        return false;
+    if (*start + *len > 64) goto _err;
+    return true;
+
+_err:
+    p->err = "bad operand";
+    return false;
+}
+
+static void _filter_or(filter_parser_t* p);
+
+static void _filter_operand(filter_parser_t* p)
+{
+    filter_ins_t ins = {0};
+    uint32_t v;
+    if (_filter_accept(p, "ID")) {
+        ins.op = FILTER_OP_ID;
+    }
+    else if (_filter_accept(p, "CHG")) {
+        if (!_filter_accept(p, "(")) goto _err;
+        if (!_filter_bits(p, &ins.start, &ins.len)) goto _err;
+        if (!_filter_accept(p, ")")) goto _err;
+        if (p->f->chg_count >= FILTER_CHG_MAX) {
+            p->err = "too many CHG";
+            return;
+        }
+        ins.op = FILTER_OP_CHG;
+        ins.slot = p->f->chg_count++;
+    }
+    else if (_filter_bits(p, &ins.start, &ins.len)) {
+        ins.op = FILTER_OP_BITS;
+    }
+    else if (!p->err && _filter_number(p, &v)) {
+        ins.op = FILTER_OP_CONST;
+        ins.value = v;
+    }
+    else
+        goto _err;
+    _filter_emit(p, ins, 1);
+    return;
+
+_err:
+    if (!p->err) p->err = "operand expected";
+}
+
+static void _filter_cmp(filter_parser_t* p)
+{
+    static const struct {
+        const char* s;
+        uint8_t op;
+    } ops[] = {{"==", FILTER_OP_EQ}, {"!=", FILTER_OP_NE}, {"<=", FILTER_OP_LE}, {">=", FILTER_OP_GE}, {"=", FILTER_OP_EQ}, {"<", FILTER_OP_LT}, {">", FILTER_OP_GT}};
+
+    if (_filter_accept(p, "!")) {
+        _filter_cmp(p);
+        _filter_emit(p, (filter_ins_t){.op = FILTER_OP_NOT}, 0);
+        return;
+    }
+    if (_filter_accept(p, "(")) {
+        _filter_or(p);
+        if (!_filter_accept(p, ")") && !p->err) p->err = "')' expected";
+        return;
+    }
+    _filter_operand(p);
+    for (int i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+        if (_filter_accept(p, ops[i].s)) {
+            _filter_operand(p);
+            _filter_emit(p, (filter_ins_t){.op = ops[i].op}, -1);
+            return;
+        }
+    }
+}
+
+static void _filter_and(filter_parser_t* p)
+{
+    _filter_cmp(p);
+    while (!p->err && (_filter_accept(p, "&&") || _filter_accept(p, "&"))) {
+        _filter_cmp(p);
+        _filter_emit(p, (filter_ins_t){.op = FILTER_OP_AND}, -1);
+    }
+}
+
+static void _filter_or(filter_parser_t* p)
+{
+    _filter_and(p);
+    while (!p->err && (_filter_accept(p, "||") || _filter_accept(p, "|"))) {
+        _filter_and(p);
+        _filter_emit(p, (filter_ins_t){.op = FILTER_OP_OR}, -1);
+    }
+}
+
+filter_t* filter_compile(const char* expr, const char** err)
+{
+    filter_t* f = calloc(1, sizeof(filter_t));
+    if (f == NULL) {
+        *err = "no mem";
+        return NULL;
+    }
+    filter_parser_t p = {.c = expr, .f = f};
+    _filter_or(&p);
+    _filter_skip(&p);
+    if (!p.err && *p.c != 0) p.err = "unexpected char";
+    if (!p.err && p.depth_max > FILTER_STACK_LEN) p.err = "expression too deep";
+    if (!p.err && f->chg_count > 0) {
+        f->chg_last = calloc(can_id_get_count() * f->chg_count, sizeof(uint32_t));
+        f->chg_seen = calloc(can_id_get_count(), sizeof(uint8_t));
+        if (f->chg_last == NULL || f->chg_seen == NULL) p.err = "no mem";
+    }
+    if (p.err) {
+        *err = p.err;
+        filter_free(f);
+        return NULL;
+    }
+    return f;
+}
+
+void filter_free(filter_t* filter)
+{
+    if (filter == NULL) return;
+    free(filter->chg_last);
+    free(filter->chg_seen);
+    free(filter);
+}
+
+// -----------------------------  run  -----------------------------
+
+static inline uint32_t _filter_bits_get(const can_message_t* msg, uint8_t start, uint8_t len)
+{
+    uint64_t data = 0;
+    for (int i = 0; i < msg->data_length_code && i < 8; i++)
+        data |= (uint64_t)msg->data[i] << (8 * i);
+    return (data >> start) & ((1ULL << len) - 1);
+}
+
+// true if the frame must be forwarded
+bool filter_run(filter_t* filter, const can_message_t* msg)
+{
+    uint32_t stack[FILTER_STACK_LEN];
+    int sp = 0;
+    int index = filter->chg_count ? can_id_index(msg->identifier) : -1;
+
+    for (int pc = 0; pc < filter->len; pc++) {
+        const filter_ins_t* ins = &filter->prog[pc];
+        uint32_t a;
+        switch (ins->op) {
+        case FILTER_OP_ID:
+            stack[sp++] = msg->identifier;
+            break;
+        case FILTER_OP_BITS:
+            stack[sp++] = _filter_bits_get(msg, ins->start, ins->len);
+            break;
+        case FILTER_OP_CONST:
+            stack[sp++] = ins->value;
+            break;
+        case FILTER_OP_CHG: {
+            a = _filter_bits_get(msg, ins->start, ins->len);
+            if (index < 0) {
+                stack[sp++] = true;
+                break;
+            }
+            uint32_t* last = &filter->chg_last[index * filter->chg_count + ins->slot];
+            bool seen = filter->chg_seen[index] & (1 << ins->slot);
+            stack[sp++] = !seen || *last != a;
+            *last = a;
+            filter->chg_seen[index] |= 1 << ins->slot;
+            break;
+        }
+        case FILTER_OP_NOT:
+            stack[sp - 1] = !stack[sp - 1];
+            break;
+        default:
+            a = stack[--sp];
+            switch (ins->op) {
+            case FILTER_OP_EQ: stack[sp - 1] = stack[sp - 1] == a; break;
+            case FILTER_OP_NE: stack[sp - 1] = stack[sp - 1] != a; break;
+            case FILTER_OP_LT: stack[sp - 1] = stack[sp - 1] < a; break;
+            case FILTER_OP_GT: stack[sp - 1] = stack[sp - 1] > a; break;
+            case FILTER_OP_LE: stack[sp - 1] = stack[sp - 1] <= a; break;
+            case FILTER_OP_GE: stack[sp - 1] = stack[sp - 1] >= a; break;
+            case FILTER_OP_AND: stack[sp - 1] = stack[sp - 1] && a; break;
+            case FILTER_OP_OR: stack[sp - 1] = stack[sp - 1] || a; break;
+            }
+            break;
+        }
+    }
+    return sp > 0 && stack[sp - 1] != 0;
+}
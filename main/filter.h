@@ -0,0 +1,34 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "hal/can_types.h"
+
+// payload predicate, compiled from a text expression:
+//   ID, Bn (byte n), Bn.k (bit k of byte n), Wn (16 bits from byte n), Sstart:len (bits)
+//   CHG(operand): operand changed since the previous frame of the same ID
+//   = == != < > <= >=, ! & && | || and (), numbers decimal or 0x hexa
+// ex: ID=0x20A & CHG(B2) | ID=0x132 & S16:16>1000
+
+typedef struct filter_s filter_t;
+
+filter_t* filter_compile(const char* expr, const char** err);
+void filter_free(filter_t* filter);
+bool filter_run(filter_t* filter, const can_message_t* msg);
@@ -0,0 +1,128 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "gvret.h"
+
+#define GVRET_BUILD_NUM 618 // protocol of the ESP32RET build SavvyCAN expects
+#define GVRET_EXT_BUSES_LEN 15
+
+static inline char* gvret_u32(char* p, uint32_t v)
+{
+    *p++ = v & 0xff;
+    *p++ = (v >> 8) & 0xff;
+    *p++ = (v >> 16) & 0xff;
+    *p++ = (v >> 24) & 0xff;
+    return p;
+}
+
+size_t gvret_format(const can_message_t* msg, uint32_t ts_us, char* buf)
+{
+    char* p = buf;
+    uint8_t dlc = msg->data_length_code > 8 ? 8 : msg->data_length_code;
+    bool extd = msg->extd || msg->identifier > CAN_STD_ID_MASK;
+
+    *p++ = GVRET_START;
+    *p++ = GVRET_BUILD_CAN_FRAME;
+    p = gvret_u32(p, ts_us);
+    p = gvret_u32(p, (msg->identifier & (extd ? CAN_EXTD_ID_MASK : CAN_STD_ID_MASK)) | (extd ? 1u << 31 : 0));
+    *p++ = dlc; // bus 0
+    memcpy(p, msg->data, dlc);
+    p += dlc;
+    *p++ = 0; // checksum, unused
+    return p - buf;
+}
+
+size_t gvret_cmd_len(const uint8_t* cmd, size_t len)
+{
+    size_t need = 2;
+    if (len < need) return 0;
+
+    switch (cmd[1]) {
+    case GVRET_BUILD_CAN_FRAME:
+    case GVRET_ECHO_CAN_FRAME:
+        // id[4] bus len data[len] checksum
+        need = 8;
+        if (len < need) return 0;
+        need += (cmd[7] & 0xf) > 8 ? 8 : (cmd[7] & 0xf);
+        need += 1;
+        break;
+    case GVRET_SET_DIG_OUTPUTS:
+    case GVRET_SET_SINGLEWIRE_MODE:
+    case GVRET_SET_SYSTYPE:
+        need += 1;
+        break;
+    case GVRET_SETUP_CANBUS:
+        need += 8;
+        break;
+    case GVRET_SET_EXT_BUSES:
+        need += 12;
+        break;
+    }
+    return len < need ? 0 : need;
+}
+
+size_t gvret_reply(const uint8_t* cmd, uint32_t time_us, char* buf)
+{
+    char* p = buf;
+    *p++ = GVRET_START;
+    *p++ = cmd[1];
+
+    switch (cmd[1]) {
+    case GVRET_TIME_SYNC:
+        p = gvret_u32(p, time_us);
+        break;
+    case GVRET_GET_DIG_INPUTS:
+        *p++ = 0;
+        *p++ = 0; // checksum
+        break;
+    case GVRET_GET_ANALOG_INPUTS:
+        memset(p, 0, 7 * 2 + 1);
+        p += 7 * 2 + 1;
+        break;
+    case GVRET_GET_CANBUS_PARAMS:
+        // enabled, listen only
+        *p++ = 1 | (1 << 4);
+        p = gvret_u32(p, GVRET_BUS_SPEED);
+        *p++ = 0;
+        p = gvret_u32(p, 0);
+        break;
+    case GVRET_GET_DEVICE_INFO:
+        *p++ = GVRET_BUILD_NUM & 0xff;
+        *p++ = GVRET_BUILD_NUM >> 8;
+        *p++ = 0x20; // eeprom version
+        *p++ = 0;    // file type
+        *p++ = 0;    // auto log
+        *p++ = 0;    // single wire
+        break;
+    case GVRET_KEEPALIVE:
+        *p++ = 0xDE;
+        *p++ = 0xAD;
+        break;
+    case GVRET_GET_NUMBUSES:
+        *p++ = 1;
+        break;
+    case GVRET_GET_EXT_BUSES:
+        memset(p, 0, GVRET_EXT_BUSES_LEN);
+        p += GVRET_EXT_BUSES_LEN;
+        break;
+    default:
+        return 0;
+    }
+    return p - buf;
+}
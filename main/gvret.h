@@ -0,0 +1,59 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "hal/can_types.h"
+
+// GVRET (SavvyCAN binary) frames and commands, the session side is in elm.c
+//   E7 E7: enter binary mode
+//   F1 cmd ...: command, F1 00 ...: frame
+//   frame: F1 00 ts[4] id[4] (len | bus << 4) data[len] 00, little endian,
+//   ts in us, id bit 31 for 29 bits ID
+
+#define GVRET_BINARY 0xE7
+#define GVRET_START 0xF1
+#define GVRET_FRAME_LEN 19 // 11 + 8 data bytes
+#define GVRET_REPLY_LEN 20
+#define GVRET_BUS_SPEED 500000
+
+#define GVRET_BUILD_CAN_FRAME 0x00
+#define GVRET_TIME_SYNC 0x01
+#define GVRET_GET_DIG_INPUTS 0x02
+#define GVRET_GET_ANALOG_INPUTS 0x03
+#define GVRET_SET_DIG_OUTPUTS 0x04
+#define GVRET_SETUP_CANBUS 0x05
+#define GVRET_GET_CANBUS_PARAMS 0x06
+#define GVRET_GET_DEVICE_INFO 0x07
+#define GVRET_SET_SINGLEWIRE_MODE 0x08
+#define GVRET_KEEPALIVE 0x09
+#define GVRET_SET_SYSTYPE 0x0A
+#define GVRET_ECHO_CAN_FRAME 0x0B
+#define GVRET_GET_NUMBUSES 0x0C
+#define GVRET_GET_EXT_BUSES 0x0D
+#define GVRET_SET_EXT_BUSES 0x0E
+
+// format msg in buf, return the length
+size_t gvret_format(const can_message_t* msg, uint32_t ts_us, char* buf);
+
+// length of the command in cmd[len] (F1 cmd ...), 0 if more bytes are needed
+size_t gvret_cmd_len(const uint8_t* cmd, size_t len);
+
+// reply of a complete command in buf, return the length, 0 if none
+size_t gvret_reply(const uint8_t* cmd, uint32_t time_us, char* buf);
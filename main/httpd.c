@@ -12,96 +12,342 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "esp_err.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_system.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/ringbuf.h"
+#include "freertos/semphr.h"
 
 #include "esp_netif.h"
 #include "esp_sntp.h"
 #include "esp_wifi.h"
 #include "esp_wifi_default.h"
 
-#include "cJSON.h"
 #include "esp_http_server.h"
+#include "esp_timer.h"
+#include "lwip/sockets.h"
 
 #include "sdkconfig.h"
 
+#include "can.h"
+#include "dbc.h"
+#include "jsonw.h"
 #include "httpd.h"
 
 static const char* TAG = "net-httpd";
 static const char* TAG_WS = "net-httpd-ws";
 
 #define HTTPD_WS_RINGBUF_RX_SIZE 256
+#define HTTPD_WS_SEND_BUFS 4    // frames queued to the httpd task at most
+#define HTTPD_WS_SEND_LEN 1024 // frame payload
 
-static RingbufHandle_t httpd_ws_rx_buffer = NULL;
-static int httpd_ws_fd = 0;
-static httpd_handle_t httpd_ws_hd = NULL;
-static net_httpd_cb_t httpd_ws_open_cb = NULL;
-static net_httpd_cb_t httpd_ws_close_cb = NULL;
+typedef enum {
+    WS_BUF_FREE,
+    WS_BUF_QUEUED,  // work queued, writes are appended until it runs
+    WS_BUF_SENDING, // in httpd_ws_send_frame_async
+} ws_buf_state_t;
 
-static httpd_handle_t server = NULL;
+typedef struct ws_client_s ws_client_t;
 
-// -----------------------------  _httpd_handler_ws  -----------------------------
+typedef struct {
+    ws_client_t* client;
+    ws_buf_state_t state;
+    httpd_ws_type_t type;
+    int fd;
+    size_t len;
+    uint8_t data[HTTPD_WS_SEND_LEN];
+} ws_send_buf_t;
 
-struct async_resp_arg {
+// a ws client and its fixed send pool, no allocation while streaming
+struct ws_client_s {
+    int fd; // 0 if free
     httpd_handle_t hd;
-    int fd;
-    httpd_ws_type_t type;
-    char* data;
-    int len;
+    RingbufHandle_t rx_buffer;
+    uint8_t* rx_item; // received from rx_buffer, partly taken by ws_data_cb
+    size_t rx_item_len;
+    size_t rx_item_taken;
+    ws_send_buf_t send[HTTPD_WS_SEND_BUFS];
+    ws_send_buf_t* queued_last; // last queued buffer, NULL if sent
+    bool close_pending;         // close frame waiting for a free buffer
+    bool binary;                // binary frames since the client sent one
+    uint32_t drop;              // writes dropped on full pool
 };
 
+static SemaphoreHandle_t httpd_ws_mutex = NULL; // clients and send pools
+static ws_client_t httpd_ws_clients[HTTPD_WS_CONN_MAX];
+static net_httpd_open_cb_t httpd_ws_open_cb = NULL;
+static net_httpd_cb_t httpd_ws_close_cb = NULL;
+static net_httpd_data_cb_t httpd_ws_data_cb = NULL;
+
+static httpd_handle_t server = NULL;
+
+// -----------------------------  ws send pool  -----------------------------
+
+// the client of a fd, with httpd_ws_mutex
+static ws_client_t* _ws_client_get(int fd)
+{
+    if (fd == 0) return NULL;
+    for (int i = 0; i < HTTPD_WS_CONN_MAX; i++) {
+        if (httpd_ws_clients[i].fd == fd) return &httpd_ws_clients[i];
+    }
+    return NULL;
+}
+
+// a free client without frames of its previous fd in flight, with httpd_ws_mutex
+static ws_client_t* _ws_client_free()
+{
+    for (int i = 0; i < HTTPD_WS_CONN_MAX; i++) {
+        ws_client_t* client = &httpd_ws_clients[i];
+        if (client->fd != 0 || client->close_pending) continue;
+        int j = 0;
+        while (j < HTTPD_WS_SEND_BUFS && client->send[j].state == WS_BUF_FREE)
+            j++;
+        if (j == HTTPD_WS_SEND_BUFS) return client;
+    }
+    return NULL;
+}
+
+// a free buffer, with httpd_ws_mutex
+static ws_send_buf_t* _ws_buf_get(ws_client_t* client)
+{
+    for (int i = 0; i < HTTPD_WS_SEND_BUFS; i++) {
+        if (client->send[i].state == WS_BUF_FREE) return &client->send[i];
+    }
+    return NULL;
+}
+
+// free bytes in the pool, with httpd_ws_mutex
+static size_t _ws_tx_free(ws_client_t* client, httpd_ws_type_t type)
+{
+    size_t tx_free = 0;
+    for (int i = 0; i < HTTPD_WS_SEND_BUFS; i++) {
+        if (client->send[i].state == WS_BUF_FREE) tx_free += HTTPD_WS_SEND_LEN;
+    }
+    ws_send_buf_t* last = client->queued_last;
+    if (last && last->type == type) tx_free += HTTPD_WS_SEND_LEN - last->len;
+    return tx_free;
+}
+
+void ws_async_send(void* arg);
+
+static void _ws_queue(ws_send_buf_t* buf)
+{
+    esp_err_t err = httpd_queue_work(server, ws_async_send, buf);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG_WS, "httpd_queue_work failed with %d", err);
+        xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+        buf->state = WS_BUF_FREE;
+        if (buf->client->queued_last == buf) buf->client->queued_last = NULL;
+        xSemaphoreGive(httpd_ws_mutex);
+    }
+}
+
 void ws_async_send(void* arg)
 {
-    struct async_resp_arg* resp_arg = arg;
-    httpd_handle_t hd = resp_arg->hd;
-    int fd = resp_arg->fd;
+    ws_send_buf_t* buf = arg;
+    ws_client_t* client = buf->client;
+
+    xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+    buf->state = WS_BUF_SENDING;
+    if (client->queued_last == buf) client->queued_last = NULL;
+    xSemaphoreGive(httpd_ws_mutex);
+
     httpd_ws_frame_t ws_pkt;
     memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
-    ws_pkt.payload = (uint8_t*)resp_arg->data;
-    ws_pkt.len = resp_arg->len;
-    ws_pkt.type = resp_arg->type;
-
-    esp_err_t err = httpd_ws_send_frame_async(hd, fd, &ws_pkt);
+    ws_pkt.payload = buf->data;
+    ws_pkt.len = buf->len;
+    ws_pkt.type = buf->type;
+    esp_err_t err = httpd_ws_send_frame_async(client->hd, buf->fd, &ws_pkt);
     if (err != ESP_OK) {
         ESP_LOGE(TAG_WS, "httpd_ws_send_frame_async failed with %d", err);
     }
 
-    free(resp_arg->data);
-    free(resp_arg);
+    bool close = false;
+    xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+    buf->state = WS_BUF_FREE;
+    if (client->close_pending) {
+        client->close_pending = false;
+        buf->state = WS_BUF_QUEUED;
+        buf->type = HTTPD_WS_TYPE_CLOSE;
+        buf->len = 0;
+        close = true;
+    }
+    xSemaphoreGive(httpd_ws_mutex);
+    if (close) _ws_queue(buf);
+}
+
+static inline httpd_ws_type_t _ws_type(ws_client_t* client)
+{
+    return client->binary ? HTTPD_WS_TYPE_BINARY : HTTPD_WS_TYPE_TEXT;
+}
+
+// append to the frame waiting for its send, or queue a new one; all or
+// nothing, -1 with errno when the fd is closed or the pool is full
+static int _ws_send(int fd, const char* data, size_t size)
+{
+    ws_send_buf_t* queue[HTTPD_WS_SEND_BUFS];
+    int queue_count = 0;
+
+    xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+    ws_client_t* client = _ws_client_get(fd);
+    if (client == NULL) {
+        xSemaphoreGive(httpd_ws_mutex);
+        errno = EBADF;
+        return -1;
+    }
+    httpd_ws_type_t type = _ws_type(client);
+    if (_ws_tx_free(client, type) < size) {
+        client->drop++;
+        xSemaphoreGive(httpd_ws_mutex);
+        errno = EAGAIN;
+        return -1;
+    }
+    while (size > 0) {
+        ws_send_buf_t* buf = client->queued_last;
+        if (buf == NULL || buf->type != type || buf->len == HTTPD_WS_SEND_LEN) {
+            buf = _ws_buf_get(client);
+            buf->state = WS_BUF_QUEUED;
+            buf->type = type;
+            buf->fd = client->fd;
+            buf->len = 0;
+            client->queued_last = buf;
+            queue[queue_count++] = buf;
+        }
+        size_t len = HTTPD_WS_SEND_LEN - buf->len;
+        if (len > size) len = size;
+        memcpy(buf->data + buf->len, data, len);
+        buf->len += len;
+        data += len;
+        size -= len;
+    }
+    xSemaphoreGive(httpd_ws_mutex);
+
+    for (int i = 0; i < queue_count; i++)
+        _ws_queue(queue[i]);
+    return 0;
 }
 
-void _httpd_ws_open(httpd_req_t* req)
+// -----------------------------  _httpd_handler_ws  -----------------------------
+
+// a client for the fd of the request, NULL if all are busy or the open
+// callback refuses it: the handler fails and the server closes the socket
+ws_client_t* _httpd_ws_open(httpd_req_t* req)
 {
-    httpd_ws_fd = httpd_req_to_sockfd(req);
-    httpd_ws_hd = req->handle;
-    if (httpd_ws_rx_buffer) vRingbufferDelete(httpd_ws_rx_buffer);
-    httpd_ws_rx_buffer = xRingbufferCreate(HTTPD_WS_RINGBUF_RX_SIZE, RINGBUF_TYPE_BYTEBUF);
-    httpd_ws_open_cb(httpd_ws_fd);
+    int fd = httpd_req_to_sockfd(req);
+    xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+    ws_client_t* client = _ws_client_get(fd);
+    if (client) {
+        xSemaphoreGive(httpd_ws_mutex);
+        return client;
+    }
+    client = _ws_client_free();
+    if (client) {
+        client->hd = req->handle;
+        client->queued_last = NULL;
+        client->binary = false;
+        client->drop = 0;
+        for (int i = 0; i < HTTPD_WS_SEND_BUFS; i++)
+            client->send[i].client = client;
+        client->fd = fd;
+    }
+    xSemaphoreGive(httpd_ws_mutex);
+    if (client == NULL) {
+        ESP_LOGW(TAG_WS, "no free client for fd=%d", fd);
+        return NULL;
+    }
+
+    // the rx ring is kept for the next client of the slot
+    if (client->rx_buffer == NULL) client->rx_buffer = xRingbufferCreate(HTTPD_WS_RINGBUF_RX_SIZE, RINGBUF_TYPE_BYTEBUF);
+    size_t size = 0;
+    void* data;
+    if (client->rx_item) vRingbufferReturnItem(client->rx_buffer, client->rx_item);
+    client->rx_item = NULL;
+    while ((data = xRingbufferReceiveUpTo(client->rx_buffer, &size, 0, HTTPD_WS_RINGBUF_RX_SIZE)) != NULL)
+        vRingbufferReturnItem(client->rx_buffer, data);
+
+    ESP_LOGI(TAG_WS, "open fd=%d", fd);
+    if (!httpd_ws_open_cb(fd)) {
+        ESP_LOGW(TAG_WS, "client refused fd=%d", fd);
+        xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+        client->fd = 0;
+        xSemaphoreGive(httpd_ws_mutex);
+        return NULL;
+    }
+    return client;
 }
 
-void _httpd_ws_close()
+void _httpd_ws_close(int fd)
 {
-    if (httpd_ws_fd) httpd_ws_close_cb(httpd_ws_fd);
-    httpd_ws_fd = 0;
-    httpd_ws_hd = NULL;
-    if (httpd_ws_rx_buffer) vRingbufferDelete(httpd_ws_rx_buffer);
-    httpd_ws_rx_buffer = NULL;
+    xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+    ws_client_t* client = _ws_client_get(fd);
+    uint32_t drop = 0;
+    if (client) {
+        drop = client->drop;
+        client->fd = 0; // hd stays for the frames still queued
+    }
+    xSemaphoreGive(httpd_ws_mutex);
+    if (client == NULL) return;
+
+    if (drop) ESP_LOGW(TAG_WS, "closed fd=%d, %u writes dropped on full send pool", fd, drop);
+    httpd_ws_close_cb(fd);
 }
 
-esp_err_t _httpd_handler_ws(httpd_req_t* req)
+// to ws_data_cb after what waits in the rx buffer, the rest waits for
+// net_httpd_ws_rx_resume; on the httpd task like the resume work
+static void _ws_rx_push(ws_client_t* client, const char* data, size_t len)
+{
+    if (client->rx_item == NULL && xRingbufferGetCurFreeSize(client->rx_buffer) == HTTPD_WS_RINGBUF_RX_SIZE) {
+        size_t rest = httpd_ws_data_cb(client->fd, data, len);
+        data += len - rest;
+        len = rest;
+    }
+    if (len && xRingbufferSend(client->rx_buffer, data, len, 0) == 0)
+        ESP_LOGW(TAG_WS, "rx buffer full fd=%d, %u bytes dropped", client->fd, len);
+}
+
+static void _ws_rx_resume(void* arg)
 {
-    if (httpd_ws_fd == 0) {
-        _httpd_ws_open(req);
+    int fd = (int)arg;
+    xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+    ws_client_t* client = _ws_client_get(fd);
+    xSemaphoreGive(httpd_ws_mutex);
+
+    while (client && client->fd == fd) {
+        if (client->rx_item == NULL) {
+            client->rx_item = xRingbufferReceiveUpTo(client->rx_buffer, &client->rx_item_len, 0, HTTPD_WS_RINGBUF_RX_SIZE);
+            client->rx_item_taken = 0;
+            if (client->rx_item == NULL) break;
+        }
+        size_t len = client->rx_item_len - client->rx_item_taken;
+        size_t rest = httpd_ws_data_cb(fd, (const char*)client->rx_item + client->rx_item_taken, len);
+        client->rx_item_taken += len - rest;
+        if (rest) break;
+        vRingbufferReturnItem(client->rx_buffer, client->rx_item);
+        client->rx_item = NULL;
     }
+}
+
+void net_httpd_ws_rx_resume(int fd)
+{
+    if (httpd_ws_data_cb == NULL) return;
+    esp_err_t err = httpd_queue_work(server, _ws_rx_resume, (void*)fd);
+    if (err != ESP_OK) ESP_LOGE(TAG_WS, "httpd_queue_work failed with %d", err);
+}
+
+esp_err_t _httpd_handler_ws(httpd_req_t* req)
+{
+    ws_client_t* client = _httpd_ws_open(req);
+    if (client == NULL) return ESP_FAIL;
 
     uint8_t buf[128] = {0};
     httpd_ws_frame_t ws_pkt;
@@ -119,14 +365,30 @@ esp_err_t _httpd_handler_ws(httpd_req_t* req)
     switch (ws_pkt.type) {
 
     case HTTPD_WS_TYPE_TEXT:
-        done = xRingbufferSend(httpd_ws_rx_buffer, ws_pkt.payload, ws_pkt.len, 0);
+        if (httpd_ws_data_cb) {
+            _ws_rx_push(client, (const char*)ws_pkt.payload, ws_pkt.len);
+            _ws_rx_push(client, "\r", 1);
+            return ESP_OK;
+        }
+        done = xRingbufferSend(client->rx_buffer, ws_pkt.payload, ws_pkt.len, 0);
         if (done == 0) ESP_LOGW(TAG_WS, "rx buffer full");
-        done = xRingbufferSend(httpd_ws_rx_buffer, "\r", 1, 0);
+        done = xRingbufferSend(client->rx_buffer, "\r", 1, 0);
+        if (done == 0) ESP_LOGW(TAG_WS, "rx buffer full");
+        return ESP_OK;
+
+    case HTTPD_WS_TYPE_BINARY:
+        // a binary client gets binary frames, the messages are not lines
+        client->binary = true;
+        if (httpd_ws_data_cb) {
+            _ws_rx_push(client, (const char*)ws_pkt.payload, ws_pkt.len);
+            return ESP_OK;
+        }
+        done = xRingbufferSend(client->rx_buffer, ws_pkt.payload, ws_pkt.len, 0);
         if (done == 0) ESP_LOGW(TAG_WS, "rx buffer full");
         return ESP_OK;
 
     case HTTPD_WS_TYPE_CLOSE:
-        _httpd_ws_close();
+        _httpd_ws_close(client->fd);
         return ESP_OK;
 
     default:
@@ -147,19 +409,22 @@ static const httpd_uri_t _httpd_uri_ws = {
 ssize_t _ws_read(void* cookie, char* buf, size_t max_size)
 {
     int fd = (int)cookie;
-    if (fd != httpd_ws_fd) {
-        if (httpd_ws_fd != 0) ESP_LOGE(TAG_WS, "_ws_read fd error %u != %u", fd, httpd_ws_fd);
+    xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+    ws_client_t* client = _ws_client_get(fd);
+    xSemaphoreGive(httpd_ws_mutex);
+    if (client == NULL) {
+        ESP_LOGE(TAG_WS, "_ws_read fd error %u", fd);
         errno = EBADF;
         return -1;
     }
 
     size_t size = 0;
-    uint8_t* data = xRingbufferReceiveUpTo(httpd_ws_rx_buffer, &size, portMAX_DELAY, max_size);
+    uint8_t* data = xRingbufferReceiveUpTo(client->rx_buffer, &size, portMAX_DELAY, max_size);
     if (data == NULL || size == 0) return 0;
     if (size > max_size) size = max_size;
 
     memcpy(buf, data, size);
-    vRingbufferReturnItem(httpd_ws_rx_buffer, data);
+    vRingbufferReturnItem(client->rx_buffer, data);
 
     return size;
 }
@@ -167,42 +432,41 @@ ssize_t _ws_read(void* cookie, char* buf, size_t max_size)
 ssize_t _ws_write(void* cookie, const char* buf, size_t size)
 {
     int fd = (int)cookie;
-    if (fd != httpd_ws_fd) {
-        if (httpd_ws_fd != 0) ESP_LOGE(TAG_WS, "_ws_write fd error %u != %u", fd, httpd_ws_fd);
-        errno = EBADF;
+    // the producer thins on net_httpd_ws_get_tx_free to avoid EAGAIN
+    if (_ws_send(fd, buf, size) < 0) {
+        if (errno == EBADF) ESP_LOGE(TAG_WS, "_ws_write fd error %u", fd);
         return -1;
     }
-
-    struct async_resp_arg* resp_arg = malloc(sizeof(struct async_resp_arg));
-    resp_arg->hd = httpd_ws_hd;
-    resp_arg->fd = httpd_ws_fd;
-    resp_arg->type = HTTPD_WS_TYPE_TEXT;
-    resp_arg->len = size;
-    resp_arg->data = malloc(size);
-    memcpy(resp_arg->data, buf, size);
-    httpd_queue_work(server, ws_async_send, resp_arg);
-
     return size;
 }
 
 int _ws_close(void* cookie)
 {
     int fd = (int)cookie;
-    if (fd != httpd_ws_fd) {
-        if (httpd_ws_fd != 0) ESP_LOGE(TAG_WS, "_ws_close fd error %u != %u", fd, httpd_ws_fd);
+    xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+    ws_client_t* client = _ws_client_get(fd);
+    if (client == NULL) {
+        xSemaphoreGive(httpd_ws_mutex);
         errno = EBADF;
         return -1;
     }
 
-    struct async_resp_arg* resp_arg = malloc(sizeof(struct async_resp_arg));
-    resp_arg->hd = httpd_ws_hd;
-    resp_arg->fd = httpd_ws_fd;
-    resp_arg->type = HTTPD_WS_TYPE_CLOSE;
-    resp_arg->len = 0;
-    resp_arg->data = NULL;
-    httpd_queue_work(server, ws_async_send, resp_arg);
+    // the close frame follows the queued ones
+    ws_send_buf_t* buf = _ws_buf_get(client);
+    if (buf) {
+        buf->state = WS_BUF_QUEUED;
+        buf->type = HTTPD_WS_TYPE_CLOSE;
+        buf->fd = fd;
+        buf->len = 0;
+        client->queued_last = NULL;
+    }
+    else {
+        client->close_pending = true;
+    }
+    xSemaphoreGive(httpd_ws_mutex);
+    if (buf) _ws_queue(buf);
 
-    _httpd_ws_close();
+    _httpd_ws_close(fd);
     return 0;
 }
 
@@ -217,23 +481,47 @@ FILE* net_httpd_ws_fopen(int fd, const char* mode)
     return fopencookie((void*)fd, mode, ws_cookie_func);
 }
 
+ssize_t net_httpd_ws_read(int fd, char* buf, size_t size)
+{
+    return _ws_read((void*)fd, buf, size);
+}
+
+size_t net_httpd_ws_get_tx_free(int fd)
+{
+    size_t tx_free = 0;
+    xSemaphoreTake(httpd_ws_mutex, portMAX_DELAY);
+    ws_client_t* client = _ws_client_get(fd);
+    if (client) tx_free = _ws_tx_free(client, _ws_type(client));
+    xSemaphoreGive(httpd_ws_mutex);
+    return tx_free;
+}
+
+size_t net_httpd_ws_get_tx_size(int fd)
+{
+    return HTTPD_WS_SEND_BUFS * HTTPD_WS_SEND_LEN;
+}
+
 // -----------------------------  _httpd_handler_get_system_info  -----------------------------
 
 /* Simple handler for getting system info */
 static esp_err_t _httpd_handler_get_system_info(httpd_req_t* req)
 {
     httpd_resp_set_type(req, HTTPD_TYPE_JSON);
-    cJSON* root = cJSON_CreateObject();
     esp_chip_info_t chip_info;
     esp_chip_info(&chip_info);
-    cJSON_AddStringToObject(root, "version", IDF_VER);
-    cJSON_AddNumberToObject(root, "cores", chip_info.cores);
-    cJSON_AddNumberToObject(root, "revision", chip_info.revision);
-    const char* sys_info = cJSON_Print(root);
-    httpd_resp_sendstr(req, sys_info);
-    free((void*)sys_info);
-    cJSON_Delete(root);
-    return ESP_OK;
+    char buf[128];
+    jsonw_t w;
+    jsonw_init(&w, buf, sizeof(buf));
+    jsonw_object_begin(&w);
+    jsonw_key(&w, "version");
+    jsonw_string(&w, IDF_VER);
+    jsonw_key(&w, "cores");
+    jsonw_uint(&w, chip_info.cores);
+    jsonw_key(&w, "revision");
+    jsonw_uint(&w, chip_info.revision);
+    jsonw_object_end(&w);
+    if (!jsonw_ok(&w)) return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "overflow");
+    return httpd_resp_send(req, buf, jsonw_len(&w));
 }
 
 /* URI handler for fetching system info */
@@ -243,12 +531,359 @@ static const httpd_uri_t _httpd_uri_get_system_info = {
     .handler = _httpd_handler_get_system_info,
     .user_ctx = NULL};
 
+// -----------------------------  _httpd_handler_stream  -----------------------------
+
+// server-sent events of decoded signals: /api/stream?sg=name,name&ms=500,
+// all signals every second by default; the clients with the same signals
+// share the event of a tick
+
+#define HTTPD_SSE_CONN_MAX 3
+#define HTTPD_SSE_TICK_MS 100       // the intervals are multiples
+#define HTTPD_SSE_INTERVAL_MS 1000  // default
+#define HTTPD_SSE_CHUNK_HEAD 6      // "01ab\r\n", fixed width chunk size
+#define HTTPD_SSE_DATA "data: "
+#define HTTPD_SSE_QUERY_LEN 256
+#define HTTPD_SSE_RETRY "retry: 2000\n\n"
+#define HTTPD_SSE_OVERFLOW "event: error\ndata: overflow\n\n"
+
+typedef struct {
+    int fd; // 0 if free
+    dbc_set_t sg;
+    uint32_t interval_ms;
+    int64_t next_us;
+    uint32_t drop; // events skipped on a full socket
+    size_t len;    // event of this tick, 0 if none
+    char* event;   // chunk of an event, sized from the signal table at start
+} sse_client_t;
+
+// the clients are only used by the httpd task
+static sse_client_t httpd_sse_clients[HTTPD_SSE_CONN_MAX];
+static esp_timer_handle_t httpd_sse_timer = NULL;
+static volatile bool httpd_sse_queued = false; // push work pending
+static int httpd_sse_count = 0;
+static size_t httpd_sse_event_size = 0;
+
+#define HTTPD_SG_HEAD_LEN 48  // {"ts":<uint64>,"sg":{ or {"gen":<uint32>,"sg":{, }}
+#define HTTPD_SG_VALUE_LEN 16 // %.7g or null, comma
+
+// longest object of the values of all the signals
+static size_t _httpd_sg_values_len()
+{
+    size_t len = HTTPD_SG_HEAD_LEN;
+    for (int i = 0; i < dbc_signal_count(); i++)
+        len += strlen(dbc_signal_get(i)->name) + 3 + HTTPD_SG_VALUE_LEN; // "name":
+    return len;
+}
+
+// signals of the sg query key (name,name), all by default, false on an unknown name
+static bool _httpd_query_sg(const char* query, dbc_set_t* sg)
+{
+    char val[HTTPD_SSE_QUERY_LEN];
+    memset(sg, 0, sizeof(*sg));
+    if (query && httpd_query_key_value(query, "sg", val, sizeof(val)) == ESP_OK) {
+        char* save;
+        for (char* name = strtok_r(val, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+            int i = dbc_signal_find(name);
+            if (i < 0) return false;
+            dbc_set_add(sg, i);
+        }
+    }
+    if (dbc_set_empty(sg)) dbc_set_all(sg);
+    return true;
+}
+
+static sse_client_t* _sse_client_get(int fd)
+{
+    for (int i = 0; i < HTTPD_SSE_CONN_MAX; i++) {
+        if (httpd_sse_clients[i].fd == fd) return &httpd_sse_clients[i];
+    }
+    return NULL;
+}
+
+// an event chunk with the latest values of the signals in buf, 0 on overflow
+static size_t _sse_event(const dbc_set_t* sg_set, int64_t us, char* buf)
+{
+    char* ev = buf + HTTPD_SSE_CHUNK_HEAD;
+    size_t len = strlen(HTTPD_SSE_DATA);
+    memcpy(ev, HTTPD_SSE_DATA, len);
+
+    jsonw_t w;
+    jsonw_init(&w, ev + len, httpd_sse_event_size - HTTPD_SSE_CHUNK_HEAD - len - 4);
+    jsonw_object_begin(&w);
+    jsonw_key(&w, "ts");
+    jsonw_uint(&w, us / 1000);
+    jsonw_key(&w, "sg");
+    jsonw_object_begin(&w);
+    for (int i = 0; i < dbc_signal_count(); i++) {
+        if (!dbc_set_has(sg_set, i)) continue;
+        const sg_t* sg = dbc_signal_get(i);
+        can_message_timestamp_t msg;
+        jsonw_key(&w, sg->name);
+        if (can_id_latest_get(sg->id, &msg))
+            jsonw_number(&w, dbc_decode(sg, msg.msg.data, msg.msg.data_length_code));
+        else
+            jsonw_null(&w);
+    }
+    jsonw_object_end(&w);
+    jsonw_object_end(&w);
+    if (!jsonw_ok(&w)) {
+        ESP_LOGE(TAG, "sse event overflow sg=%08X", dbc_set_hash(sg_set));
+        return 0;
+    }
+
+    len += jsonw_len(&w);
+    memcpy(ev + len, "\n\n\r\n", 4); // event end, chunk end
+    char head[HTTPD_SSE_CHUNK_HEAD + 1];
+    snprintf(head, sizeof(head), "%04x\r\n", len + 2);
+    memcpy(buf, head, HTTPD_SSE_CHUNK_HEAD);
+    return HTTPD_SSE_CHUNK_HEAD + len + 4;
+}
+
+static void _sse_push(void* arg)
+{
+    httpd_sse_queued = false;
+    int64_t us = esp_timer_get_time();
+
+    for (int i = 0; i < HTTPD_SSE_CONN_MAX; i++) {
+        sse_client_t* client = &httpd_sse_clients[i];
+        client->len = 0;
+        if (client->fd == 0 || us < client->next_us) continue;
+        client->next_us += client->interval_ms * 1000;
+        if (client->next_us < us) client->next_us = us + client->interval_ms * 1000;
+
+        // one serialization per signal set and tick
+        const char* event = NULL;
+        size_t len = 0;
+        for (int j = 0; j < i && event == NULL; j++) {
+            sse_client_t* other = &httpd_sse_clients[j];
+            if (other->len > 0 && dbc_set_equal(&other->sg, &client->sg)) {
+                event = other->event;
+                len = other->len;
+            }
+        }
+        if (event == NULL) {
+            client->len = _sse_event(&client->sg, us, client->event);
+            event = client->event;
+            len = client->len;
+        }
+        if (len == 0) {
+            // tell the client why the stream ends
+            char chunk[HTTPD_SSE_CHUNK_HEAD + sizeof(HTTPD_SSE_OVERFLOW) + 2];
+            int n = snprintf(chunk, sizeof(chunk), "%04x\r\n%s\r\n", (unsigned)strlen(HTTPD_SSE_OVERFLOW), HTTPD_SSE_OVERFLOW);
+            httpd_socket_send(server, client->fd, chunk, n, MSG_DONTWAIT);
+            httpd_sess_trigger_close(server, client->fd);
+            continue;
+        }
+
+        // a slow client skips events, a partial chunk ends the stream
+        int ret = httpd_socket_send(server, client->fd, event, len, MSG_DONTWAIT);
+        if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+            client->drop++;
+        }
+        else if (ret != (int)len) {
+            ESP_LOGW(TAG, "sse send error fd=%d ret=%d", client->fd, ret);
+            httpd_sess_trigger_close(server, client->fd);
+        }
+    }
+}
+
+static void _sse_tick(void* arg)
+{
+    if (httpd_sse_queued || server == NULL) return;
+    httpd_sse_queued = true;
+    if (httpd_queue_work(server, _sse_push, NULL) != ESP_OK) httpd_sse_queued = false;
+}
+
+static void _sse_close(int fd)
+{
+    if (fd == 0) return;
+    sse_client_t* client = _sse_client_get(fd);
+    if (client == NULL) return;
+    ESP_LOGI(TAG, "sse closed fd=%d, %u events skipped", fd, client->drop);
+    client->fd = 0;
+    if (--httpd_sse_count == 0) esp_timer_stop(httpd_sse_timer);
+}
+
+static esp_err_t _httpd_handler_stream(httpd_req_t* req)
+{
+    dbc_set_t sg;
+    uint32_t interval_ms = HTTPD_SSE_INTERVAL_MS;
+    char query[HTTPD_SSE_QUERY_LEN];
+    char val[16];
+    bool has_query = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK;
+    if (!_httpd_query_sg(has_query ? query : NULL, &sg))
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "unknown signal");
+    if (has_query && httpd_query_key_value(query, "ms", val, sizeof(val)) == ESP_OK) {
+        interval_ms = strtoul(val, NULL, 10);
+        if (interval_ms < HTTPD_SSE_TICK_MS) interval_ms = HTTPD_SSE_TICK_MS;
+    }
+
+    sse_client_t* client = _sse_client_get(0);
+    if (client == NULL) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_sendstr(req, "too many streams");
+    }
+
+    // the response is never ended: the headers and a first chunk now, then
+    // each event is a chunk sent on the socket by _sse_push
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    esp_err_t err = httpd_resp_send_chunk(req, HTTPD_SSE_RETRY, strlen(HTTPD_SSE_RETRY));
+    if (err != ESP_OK) return err;
+
+    client->fd = httpd_req_to_sockfd(req);
+    client->sg = sg;
+    client->interval_ms = interval_ms;
+    client->next_us = esp_timer_get_time();
+    client->drop = 0;
+    client->len = 0;
+    if (httpd_sse_count++ == 0) esp_timer_start_periodic(httpd_sse_timer, HTTPD_SSE_TICK_MS * 1000);
+    ESP_LOGI(TAG, "sse open fd=%d sg=%08X every %u ms", client->fd, dbc_set_hash(&sg), interval_ms);
+    return ESP_OK;
+}
+
+static const httpd_uri_t _httpd_uri_stream = {
+    .uri = "/api/stream",
+    .method = HTTP_GET,
+    .handler = _httpd_handler_stream,
+    .user_ctx = NULL};
+
+// -----------------------------  _httpd_handler_state  -----------------------------
+
+// latest decoded values: /api/state?sg=name,name, all signals by default;
+// the ETag is the generation of the frames of the signals, a poll of
+// unchanged frames is answered 304 without decoding nor a body; the
+// generations restart at each boot, a nonce of the boot tells them apart
+
+#define HTTPD_ETAG_LEN 32
+
+// last body sized from the signal table at start, only used by the httpd task
+static uint32_t httpd_state_nonce = 0;
+static char* httpd_state_body = NULL;
+static size_t httpd_state_body_size = 0;
+static size_t httpd_state_body_len = 0;
+static dbc_set_t httpd_state_body_sg;
+static uint32_t httpd_state_body_gen = 0;
+
+// the sum of the data generations of the IDs of the signals, it grows on
+// each change of their frames
+static uint32_t _state_gen(const dbc_set_t* sg_set)
+{
+    uint32_t gen = 0;
+    for (int i = 0; i < dbc_signal_count(); i++) {
+        if (dbc_set_has(sg_set, i)) gen += can_id_gen(can_id_index(dbc_signal_get(i)->id));
+    }
+    return gen;
+}
+
+static size_t _state_body(const dbc_set_t* sg_set, uint32_t gen, char* buf, size_t size)
+{
+    jsonw_t w;
+    jsonw_init(&w, buf, size);
+    jsonw_object_begin(&w);
+    jsonw_key(&w, "gen");
+    jsonw_uint(&w, gen);
+    jsonw_key(&w, "sg");
+    jsonw_object_begin(&w);
+    for (int i = 0; i < dbc_signal_count(); i++) {
+        if (!dbc_set_has(sg_set, i)) continue;
+        const sg_t* sg = dbc_signal_get(i);
+        can_message_timestamp_t msg;
+        jsonw_key(&w, sg->name);
+        if (can_id_latest_get(sg->id, &msg))
+            jsonw_number(&w, dbc_decode(sg, msg.msg.data, msg.msg.data_length_code));
+        else
+            jsonw_null(&w);
+    }
+    jsonw_object_end(&w);
+    jsonw_object_end(&w);
+    if (!jsonw_ok(&w)) {
+        ESP_LOGE(TAG, "state body overflow sg=%08X", dbc_set_hash(sg_set));
+        return 0;
+    }
+    return jsonw_len(&w);
+}
+
+static esp_err_t _httpd_handler_state(httpd_req_t* req)
+{
+    dbc_set_t sg;
+    char query[HTTPD_SSE_QUERY_LEN];
+    bool has_query = httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK;
+    if (!_httpd_query_sg(has_query ? query : NULL, &sg))
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "unknown signal");
+
+    uint32_t gen = _state_gen(&sg);
+    char etag[HTTPD_ETAG_LEN];
+    snprintf(etag, sizeof(etag), "\"%x-%x-%x\"", httpd_state_nonce, gen, dbc_set_hash(&sg));
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+
+    char match[HTTPD_ETAG_LEN];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match)) == ESP_OK && strcmp(match, etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, NULL, 0);
+    }
+
+    // the signals are decoded again for other signals or a new generation
+    if (httpd_state_body_len == 0 || !dbc_set_equal(&sg, &httpd_state_body_sg) || gen != httpd_state_body_gen) {
+        httpd_state_body_len = _state_body(&sg, gen, httpd_state_body, httpd_state_body_size);
+        httpd_state_body_sg = sg;
+        httpd_state_body_gen = gen;
+    }
+    if (httpd_state_body_len == 0) return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "overflow");
+
+    httpd_resp_set_type(req, HTTPD_TYPE_JSON);
+    return httpd_resp_send(req, httpd_state_body, httpd_state_body_len);
+}
+
+static const httpd_uri_t _httpd_uri_state = {
+    .uri = "/api/state",
+    .method = HTTP_GET,
+    .handler = _httpd_handler_state,
+    .user_ctx = NULL};
+
 // -----------------------------  net_httpd_start/stop  -----------------------------
 
+// a socket of the server closed: a ws client without a close frame, an sse stream
+void _httpd_close_fn(httpd_handle_t hd, int fd)
+{
+    _httpd_ws_close(fd);
+    _sse_close(fd);
+    close(fd);
+}
+
 bool net_httpd_start()
 {
     esp_err_t err;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.close_fn = _httpd_close_fn;
+    if (httpd_state_nonce == 0) httpd_state_nonce = esp_random();
+    if (httpd_state_body == NULL) {
+        httpd_state_body_size = _httpd_sg_values_len();
+        httpd_state_body = malloc(httpd_state_body_size);
+        if (httpd_state_body == NULL) {
+            ESP_LOGE(TAG, "state no mem");
+            return false;
+        }
+    }
+
+    if (httpd_sse_event_size == 0) {
+        size_t size = HTTPD_SSE_CHUNK_HEAD + strlen(HTTPD_SSE_DATA) + _httpd_sg_values_len() + 4;
+        for (int i = 0; i < HTTPD_SSE_CONN_MAX; i++) {
+            if (httpd_sse_clients[i].event == NULL) httpd_sse_clients[i].event = malloc(size);
+            if (httpd_sse_clients[i].event == NULL) {
+                ESP_LOGE(TAG, "sse no mem");
+                return false;
+            }
+        }
+        httpd_sse_event_size = size;
+    }
+    if (httpd_sse_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+            .callback = _sse_tick,
+            .name = "httpd-sse"};
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &httpd_sse_timer));
+    }
 
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
@@ -262,6 +897,8 @@ bool net_httpd_start()
     ESP_LOGI(TAG, "Registering URI handlers");
     httpd_register_uri_handler(server, &_httpd_uri_ws);
     httpd_register_uri_handler(server, &_httpd_uri_get_system_info);
+    httpd_register_uri_handler(server, &_httpd_uri_stream);
+    httpd_register_uri_handler(server, &_httpd_uri_state);
 
     return true;
 }
@@ -273,9 +910,11 @@ bool net_httpd_stop()
     return httpd_stop(server) == ESP_OK;
 }
 
-int net_httpd_ws_init(net_httpd_cb_t ws_open_cb, net_httpd_cb_t ws_close_cb)
+int net_httpd_ws_init(net_httpd_open_cb_t ws_open_cb, net_httpd_cb_t ws_close_cb, net_httpd_data_cb_t ws_data_cb)
 {
+    if (httpd_ws_mutex == NULL) httpd_ws_mutex = xSemaphoreCreateMutex();
     httpd_ws_open_cb = ws_open_cb;
     httpd_ws_close_cb = ws_close_cb;
+    httpd_ws_data_cb = ws_data_cb;
     return 0;
 }
@@ -19,10 +19,21 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#define HTTPD_WS_CONN_MAX 3 // ws clients at once, each with its own buffers
+
 typedef void (*net_httpd_cb_t)(int fd);
+typedef bool (*net_httpd_open_cb_t)(int fd); // false refuses the client
+typedef size_t (*net_httpd_data_cb_t)(int fd, const char* data, size_t len); // bytes not taken
 
 bool net_httpd_start();
 bool net_httpd_stop();
 
-int net_httpd_ws_init(net_httpd_cb_t ws_open_cb, net_httpd_cb_t ws_close_cb);
+// with ws_data_cb, text frames are pushed to it instead of net_httpd_ws_read;
+// what it does not take waits in the rx buffer until net_httpd_ws_rx_resume
+int net_httpd_ws_init(net_httpd_open_cb_t ws_open_cb, net_httpd_cb_t ws_close_cb, net_httpd_data_cb_t ws_data_cb);
+void net_httpd_ws_rx_resume(int fd);
 FILE* net_httpd_ws_fopen(int fd, const char* mode);
+ssize_t net_httpd_ws_read(int fd, char* buf, size_t size);
+// the writes fail when the send pool is full, free size to avoid it
+size_t net_httpd_ws_get_tx_free(int fd);
+size_t net_httpd_ws_get_tx_size(int fd);
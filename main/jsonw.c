@@ -0,0 +1,170 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "jsonw.h"
+
+void jsonw_init(jsonw_t* w, char* buf, size_t size)
+{
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->comma = false;
+    w->overflow = false;
+}
+
+static void _jsonw_put(jsonw_t* w, const char* s, size_t len)
+{
+    if (w->overflow) return;
+    if (w->len + len > w->size) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->buf + w->len, s, len);
+    w->len += len;
+}
+
+static inline void _jsonw_char(jsonw_t* w, char c)
+{
+    _jsonw_put(w, &c, 1);
+}
+
+// before a value or a key
+static void _jsonw_sep(jsonw_t* w)
+{
+    if (w->comma) _jsonw_char(w, ',');
+    w->comma = false;
+}
+
+static void _jsonw_printf(jsonw_t* w, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+static void _jsonw_printf(jsonw_t* w, const char* fmt, ...)
+{
+    if (w->overflow) return;
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(w->buf + w->len, w->size - w->len, fmt, args);
+    va_end(args);
+    if (len < 0 || (size_t)len >= w->size - w->len)
+        w->overflow = true;
+    else
+        w->len += len;
+}
+
+void jsonw_object_begin(jsonw_t* w)
+{
+    _jsonw_sep(w);
+    _jsonw_char(w, '{');
+}
+
+void jsonw_object_end(jsonw_t* w)
+{
+    _jsonw_char(w, '}');
+    w->comma = true;
+}
+
+void jsonw_array_begin(jsonw_t* w)
+{
+    _jsonw_sep(w);
+    _jsonw_char(w, '[');
+}
+
+void jsonw_array_end(jsonw_t* w)
+{
+    _jsonw_char(w, ']');
+    w->comma = true;
+}
+
+static void _jsonw_escaped(jsonw_t* w, const char* s)
+{
+    static const char hex[] = "0123456789abcdef";
+    _jsonw_char(w, '"');
+    for (; *s; s++) {
+        uint8_t c = *s;
+        if (c == '"' || c == '\\') {
+            char esc[2] = {'\\', c};
+            _jsonw_put(w, esc, 2);
+        }
+        else if (c < 0x20) {
+            char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+            _jsonw_put(w, esc, 6);
+        }
+        else {
+            _jsonw_char(w, c);
+        }
+    }
+    _jsonw_char(w, '"');
+}
+
+void jsonw_key(jsonw_t* w, const char* key)
+{
+    _jsonw_sep(w);
+    _jsonw_escaped(w, key);
+    _jsonw_char(w, ':');
+}
+
+void jsonw_string(jsonw_t* w, const char* s)
+{
+    _jsonw_sep(w);
+    _jsonw_escaped(w, s);
+    w->comma = true;
+}
+
+void jsonw_number(jsonw_t* w, double v)
+{
+    if (!isfinite(v)) {
+        jsonw_null(w);
+        return;
+    }
+    _jsonw_sep(w);
+    _jsonw_printf(w, "%.7g", v);
+    w->comma = true;
+}
+
+void jsonw_uint(jsonw_t* w, uint64_t v)
+{
+    _jsonw_sep(w);
+    _jsonw_printf(w, "%" PRIu64, v);
+    w->comma = true;
+}
+
+void jsonw_int(jsonw_t* w, int64_t v)
+{
+    _jsonw_sep(w);
+    _jsonw_printf(w, "%" PRId64, v);
+    w->comma = true;
+}
+
+void jsonw_bool(jsonw_t* w, bool v)
+{
+    _jsonw_sep(w);
+    if (v)
+        _jsonw_put(w, "true", 4);
+    else
+        _jsonw_put(w, "false", 5);
+    w->comma = true;
+}
+
+void jsonw_null(jsonw_t* w)
+{
+    _jsonw_sep(w);
+    _jsonw_put(w, "null", 4);
+    w->comma = true;
+}
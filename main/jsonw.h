@@ -0,0 +1,50 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// streaming JSON writer into a caller buffer, no allocation and no tree:
+// the values are written in order, commas are added between them; on
+// overflow the output is truncated and jsonw_ok is false
+
+typedef struct {
+    char* buf;
+    size_t size;
+    size_t len;
+    bool comma;    // a value was written at this level
+    bool overflow;
+} jsonw_t;
+
+void jsonw_init(jsonw_t* w, char* buf, size_t size);
+
+void jsonw_object_begin(jsonw_t* w);
+void jsonw_object_end(jsonw_t* w);
+void jsonw_array_begin(jsonw_t* w);
+void jsonw_array_end(jsonw_t* w);
+void jsonw_key(jsonw_t* w, const char* key); // the next value is the member key
+
+void jsonw_string(jsonw_t* w, const char* s);
+void jsonw_number(jsonw_t* w, double v); // null if not finite
+void jsonw_uint(jsonw_t* w, uint64_t v);
+void jsonw_int(jsonw_t* w, int64_t v);
+void jsonw_bool(jsonw_t* w, bool v);
+void jsonw_null(jsonw_t* w);
+
+static inline size_t jsonw_len(const jsonw_t* w) { return w->len; }
+static inline bool jsonw_ok(const jsonw_t* w) { return !w->overflow; }
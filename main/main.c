@@ -17,6 +17,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "driver/gpio.h"
@@ -41,121 +42,361 @@
 
 static const char* TAG = "TeslapLX";
 
+// nominal transport rates for the monitor rate plan, B/s
+#define BT_LINK_RATE 40000
+#define NET_LINK_RATE 200000
+
+#define UART_LINK_POLL_MS 100 // session end check while no input
+
+// link of a transport read by a task of its own (uart)
+typedef struct {
+    elm_link_t link;
+    TaskHandle_t task; // notified when the session ended
+} main_link_t;
+
+void main_link_close(const elm_link_t* link)
+{
+    xTaskNotifyGive(((const main_link_t*)link)->task);
+}
+
 
 // -----------------------------  bt  -----------------------------
 
-void bt_task(void* param)
+// bt sessions by connection, the bt callbacks run on the bt task
+typedef struct {
+    uint32_t handle;
+    uint32_t session;
+} bt_session_t;
+
+static bt_session_t bt_sessions[BT_CONN_MAX];
+static volatile int bt_session_count = 0;
+
+static bt_session_t* bt_session_get(uint32_t handle)
 {
-    uint32_t handle = (uint32_t)param;
-    ESP_LOGI(TAG, "bt task started handle=%u", handle);
+    for (int i = 0; i < BT_CONN_MAX; i++) {
+        if (bt_sessions[i].handle == handle) return &bt_sessions[i];
+    }
+    return NULL;
+}
 
-    stdin  = bt_fopen(handle, "r");
-    stdout = bt_fopen(handle, "w");
+// the connections share the radio, each link plans its monitor on its
+// share; read by the workers, the links may be freed there
+void bt_session_count_update()
+{
+    int count = 0;
+    for (int i = 0; i < BT_CONN_MAX; i++) {
+        if (bt_sessions[i].handle != 0) count++;
+    }
+    bt_session_count = count;
+}
 
-    setvbuf(stdin, NULL, _IONBF, 0);
+uint32_t bt_link_rate(void* ctx)
+{
+    int count = bt_session_count;
+    return BT_LINK_RATE / (count > 0 ? count : 1);
+}
 
-    elm_do("elm-bt");
+size_t bt_link_tx_free(void* ctx)
+{
+    return bt_get_tx_free((uint32_t)ctx);
+}
 
-    ESP_LOGI(TAG, "bt task ended handle=%u", handle);
-    fclose(stdin);
-    fclose(stdout);
-    vTaskDelete(NULL);
+void bt_link_rx_resume(void* ctx)
+{
+    bt_rx_resume((uint32_t)ctx);
+}
+
+void bt_link_close(const elm_link_t* link)
+{
+    ESP_LOGI(TAG, "bt session ended handle=%u", (uint32_t)link->ctx);
+    fclose(link->out);
+    free((elm_link_t*)link);
 }
 
 void bt_open_cb(uint32_t handle)
 {
     ESP_LOGI(TAG, "bt start handle=%u", handle);
-    xTaskCreatePinnedToCore(bt_task, "elm-bt", 8 * 1024, (void*)handle, 5, NULL, 0);
+
+    bt_session_t* s = bt_session_get(0);
+    elm_link_t* link = s ? calloc(1, sizeof(elm_link_t)) : NULL;
+    if (link == NULL) {
+        ESP_LOGE(TAG, "bt no slot or mem for link handle=%u", handle);
+        bt_close(handle);
+        return;
+    }
+    link->ctx = (void*)handle;
+    link->tx_size = bt_get_tx_size(handle);
+    link->tx_free = bt_link_tx_free;
+    link->rate = BT_LINK_RATE;
+    link->rate_get = bt_link_rate;
+    link->peer = bt_get_peer(handle);
+    link->out = bt_fopen(handle, "w");
+    link->rx_resume = bt_link_rx_resume;
+    link->close = bt_link_close;
+    s->session = elm_session_open("elm-bt", link);
+    if (s->session == 0) {
+        bt_link_close(link);
+        return;
+    }
+    s->handle = handle;
+    bt_session_count_update();
+}
+
+size_t bt_data_cb(uint32_t handle, const uint8_t* data, size_t len)
+{
+    bt_session_t* s = bt_session_get(handle);
+    return s ? elm_session_push(s->session, (const char*)data, len) : 0;
 }
 
 void bt_close_cb(uint32_t handle)
 {
     ESP_LOGI(TAG, "bt stop handle=%u", handle);
+    bt_session_t* s = bt_session_get(handle);
+    if (s == NULL) return;
+    elm_session_close(s->session);
+    s->handle = 0;
+    s->session = 0;
+    bt_session_count_update();
 }
 
 // -----------------------------  tcp  -----------------------------
 
-void tcp_task(void* param)
+// tcp sessions by socket, the tcp callbacks run on the tcp server task
+typedef struct {
+    int sock; // -1 if free
+    uint32_t session;
+} tcp_session_t;
+
+static tcp_session_t tcp_sessions[WIFI_TCP_CONN_MAX] = {[0 ... WIFI_TCP_CONN_MAX - 1] = {.sock = -1}};
+
+static tcp_session_t* tcp_session_get(int sock)
 {
-    int soc = (int)param;
-    ESP_LOGI(TAG, "tcp task started socket=%u", soc);
+    for (int i = 0; i < WIFI_TCP_CONN_MAX; i++) {
+        if (tcp_sessions[i].sock == sock) return &tcp_sessions[i];
+    }
+    return NULL;
+}
 
+size_t tcp_link_tx_free(void* ctx)
+{
+    return tcp_get_tx_free((int)ctx);
+}
 
-    stdin  = tcp_fopen(soc, "r");
-    stdout = tcp_fopen(soc, "w");
+void tcp_link_rx_resume(void* ctx)
+{
+    tcp_rx_resume((int)ctx);
+}
 
-    setvbuf(stdin, NULL, _IONBF, 0);
+void tcp_link_close(const elm_link_t* link)
+{
+    // the socket is closed once its tx buffer is sent
+    ESP_LOGI(TAG, "tcp session ended socket=%d", (int)link->ctx);
+    fclose(link->out);
+    free((elm_link_t*)link);
+}
 
-    elm_do("elm-tcp");
+void tcp_open_cb(int sock)
+{
+    ESP_LOGI(TAG, "tcp start socket=%d", sock);
+
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    uint64_t peer = 0;
+    if (getpeername(sock, (struct sockaddr*)&peer_addr, &peer_addr_len) == 0 && peer_addr.sin_family == AF_INET)
+        peer = peer_addr.sin_addr.s_addr;
+
+    tcp_session_t* s = tcp_session_get(-1);
+    elm_link_t* link = s ? calloc(1, sizeof(elm_link_t)) : NULL;
+    if (link == NULL) {
+        ESP_LOGE(TAG, "tcp no slot or mem for link socket=%d", sock);
+        tcp_close(sock);
+        return;
+    }
+    link->ctx = (void*)sock;
+    link->tx_size = tcp_get_tx_size(sock);
+    link->tx_free = tcp_link_tx_free;
+    link->rate = NET_LINK_RATE;
+    link->peer = peer;
+    link->out = tcp_fopen(sock, "w");
+    link->binary = true;
+    link->rx_resume = tcp_link_rx_resume;
+    link->close = tcp_link_close;
+    s->session = elm_session_open("elm-tcp", link);
+    if (s->session == 0) {
+        tcp_link_close(link);
+        return;
+    }
+    s->sock = sock;
+}
 
-    ESP_LOGI(TAG, "tcp task ended socket=%u", soc);
-    fclose(stdin);
-    fclose(stdout);
+size_t tcp_data_cb(int sock, const char* data, size_t len)
+{
+    tcp_session_t* s = tcp_session_get(sock);
+    return s ? elm_session_push(s->session, data, len) : 0;
 }
 
-void tcp_open_cb(int soc)
+void tcp_close_cb(int sock)
 {
-    ESP_LOGI(TAG, "tcp start socket=%u", soc);
-    tcp_task((void*)soc);
-    //CONFIG_ESP32_WIFI_TASK_PINNED_TO_CORE_0
-    // xTaskCreatePinnedToCore(bt_task, "elm-bt", 8 * 1024, (void*)soc, 5, NULL, 0);
+    ESP_LOGI(TAG, "tcp stop socket=%d", sock);
+    tcp_session_t* s = tcp_session_get(sock);
+    if (s == NULL) return;
+    elm_session_close(s->session);
+    s->sock = -1;
+    s->session = 0;
 }
 
 
 // -----------------------------  ws  -----------------------------
 
-void ws_task(void* param)
-{
-    int fd = (int)param;
-    ESP_LOGI(TAG, "ws task started fd=%u", fd);
+// ws sessions by fd, the ws callbacks run on the httpd task
+typedef struct {
+    int fd; // 0 if free
+    uint32_t session;
+} ws_session_t;
+
+static ws_session_t ws_sessions[HTTPD_WS_CONN_MAX];
 
-    stdin  = net_httpd_ws_fopen(fd, "r");
-    stdout = net_httpd_ws_fopen(fd, "w");
+static ws_session_t* ws_session_get(int fd)
+{
+    for (int i = 0; i < HTTPD_WS_CONN_MAX; i++) {
+        if (ws_sessions[i].fd == fd) return &ws_sessions[i];
+    }
+    return NULL;
+}
 
-    setvbuf(stdin, NULL, _IONBF, 0);
+size_t ws_link_tx_free(void* ctx)
+{
+    return net_httpd_ws_get_tx_free((int)ctx);
+}
 
-    elm_do("elm-ws");
+void ws_link_rx_resume(void* ctx)
+{
+    net_httpd_ws_rx_resume((int)ctx);
+}
 
-    ESP_LOGI(TAG, "ws task ended fd=%u", fd);
-    fclose(stdin);
-    fclose(stdout);
-    vTaskDelete(NULL);
+void ws_link_close(const elm_link_t* link)
+{
+    ESP_LOGI(TAG, "ws session ended fd=%u", (int)link->ctx);
+    fclose(link->out);
+    free((elm_link_t*)link);
 }
 
-void ws_open_cb(int fd)
+// false without a slot or a session, the client is refused
+bool ws_open_cb(int fd)
 {
     ESP_LOGI(TAG, "ws start handle=%u", fd);
-    xTaskCreatePinnedToCore(ws_task, "elm-ws", 8 * 1024, (void*)fd, 5, NULL, 0);
+
+    ws_session_t* s = ws_session_get(0);
+    elm_link_t* link = s ? calloc(1, sizeof(elm_link_t)) : NULL;
+    if (link == NULL) {
+        ESP_LOGE(TAG, "ws no slot or mem for link fd=%u", fd);
+        return false;
+    }
+    link->ctx = (void*)fd;
+    link->tx_size = net_httpd_ws_get_tx_size(fd);
+    link->tx_free = ws_link_tx_free;
+    link->rate = NET_LINK_RATE;
+    link->out = net_httpd_ws_fopen(fd, "w");
+    link->binary = true;
+    link->rx_resume = ws_link_rx_resume;
+    link->close = ws_link_close;
+    s->session = elm_session_open("elm-ws", link);
+    if (s->session == 0) {
+        ws_link_close(link);
+        return false;
+    }
+    s->fd = fd;
+    return true;
+}
+
+size_t ws_data_cb(int fd, const char* data, size_t len)
+{
+    ws_session_t* s = ws_session_get(fd);
+    return s ? elm_session_push(s->session, data, len) : 0;
 }
 
 void ws_close_cb(int fd)
 {
     ESP_LOGI(TAG, "ws stop handle=%u", fd);
+    ws_session_t* s = ws_session_get(fd);
+    if (s == NULL) return;
+    elm_session_close(s->session);
+    s->fd = 0;
+    s->session = 0;
 }
 
 // -----------------------------  uart  -----------------------------
 
+size_t uart_link_tx_free(void* ctx)
+{
+    return uart_get_tx_free((uart_port_t)ctx);
+}
+
+// wait for the first char, then take what is buffered, 0 on timeout
+int uart_link_read(uart_port_t port, char* buf, size_t size, TickType_t ticks)
+{
+    int len = uart_read_bytes(port, (uint8_t*)buf, 1, ticks);
+    if (len <= 0) return len;
+    size_t buffered = 0;
+    uart_get_buffered_data_len(port, &buffered);
+    if (buffered > size - 1) buffered = size - 1;
+    if (buffered > 0) {
+        int more = uart_read_bytes(port, (uint8_t*)buf + 1, buffered, 0);
+        if (more > 0) len += more;
+    }
+    return len;
+}
+
 void uart_task(void* param)
 {
     uart_port_t port = (uart_port_t)param;
     ESP_LOGI(TAG, "uart task started port=%u", port);
 
-    ESP_ERROR_CHECK(uart_driver_install(port, 256, 2048, 0, NULL, 0));
-
-    stdin  = uart_fopen(port, "r");
-    stdout = uart_fopen(port, "w");
+    ESP_ERROR_CHECK(uart_driver_install(port, 256, UART_TX_SIZE, 0, NULL, 0));
 
-    elog_out_set(stdout);
+    FILE* out = uart_fopen(port, "w");
+    elog_out_set(out);
     elog_level_set("*", ESP_LOG_WARN);
 
-    /* Disable buffering on stdin */
-    setvbuf(stdin, NULL, _IONBF, 0);
-
-    elm_do("elm-uart");
-
-    ESP_LOGI(TAG, "uart task ended port=%u", port);
-    fclose(stdin);
-    fclose(stdout);
+    uint32_t baudrate = 0;
+    uart_get_baudrate(port, &baudrate);
+    main_link_t link = {
+        .link = {
+            .ctx = (void*)port,
+            .tx_size = UART_TX_SIZE,
+            .tx_free = uart_link_tx_free,
+            .rate = baudrate / 10, // 8N1
+            .out = out,
+            .binary = true,
+            .close = main_link_close},
+        .task = xTaskGetCurrentTaskHandle()};
+
+    // a new session when the previous one ends (ctrl-D)
+    while (true) {
+        uint32_t session = elm_session_open("elm-uart", &link.link);
+        if (session == 0) break;
+
+        // what the session did not take is pushed again before reading more,
+        // the rest waits in the driver rx buffer
+        char buf[128];
+        size_t pos = 0;
+        size_t len = 0;
+        while (ulTaskNotifyTake(pdTRUE, 0) == 0) {
+            if (len == 0) {
+                int read = uart_link_read(port, buf, sizeof(buf), pdMS_TO_TICKS(UART_LINK_POLL_MS));
+                if (read <= 0) continue;
+                pos = 0;
+                len = read;
+            }
+            else
+                vTaskDelay(1);
+            size_t rest = elm_session_push(session, buf + pos, len);
+            pos += len - rest;
+            len = rest;
+        }
+        ESP_LOGI(TAG, "uart session ended port=%u", port);
+    }
+    ESP_LOGE(TAG, "uart task ended port=%u", port);
 }
 
 void uart_start(uart_port_t port)
@@ -182,14 +423,14 @@ void app_main()
 
     can_init();
 
-    bt_init(bt_open_cb, bt_close_cb);
+    elm_init();
 
-    wifi_init(tcp_open_cb);
+    bt_init(bt_open_cb, bt_close_cb, bt_data_cb);
 
-    net_httpd_ws_init(ws_open_cb, ws_close_cb);
+    wifi_init(tcp_open_cb, tcp_close_cb, tcp_data_cb);
 
-    // serial elm
-    while (true) {
-        uart_start(UART_NUM_0);
-    }
+    net_httpd_ws_init(ws_open_cb, ws_close_cb, ws_data_cb);
+
+    // serial elm, does not return
+    uart_start(UART_NUM_0);
 }
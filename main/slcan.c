@@ -0,0 +1,83 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "slcan.h"
+
+static const char slcan_hex_digits[] = "0123456789ABCDEF";
+
+static inline char* slcan_hex(char* p, uint32_t v, int digits)
+{
+    while (digits-- > 0)
+        *p++ = slcan_hex_digits[(v >> (4 * digits)) & 0xf];
+    return p;
+}
+
+size_t slcan_format(const can_message_t* msg, int32_t ts_ms, char* buf)
+{
+    char* p = buf;
+    uint8_t dlc = msg->data_length_code > 8 ? 8 : msg->data_length_code;
+    bool extd = msg->extd || msg->identifier > CAN_STD_ID_MASK;
+
+    if (msg->rtr)
+        *p++ = extd ? 'R' : 'r';
+    else
+        *p++ = extd ? 'T' : 't';
+    p = slcan_hex(p, msg->identifier & (extd ? CAN_EXTD_ID_MASK : CAN_STD_ID_MASK), extd ? 8 : 3);
+    *p++ = '0' + dlc;
+    if (!msg->rtr) {
+        for (int i = 0; i < dlc; i++)
+            p = slcan_hex(p, msg->data[i], 2);
+    }
+    if (ts_ms >= 0) p = slcan_hex(p, ts_ms % 60000, 4);
+    *p++ = '\r';
+    return p - buf;
+}
+
+static bool slcan_is_hex(const char* c, int len)
+{
+    for (int i = 0; i < len; i++) {
+        bool digit = (c[i] >= '0' && c[i] <= '9') || (c[i] >= 'A' && c[i] <= 'F') || (c[i] >= 'a' && c[i] <= 'f');
+        if (!digit) return false;
+    }
+    return c[len] == 0;
+}
+
+bool slcan_is_cmd(const char* cmd)
+{
+    switch (cmd[0]) {
+    case 'O': // open
+    case 'L': // open listen only
+    case 'C': // close
+    case 'V': // version
+    case 'v':
+    case 'N': // serial number
+    case 'F': // status flags
+        return cmd[1] == 0;
+    case 'S': // bitrate
+        return cmd[1] >= '0' && cmd[1] <= '8' && cmd[2] == 0;
+    case 'Z': // timestamps
+        return (cmd[1] == '0' || cmd[1] == '1') && cmd[2] == 0;
+    case 's': // BTR0 BTR1
+        return slcan_is_hex(cmd + 1, 4);
+    case 'M': // acceptance code
+    case 'm': // acceptance mask
+        return slcan_is_hex(cmd + 1, 8);
+    }
+    return false;
+}
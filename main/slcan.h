@@ -0,0 +1,37 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "hal/can_types.h"
+
+// SLCAN (Lawicel) frames and commands, the session side is in elm.c
+//   t iii l dd.. [tttt] \r    11 bits ID
+//   T iiiiiiii l dd.. [tttt] \r    29 bits ID
+//   r/R: remote frame, no data; tttt: ms timestamp 0..EA5F, hexa
+
+#define SLCAN_LINE_LEN 32 // "T1FFFFFFF81122334455667788EA5F\r"
+#define SLCAN_OK "\r"
+#define SLCAN_ERROR "\a"
+
+// format msg in buf, ts_ms < 0 for no timestamp, return the length
+size_t slcan_format(const can_message_t* msg, int32_t ts_ms, char* buf);
+
+// true if cmd is a SLCAN setup command, to tell a SLCAN client from an ELM one
+bool slcan_is_cmd(const char* cmd);
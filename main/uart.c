@@ -20,6 +20,36 @@
 
 #include "driver/gpio.h"
 #include "driver/uart.h"
+#include "esp_timer.h"
+
+#include "uart.h"
+
+// bytes in the driver tx buffer, drained at the baud rate since tx_us
+typedef struct {
+    size_t tx_pending;
+    int64_t tx_us;
+} uart_tx_t;
+
+static uart_tx_t uart_tx[UART_NUM_MAX];
+static portMUX_TYPE uart_tx_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// pending after the drain, written added
+static size_t _uart_tx_update(uart_port_t port, size_t written)
+{
+    uint32_t baudrate = 0;
+    uart_get_baudrate(port, &baudrate);
+    int64_t us = esp_timer_get_time();
+
+    uart_tx_t* tx = &uart_tx[port];
+    portENTER_CRITICAL(&uart_tx_mux);
+    uint64_t sent = (uint64_t)(us - tx->tx_us) * (baudrate / 10) / 1000000; // 8N1
+    tx->tx_pending = sent >= tx->tx_pending ? 0 : tx->tx_pending - sent;
+    tx->tx_pending += written;
+    tx->tx_us = us;
+    size_t pending = tx->tx_pending;
+    portEXIT_CRITICAL(&uart_tx_mux);
+    return pending;
+}
 
 
 ssize_t _uart_read(void *cookie, char *buf, size_t size)
@@ -29,7 +59,9 @@ ssize_t _uart_read(void *cookie, char *buf, size_t size)
 
 ssize_t _uart_write(void *cookie, const char *buf, size_t size)
 {
-    return uart_write_bytes((uart_port_t)cookie, buf, size);
+    int len = uart_write_bytes((uart_port_t)cookie, buf, size);
+    if (len > 0) _uart_tx_update((uart_port_t)cookie, len);
+    return len;
 }
 
 static const cookie_io_functions_t  uart_cookie_func = {
@@ -44,3 +76,9 @@ FILE *uart_fopen(uart_port_t port, const char *mode)
     return fopencookie((void*)port, mode, uart_cookie_func);
 }
 
+size_t uart_get_tx_free(uart_port_t port)
+{
+    size_t pending = _uart_tx_update(port, 0);
+    return pending >= UART_TX_SIZE ? 0 : UART_TX_SIZE - pending;
+}
+
@@ -21,4 +21,8 @@
 
 #include "driver/uart.h"
 
+#define UART_TX_SIZE 2048 // driver tx buffer
+
 FILE *uart_fopen(uart_port_t port, const char *mode);
+// the driver has no free size in IDF 4.1: the written bytes drain at the baud rate
+size_t uart_get_tx_free(uart_port_t port);
@@ -0,0 +1,258 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/ringbuf.h"
+#include "freertos/task.h"
+
+#include "lwip/sockets.h"
+
+#include "can.h"
+#include "canbin.h"
+#include "udp.h"
+
+static const char* TAG = "udp";
+
+#define UDP_TASK_PRIO 4
+#define UDP_TASK_CORE 0
+#define UDP_RINGBUF_ITEMS 64
+#define UDP_POLL_MS 1000      // stop check while no frame
+#define UDP_PAYLOAD_MAX 1472  // 1500 MTU - IP - UDP headers
+#define UDP_HEADER_LEN 10
+#define UDP_VERSION 1
+#define UDP_RECORD_MAX (CANBIN_TS_LEN + 1 + 4 + 8)
+
+typedef struct {
+    struct sockaddr_in dest;
+    uint32_t interval_ms;
+    uint32_t ids[UDP_IDS_MAX];
+    int id_count; // 0 for all
+} udp_config_t;
+
+static udp_config_t udp_config = {.interval_ms = UDP_INTERVAL_MS_DEFAULT};
+static portMUX_TYPE udp_mux = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t udp_task_handle = NULL;
+static volatile bool udp_running = false;
+
+// totals since the start
+static volatile uint32_t udp_sends = 0;
+static volatile uint32_t udp_frames = 0;
+static volatile uint32_t udp_errors = 0;
+
+static bool _udp_id_test(const udp_config_t* config, uint32_t id)
+{
+    if (config->id_count == 0) return true;
+    for (int i = 0; i < config->id_count; i++) {
+        if (config->ids[i] == id) return true;
+    }
+    return false;
+}
+
+static void _udp_send(int sock, const udp_config_t* config, char* dgram, size_t len, uint32_t seq, uint16_t count)
+{
+    char* p = dgram;
+    *p++ = 'C';
+    *p++ = 'B';
+    *p++ = UDP_VERSION;
+    *p++ = 0;
+    for (int i = 0; i < 4; i++)
+        *p++ = (seq >> (8 * i)) & 0xff;
+    *p++ = count & 0xff;
+    *p++ = count >> 8;
+
+    if (sendto(sock, dgram, len, 0, (const struct sockaddr*)&config->dest, sizeof(config->dest)) < 0) {
+        // the listeners see the gap in seq
+        udp_errors++;
+        ESP_LOGD(TAG, "sendto errno %d: %s", errno, strerror(errno));
+        return;
+    }
+    udp_sends++;
+    udp_frames += count;
+}
+
+static void _udp_stat(uint32_t* stat_us, uint32_t* stat_sends, uint32_t* stat_frames, uint32_t us)
+{
+    uint32_t time_us = us - *stat_us;
+    if (time_us < 10 * 1000000) return;
+    uint32_t sends = udp_sends - *stat_sends;
+    if (sends > 0) {
+        float time_s = (float)time_us / 1000000;
+        ESP_LOGI(TAG, "udp stat: sends=%i/s frames=%i/s avg=%u frames errors=%u",
+                 (int)(sends / time_s),
+                 (int)((udp_frames - *stat_frames) / time_s),
+                 (udp_frames - *stat_frames) / sends,
+                 udp_errors);
+    }
+    *stat_sends = udp_sends;
+    *stat_frames = udp_frames;
+    *stat_us = us;
+}
+
+static void udp_task(void* param)
+{
+    static char dgram[UDP_PAYLOAD_MAX];
+    RingbufHandle_t rx = can_ringbuf_new(UDP_RINGBUF_ITEMS);
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (rx == NULL || sock < 0) {
+        ESP_LOGE(TAG, "no ringbuf or socket, errno %d", errno);
+        goto _end;
+    }
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+    uint8_t ttl = 1; // local network only
+    setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    udp_config_t config;
+    size_t len = 0; // 0 if no datagram is started
+    uint16_t count = 0;
+    uint32_t seq = 0;
+    uint32_t first_us = 0;
+    uint64_t ts_last = 0;
+    uint32_t stat_us = esp_timer_get_time();
+    uint32_t stat_sends = udp_sends;
+    uint32_t stat_frames = udp_frames;
+
+    while (udp_running) {
+        portENTER_CRITICAL(&udp_mux);
+        config = udp_config;
+        portEXIT_CRITICAL(&udp_mux);
+
+        // wait for a frame, or the end of the batch
+        uint32_t wait_ms = UDP_POLL_MS;
+        if (len > 0) {
+            uint32_t age_ms = ((uint32_t)esp_timer_get_time() - first_us) / 1000;
+            wait_ms = age_ms < config.interval_ms ? config.interval_ms - age_ms : 0;
+        }
+        if (wait_ms > 0) ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait_ms) + 1);
+
+        size_t size;
+        can_message_timestamp_t* msg;
+        while ((msg = xRingbufferReceive(rx, &size, 0)) != NULL) {
+            if (_udp_id_test(&config, msg->msg.identifier)) {
+                if (len + UDP_RECORD_MAX > UDP_PAYLOAD_MAX) {
+                    _udp_send(sock, &config, dgram, len, seq++, count);
+                    len = 0;
+                }
+                if (len == 0) {
+                    len = UDP_HEADER_LEN;
+                    count = 0;
+                    first_us = esp_timer_get_time();
+                }
+                len += canbin_format_ts(msg->timestamp, &ts_last, count == 0, dgram + len);
+                len += canbin_format(&msg->msg, dgram + len);
+                count++;
+            }
+            vRingbufferReturnItem(rx, msg);
+        }
+
+        uint32_t us = esp_timer_get_time();
+        if (len > 0 && us - first_us >= config.interval_ms * 1000) {
+            _udp_send(sock, &config, dgram, len, seq++, count);
+            len = 0;
+        }
+        _udp_stat(&stat_us, &stat_sends, &stat_frames, us);
+    }
+
+_end:
+    ESP_LOGI(TAG, "udp task ended");
+    can_ringbuf_del(rx);
+    if (sock >= 0) close(sock);
+    udp_task_handle = NULL;
+    vTaskDelete(NULL);
+}
+
+bool udp_start(const char* addr, uint16_t port)
+{
+    struct sockaddr_in dest = {0};
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &dest.sin_addr) != 1) {
+        ESP_LOGW(TAG, "bad address '%s'", addr);
+        return false;
+    }
+    portENTER_CRITICAL(&udp_mux);
+    udp_config.dest = dest;
+    portEXIT_CRITICAL(&udp_mux);
+    ESP_LOGI(TAG, "udp to %s:%u", addr, port);
+
+    if (udp_running) return true;
+    // a stopping task ends within its poll
+    for (int i = 0; udp_task_handle != NULL && i < UDP_POLL_MS / 10 + 10; i++)
+        vTaskDelay(pdMS_TO_TICKS(10));
+    if (udp_task_handle != NULL) return false;
+
+    udp_running = true;
+    if (xTaskCreatePinnedToCore(udp_task, "udp", 3 * 1024, NULL, UDP_TASK_PRIO, &udp_task_handle, UDP_TASK_CORE) != pdPASS) {
+        ESP_LOGE(TAG, "udp task not created");
+        udp_running = false;
+        udp_task_handle = NULL;
+        return false;
+    }
+    return true;
+}
+
+void udp_stop()
+{
+    udp_running = false;
+    TaskHandle_t task = udp_task_handle;
+    if (task) xTaskNotifyGive(task);
+}
+
+void udp_set_interval(uint32_t ms)
+{
+    portENTER_CRITICAL(&udp_mux);
+    udp_config.interval_ms = ms;
+    portEXIT_CRITICAL(&udp_mux);
+}
+
+bool udp_set_ids(const uint32_t* ids, int count)
+{
+    if (count < 0 || count > UDP_IDS_MAX) return false;
+    portENTER_CRITICAL(&udp_mux);
+    memcpy(udp_config.ids, ids, count * sizeof(*ids));
+    udp_config.id_count = count;
+    portEXIT_CRITICAL(&udp_mux);
+    return true;
+}
+
+void udp_status()
+{
+    udp_config_t config;
+    portENTER_CRITICAL(&udp_mux);
+    config = udp_config;
+    portEXIT_CRITICAL(&udp_mux);
+
+    char addr[16];
+    inet_ntop(AF_INET, &config.dest.sin_addr, addr, sizeof(addr));
+    printf("udp %s %s:%u every %u ms, %u sends %u frames %u errors\n",
+           udp_running ? "on" : "off", addr, ntohs(config.dest.sin_port), config.interval_ms,
+           udp_sends, udp_frames, udp_errors);
+    if (config.id_count == 0) {
+        printf("  all IDs\n");
+        return;
+    }
+    printf("  IDs");
+    for (int i = 0; i < config.id_count; i++)
+        printf(" %03X", config.ids[i]);
+    printf("\n");
+}
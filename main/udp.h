@@ -0,0 +1,38 @@
+// Copyright 2021 Pascal Akermann
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// CAN frames to a multicast or broadcast address, one send per batch for
+// any number of listeners; a datagram is a header and CANBIN records
+// (canbin.h), the first one with the absolute time, little endian
+//   header: 'C' 'B' version 00 seq[4] count[2]
+
+#define UDP_PORT_DEFAULT 35001
+#define UDP_INTERVAL_MS_DEFAULT 20
+#define UDP_IDS_MAX 32
+
+// start, or change the destination, false on a bad address
+bool udp_start(const char* addr, uint16_t port);
+void udp_stop();
+// batch interval, the datagram is sent earlier when full
+void udp_set_interval(uint32_t ms);
+// IDs sent, all if count is 0, false if too many
+bool udp_set_ids(const uint32_t* ids, int count);
+void udp_status();
@@ -20,8 +20,11 @@
 #include "esp_err.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#include "freertos/ringbuf.h"
+#include "freertos/semphr.h"
 
 #include "esp_netif.h"
 #include "esp_sntp.h"
@@ -50,6 +53,7 @@ static EventGroupHandle_t wifi_event_group;
 static const int WIFI_AP_STARTED_BIT = BIT0;
 static const int WIFI_STA_CONNECTING_BIT = BIT1;
 static const int WIFI_STA_CONNECTED_BIT = BIT2;
+static const int WIFI_TCP_STOPPED_BIT = BIT3;
 
 static const char* second_chan_str[] = {"NONE", "ABOVE", "BELOW"};
 static const int second_chan_str_count = sizeof(second_chan_str) / sizeof(*second_chan_str);
@@ -65,43 +69,143 @@ static const int wifi_event_str_count = sizeof(wifi_event_str) / sizeof(*wifi_ev
 #define WIFI_TCP_PORT 35000
 #define WIFI_TCP_TASK_PRIO 4
 #define WIFI_TCP_TASK_CORE 1 // tskNO_AFFINITY
-
-static wifi_cb_t wifi_cb = NULL;
+#define WIFI_TCP_TX_SIZE (8 * 1024)
+#define WIFI_TCP_RX_LEN 128
+#define WIFI_TCP_MSS CONFIG_LWIP_TCP_MSS
+#define WIFI_TCP_BATCH_US 2000 // wait for a full segment, no Nagle
+#define WIFI_TCP_STOP_MS 1000  // the server frees its clients and ends
+
+// a tcp client; the server task owns the socket, the sessions write to
+// the tx ring and never block on a slow client
+typedef struct {
+    int sock; // -1 if free
+    RingbufHandle_t tx_buffer;
+    uint8_t* tx_item; // received from tx_buffer, partly sent
+    size_t tx_item_len;
+    size_t tx_item_sent;
+    uint32_t tx_first_us; // oldest byte in tx_buffer, 0 if empty
+    bool peer_closed;     // recv ended, close_cb called
+    char rx_buf[WIFI_TCP_RX_LEN];
+    size_t rx_len;        // received, 0 once all taken by data_cb
+    size_t rx_taken;
+    bool released;        // tcp_close called, close once the tx is sent
+    // stat
+    uint32_t size;
+    uint32_t sends;
+    uint32_t latency_us; // sum, write to send
+    uint32_t latency_max_us;
+    uint32_t stat_us;
+} wifi_tcp_conn_t;
+
+static wifi_tcp_cb_t wifi_tcp_open_cb = NULL;
+static wifi_tcp_cb_t wifi_tcp_close_cb = NULL;
+static wifi_tcp_data_cb_t wifi_tcp_data_cb = NULL;
 static TaskHandle_t wifi_tcp_server_handle = NULL;
 static int wifi_tcp_server_listen_sock = -1;
+static int wifi_tcp_wake_sock = -1; // loopback udp, wakes the server select
+static volatile bool wifi_tcp_wake_pending = false;
+static volatile bool wifi_tcp_server_stop = false; // the server ends on the next wake
+static SemaphoreHandle_t wifi_tcp_mutex = NULL; // conn table
+static wifi_tcp_conn_t wifi_tcp_conn[WIFI_TCP_CONN_MAX];
 
 
-// -----------------------------  tcp cookie io functions  -----------------------------
+// -----------------------------  tcp conn  -----------------------------
 
-ssize_t _tcp_read(void *cookie, char *buf, size_t size)
+// conn of sock, NULL if none, with wifi_tcp_mutex
+static wifi_tcp_conn_t* _tcp_conn_get(int sock)
 {
-    int soc = (int)cookie;
-    return recv(soc, buf, size, 0);
+    if (sock < 0) return NULL;
+    for (int i = 0; i < WIFI_TCP_CONN_MAX; i++) {
+        if (wifi_tcp_conn[i].sock == sock) return &wifi_tcp_conn[i];
+    }
+    return NULL;
 }
 
-ssize_t _tcp_write(void *cookie, const char *buf, size_t size)
+static void _tcp_wake()
 {
-    int soc = (int)cookie;
-    size_t to_write = size;
-    while (to_write > 0) {
-        int written = send(soc, buf + (size - to_write), to_write, 0);
-        if (written < 0) {
-            // ESP_LOGE(TAG, "Error occurred during sending: socket=%d errno %d: %s", socket, errno, strerror(errno));
-            return -1;
+    if (wifi_tcp_wake_pending || wifi_tcp_wake_sock < 0) return;
+    wifi_tcp_wake_pending = true;
+    send(wifi_tcp_wake_sock, "", 1, 0);
+}
+
+size_t tcp_write(int sock, const void* buf, size_t count)
+{
+    if (buf == NULL || count == 0) return 0;
+    bool wake = false;
+    xSemaphoreTake(wifi_tcp_mutex, portMAX_DELAY);
+    wifi_tcp_conn_t* conn = _tcp_conn_get(sock);
+    BaseType_t done = conn && !conn->released && xRingbufferSend(conn->tx_buffer, buf, count, 0);
+    if (done) {
+        // the server waits for a segment or the batch deadline
+        size_t pending = WIFI_TCP_TX_SIZE - xRingbufferGetCurFreeSize(conn->tx_buffer);
+        if (conn->tx_first_us == 0) {
+            conn->tx_first_us = esp_timer_get_time() | 1;
+            wake = true;
         }
-        to_write -= written;
+        wake = wake || (pending >= WIFI_TCP_MSS && pending - count < WIFI_TCP_MSS);
+    }
+    xSemaphoreGive(wifi_tcp_mutex);
+    if (conn == NULL) {
+        errno = EBADF;
+        return -1;
+    }
+    if (!done) {
+        ESP_LOGW(TAG, "tcp tx buffer full socket=%d", sock);
+        errno = EAGAIN;
+        return -1;
+    }
+    if (wake) _tcp_wake();
+    return count;
+}
+
+void tcp_rx_resume(int sock)
+{
+    _tcp_wake();
+}
+
+int tcp_close(int sock)
+{
+    xSemaphoreTake(wifi_tcp_mutex, portMAX_DELAY);
+    wifi_tcp_conn_t* conn = _tcp_conn_get(sock);
+    if (conn) conn->released = true;
+    xSemaphoreGive(wifi_tcp_mutex);
+    if (conn == NULL) {
+        errno = EBADF;
+        return -1;
     }
-    return size;
+    _tcp_wake();
+    return 0;
+}
+
+size_t tcp_get_tx_free(int sock)
+{
+    size_t free = 0;
+    xSemaphoreTake(wifi_tcp_mutex, portMAX_DELAY);
+    wifi_tcp_conn_t* conn = _tcp_conn_get(sock);
+    if (conn) free = xRingbufferGetCurFreeSize(conn->tx_buffer);
+    xSemaphoreGive(wifi_tcp_mutex);
+    return free;
+}
+
+size_t tcp_get_tx_size(int sock)
+{
+    return WIFI_TCP_TX_SIZE;
+}
+
+// -----------------------------  tcp cookie io functions  -----------------------------
+
+ssize_t _tcp_write(void *cookie, const char *buf, size_t size)
+{
+    return tcp_write((int)cookie, buf, size);
 }
 
 int _tcp_close(void *cookie)
 {
-    int soc = (int)cookie;
-    return close(soc);
+    return tcp_close((int)cookie);
 }
 
 static const cookie_io_functions_t tcp_cookie_func = {
-    .read  = _tcp_read,
+    .read  = NULL,
     .write = _tcp_write,
     .seek  = NULL,
     .close = _tcp_close
@@ -115,12 +219,195 @@ FILE *tcp_fopen(int sock, const char *mode)
 
 // -----------------------------  wifi_handler  -----------------------------
 
+static void _tcp_conn_accept(int sock)
+{
+    wifi_tcp_conn_t* conn = NULL;
+    for (int i = 0; i < WIFI_TCP_CONN_MAX && conn == NULL; i++) {
+        if (wifi_tcp_conn[i].sock < 0) conn = &wifi_tcp_conn[i];
+    }
+    if (conn == NULL) {
+        ESP_LOGE(TAG, "no free tcp connexion, %d oppened (socket=%d)", WIFI_TCP_CONN_MAX, sock);
+        close(sock);
+        return;
+    }
+    if (conn->tx_buffer == NULL) conn->tx_buffer = xRingbufferCreate(WIFI_TCP_TX_SIZE, RINGBUF_TYPE_BYTEBUF);
+    if (conn->tx_buffer == NULL) {
+        ESP_LOGE(TAG, "no mem for tcp tx buffer (socket=%d)", sock);
+        close(sock);
+        return;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    // the server batches the segments itself
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    xSemaphoreTake(wifi_tcp_mutex, portMAX_DELAY);
+    conn->tx_item = NULL;
+    conn->tx_first_us = 0;
+    conn->rx_len = 0;
+    conn->size = 0;
+    conn->sends = 0;
+    conn->latency_us = 0;
+    conn->latency_max_us = 0;
+    conn->stat_us = esp_timer_get_time();
+    conn->peer_closed = false;
+    conn->released = false;
+    conn->sock = sock;
+    xSemaphoreGive(wifi_tcp_mutex);
+
+    if (wifi_tcp_open_cb) wifi_tcp_open_cb(sock);
+}
+
+static void _tcp_conn_free(wifi_tcp_conn_t* conn)
+{
+    int sock = conn->sock;
+    ESP_LOGI(TAG, "tcp connexion closed socket=%d", sock);
+    if (!conn->peer_closed && wifi_tcp_close_cb) wifi_tcp_close_cb(sock);
+
+    xSemaphoreTake(wifi_tcp_mutex, portMAX_DELAY);
+    if (conn->tx_item) vRingbufferReturnItem(conn->tx_buffer, conn->tx_item);
+    conn->tx_item = NULL;
+    conn->tx_first_us = 0;
+    // drop what is left, the ring is kept for the next client
+    size_t size;
+    void* data;
+    while ((data = xRingbufferReceiveUpTo(conn->tx_buffer, &size, 0, WIFI_TCP_TX_SIZE)) != NULL)
+        vRingbufferReturnItem(conn->tx_buffer, data);
+    conn->sock = -1;
+    xSemaphoreGive(wifi_tcp_mutex);
+
+    shutdown(sock, 0);
+    close(sock);
+}
+
+// what data_cb did not take is pushed again before the next recv
+static void _tcp_conn_read(wifi_tcp_conn_t* conn)
+{
+    int len = 0;
+    if (conn->rx_len == 0) {
+        len = recv(conn->sock, conn->rx_buf, sizeof(conn->rx_buf), 0);
+        if (len > 0) {
+            conn->rx_len = len;
+            conn->rx_taken = 0;
+        }
+    }
+    if (conn->rx_len > 0) {
+        size_t rest = 0;
+        if (wifi_tcp_data_cb) rest = wifi_tcp_data_cb(conn->sock, conn->rx_buf + conn->rx_taken, conn->rx_len - conn->rx_taken);
+        conn->rx_taken = conn->rx_len - rest;
+        if (rest == 0) conn->rx_len = 0;
+        return;
+    }
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+    // the session ends, the socket is closed when it releases it
+    ESP_LOGI(TAG, "tcp peer closed socket=%d", conn->sock);
+    conn->peer_closed = true;
+    if (wifi_tcp_close_cb) wifi_tcp_close_cb(conn->sock);
+}
+
+static void _tcp_conn_stat(wifi_tcp_conn_t* conn, uint32_t us)
+{
+    uint32_t time_us = us - conn->stat_us;
+    if (time_us < 10 * 1000000) return;
+    if (conn->sends > 0) {
+        float time_s = (float)time_us / 1000000;
+        ESP_LOGI(TAG, "tcp stat: socket=%d size=%uB %iB/s sends=%i/s avg=%uB latency avg=%.1fms max=%.1fms",
+                 conn->sock,
+                 conn->size,
+                 (int)(conn->size / time_s),
+                 (int)(conn->sends / time_s),
+                 conn->size / conn->sends,
+                 (float)conn->latency_us / conn->sends / 1000,
+                 (float)conn->latency_max_us / 1000);
+    }
+    conn->size = 0;
+    conn->sends = 0;
+    conn->latency_us = 0;
+    conn->latency_max_us = 0;
+    conn->stat_us = us;
+}
+
+// take the next batch: a full segment, or what is there once the oldest
+// byte waited WIFI_TCP_BATCH_US; false with the deadline in wait_us if none
+static bool _tcp_conn_take(wifi_tcp_conn_t* conn, uint32_t us, uint32_t* wait_us)
+{
+    bool take = false;
+    xSemaphoreTake(wifi_tcp_mutex, portMAX_DELAY);
+    if (conn->tx_first_us != 0) {
+        size_t pending = WIFI_TCP_TX_SIZE - xRingbufferGetCurFreeSize(conn->tx_buffer);
+        uint32_t age_us = us - conn->tx_first_us;
+        take = pending >= WIFI_TCP_MSS || age_us >= WIFI_TCP_BATCH_US || conn->released;
+        if (take) {
+            conn->tx_item = xRingbufferReceiveUpTo(conn->tx_buffer, &conn->tx_item_len, 0, WIFI_TCP_TX_SIZE);
+            conn->tx_item_sent = 0;
+            if (conn->tx_item) {
+                conn->latency_us += age_us;
+                if (conn->latency_max_us < age_us) conn->latency_max_us = age_us;
+            }
+            // the rest (ring wrap) is sent right after
+            bool empty = xRingbufferGetCurFreeSize(conn->tx_buffer) == WIFI_TCP_TX_SIZE;
+            conn->tx_first_us = empty ? 0 : (us - WIFI_TCP_BATCH_US) | 1;
+        }
+        else if (WIFI_TCP_BATCH_US - age_us < *wait_us) {
+            *wait_us = WIFI_TCP_BATCH_US - age_us;
+        }
+    }
+    xSemaphoreGive(wifi_tcp_mutex);
+    return take && conn->tx_item != NULL;
+}
+
+// send what the socket takes, return true if some tx is left
+static bool _tcp_conn_send(wifi_tcp_conn_t* conn, uint32_t us, uint32_t* wait_us)
+{
+    while (true) {
+        if (conn->tx_item == NULL && !_tcp_conn_take(conn, us, wait_us)) {
+            _tcp_conn_stat(conn, us);
+            return conn->tx_first_us != 0;
+        }
+        int sent = send(conn->sock, conn->tx_item + conn->tx_item_sent, conn->tx_item_len - conn->tx_item_sent, 0);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+            ESP_LOGW(TAG, "tcp send error socket=%d errno %d: %s", conn->sock, errno, strerror(errno));
+            // drop the tx, and end the session
+            if (!conn->peer_closed) {
+                conn->peer_closed = true;
+                if (wifi_tcp_close_cb) wifi_tcp_close_cb(conn->sock);
+            }
+            vRingbufferReturnItem(conn->tx_buffer, conn->tx_item);
+            conn->tx_item = NULL;
+            return false;
+        }
+        conn->tx_item_sent += sent;
+        conn->size += sent;
+        conn->sends++;
+        if (conn->tx_item_sent < conn->tx_item_len) return true;
+        vRingbufferReturnItem(conn->tx_buffer, conn->tx_item);
+        conn->tx_item = NULL;
+    }
+}
+
+static int _tcp_wake_open()
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (sock < 0) return -1;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK), .sin_port = 0};
+    socklen_t addr_len = sizeof(addr);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        getsockname(sock, (struct sockaddr*)&addr, &addr_len) != 0 ||
+        connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    return sock;
+}
+
 static void wifi_tcp_server_task(void *pvParameters)
 {
     char addr_str[128];
     int addr_family;
     int ip_protocol;
-    int sock = -1;
 
     ESP_LOGI(TAG, "tcp server started");
 
@@ -135,8 +422,7 @@ static void wifi_tcp_server_task(void *pvParameters)
     wifi_tcp_server_listen_sock = socket(addr_family, SOCK_STREAM, ip_protocol);
     if (wifi_tcp_server_listen_sock < 0) {
         ESP_LOGE(TAG, "Unable to create socket: errno %d: %s", errno, strerror(errno));
-        vTaskDelete(NULL);
-        return;
+        goto CLEAN_UP;
     }
     ESP_LOGI(TAG, "Socket created");
 
@@ -147,48 +433,94 @@ static void wifi_tcp_server_task(void *pvParameters)
     }
     ESP_LOGI(TAG, "Socket bound, port %d", WIFI_TCP_PORT);
 
-    err = listen(wifi_tcp_server_listen_sock, 1);
+    err = listen(wifi_tcp_server_listen_sock, WIFI_TCP_CONN_MAX);
     if (err != 0) {
         ESP_LOGE(TAG, "Error occurred during listen: %s errno %d: %s", addr_str, errno, strerror(errno));
         goto CLEAN_UP;
     }
 
-    while (1) {
-
-        ESP_LOGI(TAG, "Socket listening, port %d", WIFI_TCP_PORT);
+    wifi_tcp_wake_sock = _tcp_wake_open();
+    if (wifi_tcp_wake_sock < 0) {
+        ESP_LOGE(TAG, "Unable to create wake socket: errno %d: %s", errno, strerror(errno));
+        goto CLEAN_UP;
+    }
+    ESP_LOGI(TAG, "Socket listening, port %d", WIFI_TCP_PORT);
+
+    // one task for all the clients: accept, read, and send the tx rings
+    uint32_t wait_us = UINT32_MAX; // next batch deadline
+    while (!wifi_tcp_server_stop) {
+        fd_set rfds;
+        fd_set wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        int max_sock = wifi_tcp_server_listen_sock > wifi_tcp_wake_sock ? wifi_tcp_server_listen_sock : wifi_tcp_wake_sock;
+        FD_SET(wifi_tcp_server_listen_sock, &rfds);
+        FD_SET(wifi_tcp_wake_sock, &rfds);
+        for (int i = 0; i < WIFI_TCP_CONN_MAX; i++) {
+            wifi_tcp_conn_t* conn = &wifi_tcp_conn[i];
+            if (conn->sock < 0) continue;
+            if (!conn->peer_closed && conn->rx_len == 0) FD_SET(conn->sock, &rfds);
+            if (conn->tx_item) FD_SET(conn->sock, &wfds);
+            if (conn->sock > max_sock) max_sock = conn->sock;
+        }
 
-        struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
-        uint addr_len = sizeof(source_addr);
-        sock = accept(wifi_tcp_server_listen_sock, (struct sockaddr *)&source_addr, &addr_len);
-        if (sock < 0) {
-            ESP_LOGE(TAG, "Unable to accept connection: errno %d: %s", errno, strerror(errno));
+        struct timeval timeout = {.tv_sec = 0, .tv_usec = wait_us};
+        err = select(max_sock + 1, &rfds, &wfds, NULL, wait_us == UINT32_MAX ? NULL : &timeout);
+        if (err < 0) {
+            if (errno == EINTR) continue;
+            ESP_LOGE(TAG, "tcp select error errno %d: %s", errno, strerror(errno));
             break;
         }
 
-        // Convert ip address to string
-        if (source_addr.sin6_family == PF_INET) {
-            inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-        } else if (source_addr.sin6_family == PF_INET6) {
-            inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
+        if (FD_ISSET(wifi_tcp_wake_sock, &rfds)) {
+            char buf[16];
+            wifi_tcp_wake_pending = false;
+            while (recv(wifi_tcp_wake_sock, buf, sizeof(buf), 0) > 0)
+                ;
         }
-        ESP_LOGI(TAG, "Socket accepted ip address: %s socket %d", addr_str, sock);
+        if (wifi_tcp_server_stop) break;
+
+        if (FD_ISSET(wifi_tcp_server_listen_sock, &rfds)) {
+            struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
+            uint addr_len = sizeof(source_addr);
+            int sock = accept(wifi_tcp_server_listen_sock, (struct sockaddr *)&source_addr, &addr_len);
+            if (sock < 0) {
+                ESP_LOGE(TAG, "Unable to accept connection: errno %d: %s", errno, strerror(errno));
+                break;
+            }
 
-        if (wifi_cb) wifi_cb(sock);
+            // Convert ip address to string
+            if (source_addr.sin6_family == PF_INET) {
+                inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
+            } else if (source_addr.sin6_family == PF_INET6) {
+                inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
+            }
+            ESP_LOGI(TAG, "Socket accepted ip address: %s socket %d", addr_str, sock);
+            _tcp_conn_accept(sock);
+        }
 
-        shutdown(sock, 0);
-        close(sock);
-        sock = -1;
+        uint32_t us = esp_timer_get_time();
+        wait_us = UINT32_MAX;
+        for (int i = 0; i < WIFI_TCP_CONN_MAX; i++) {
+            wifi_tcp_conn_t* conn = &wifi_tcp_conn[i];
+            if (conn->sock < 0) continue;
+            if (!conn->peer_closed && (conn->rx_len > 0 || FD_ISSET(conn->sock, &rfds))) _tcp_conn_read(conn);
+            bool pending = _tcp_conn_send(conn, us, &wait_us);
+            if (conn->released && !pending) _tcp_conn_free(conn);
+        }
     }
 
 CLEAN_UP:
     ESP_LOGI(TAG, "tcp server stoped");
-    if (sock >= 0) {
-        shutdown(sock, 0);
-        close(sock);
+    for (int i = 0; i < WIFI_TCP_CONN_MAX; i++) {
+        if (wifi_tcp_conn[i].sock >= 0) _tcp_conn_free(&wifi_tcp_conn[i]);
     }
-    close(wifi_tcp_server_listen_sock);
+    if (wifi_tcp_wake_sock >= 0) close(wifi_tcp_wake_sock);
+    wifi_tcp_wake_sock = -1;
+    if (wifi_tcp_server_listen_sock >= 0) close(wifi_tcp_server_listen_sock);
     wifi_tcp_server_listen_sock = -1;
     wifi_tcp_server_handle = NULL;
+    xEventGroupSetBits(wifi_event_group, WIFI_TCP_STOPPED_BIT);
     vTaskDelete(NULL);
 }
 
@@ -201,21 +533,21 @@ void _wifi_servers_start()
         return;
     }
 
+    wifi_tcp_server_stop = false;
+    xEventGroupClearBits(wifi_event_group, WIFI_TCP_STOPPED_BIT);
     xTaskCreatePinnedToCore(wifi_tcp_server_task, "tcp_server", 4096, NULL, WIFI_TCP_TASK_PRIO, &wifi_tcp_server_handle, WIFI_TCP_TASK_CORE);
 
     net_httpd_start();
 }
 
+// the tcp server ends itself: its clients are closed, with tcp_close_cb
 void _wifi_servers_stop()
 {
-    if (wifi_tcp_server_listen_sock >= 0) {
-        close(wifi_tcp_server_listen_sock);
-        wifi_tcp_server_listen_sock = -1;
-        vTaskDelay(100);
-    }
     if (wifi_tcp_server_handle) {
-        vTaskDelete(wifi_tcp_server_handle);
-        wifi_tcp_server_handle = NULL;
+        wifi_tcp_server_stop = true;
+        _tcp_wake();
+        int bits = xEventGroupWaitBits(wifi_event_group, WIFI_TCP_STOPPED_BIT, 0, 1, pdMS_TO_TICKS(WIFI_TCP_STOP_MS));
+        if ((bits & WIFI_TCP_STOPPED_BIT) == 0) ESP_LOGE(TAG, "tcp server not stopped after %ums", WIFI_TCP_STOP_MS);
     }
 
     net_httpd_stop();
@@ -380,13 +712,17 @@ esp_netif_t* teslap_esp_netif_create_default_wifi_ap(void)
     return netif;
 }
 
-void wifi_init(wifi_cb_t cb)
+void wifi_init(wifi_tcp_cb_t tcp_open_cb, wifi_tcp_cb_t tcp_close_cb, wifi_tcp_data_cb_t tcp_data_cb)
 {
     static bool initialized = false;
     if (initialized) return;
 
     ESP_LOGI(TAG, "Initialize wifi");
 
+    wifi_tcp_mutex = xSemaphoreCreateMutex();
+    for (int i = 0; i < WIFI_TCP_CONN_MAX; i++)
+        wifi_tcp_conn[i].sock = -1;
+
     wifi_mdns_init();
     wifi_netbios_init();
 
@@ -411,7 +747,9 @@ void wifi_init(wifi_cb_t cb)
     // ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_NULL) );
     initialized = true;
 
-    wifi_cb = cb;
+    wifi_tcp_open_cb = tcp_open_cb;
+    wifi_tcp_close_cb = tcp_close_cb;
+    wifi_tcp_data_cb = tcp_data_cb;
 
     // auto connect
     reconnect = true;
@@ -20,10 +20,15 @@
 #include <stdio.h>
 
 #define TESLAP_HOSTNAME "TeslapLX"
+#define WIFI_TCP_CONN_MAX 4 // concurrent tcp clients
 
-typedef void (*wifi_cb_t)(int sock);
+typedef void (*wifi_tcp_cb_t)(int sock);
+typedef size_t (*wifi_tcp_data_cb_t)(int sock, const char* data, size_t len); // bytes not taken
 
-void wifi_init(wifi_cb_t cb);
+// tcp clients are served by one task: the input is pushed to tcp_data_cb,
+// the socket is not read again until it took all, pushed again on tcp_rx_resume;
+// tcp_close_cb is called once when the peer closes or after tcp_close
+void wifi_init(wifi_tcp_cb_t tcp_open_cb, wifi_tcp_cb_t tcp_close_cb, wifi_tcp_data_cb_t tcp_data_cb);
 
 bool wifi_status();
 bool wifi_sta(char* ssid, char* password);
@@ -31,4 +36,12 @@ bool wifi_ap(char* ssid, char* password);
 bool wifi_stop();
 bool wifi_scan();
 
+// write to the client tx buffer, never blocks, -1 if full
+size_t tcp_write(int sock, const void *buf, size_t count);
+// close once the tx buffer is sent
+int tcp_close(int sock);
+void tcp_rx_resume(int sock);
+size_t tcp_get_tx_free(int sock);
+size_t tcp_get_tx_size(int sock);
+
 FILE *tcp_fopen(int sock, const char *mode);